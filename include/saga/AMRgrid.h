@@ -13,41 +13,178 @@
 
 #include "sqlite3/sqlite3.h"
 #include "saga/AMRcell.h"
+#include "saga/CellSet.h"
 #include "saga/LocalProperties.h"
+#include "saga/LevelPyramid.h"
+#include "saga/LinearOctree.h"
 #include "saga/SQLiteInterface.h"
 #include "saga/Referenced.h"
 
 
 namespace saga {
 
+/*********************************************************************************************************/
+// Interface for callers that consume the cells of a region one at a time, together with their properties.
+// visitCell returns false to stop the iteration.
+//
+class AMRcellVisitor
+{
+public:
+    virtual ~AMRcellVisitor() {}
+    virtual bool visitCell(AMRcell &cell, LocalProperties &properties) = 0;
+};
+
+/*********************************************************************************************************/
+// Cell crossed by a segment (see AMRgrid::traverseSegment), with the parametric positions t in [0,1] at
+// which the segment p0 + t (p1 - p0) enters and leaves it.
+//
+struct CellCrossing
+{
+    CellCrossing(const AMRcell &c, const LocalProperties &lp, double t0, double t1) : cell(c), properties(lp), tEntry(t0), tExit(t1) {}
+
+    AMRcell cell;
+    LocalProperties properties;
+    double tEntry;
+    double tExit;
+};
+
+/*********************************************************************************************************/
+// Options chosen when opening an AMRgrid.
+//   backend: SQLiteBackend queries the database for every lookup; OctreeBackend loads all cells once into
+//            an in-memory linear octree and answers every lookup without SQL; SnapshotBackend maps a
+//            binary snapshot of that octree (see ConvertToSnapshot) read-only and queries it in place.
+//   cellCacheSize: number of recently returned cells kept per thread to answer getLocalProperties without
+//            a query when consecutive points fall in the same cell (0 disables the cache).
+//   singlePrecision: with OctreeBackend, stores the density and the magnetic field as floats, halving their
+//            memory; values are then rounded to a relative error of at most 2^-24 (6e-8). A snapshot
+//            keeps the precision it was written with (see ConvertToSnapshot).
+//   levelOfDetail: builds the level-of-detail pyramid when the grid is opened (one pass over all cells),
+//            for the queries at a chosen maximum refinement level (see LevelPyramid).
+//   periodic: treats the unit cube as a periodic box: points are wrapped into it, and region and segment
+//            queries straddling its faces are split into at most 8 parts (one query each), merged without
+//            duplicates; the nearest cell across a face is chosen by the distance to its periodic image.
+//   prefetchThreads: with SQLiteBackend, number of background I/O threads fetching the regions announced by
+//            prefetch() and prefetchRegion(), whose cells then answer getLocalProperties without a query
+//            (see CellPrefetcher); 0 disables prefetching.
+//   prefetchRegions: number of most recently fetched regions kept.
+//   statistics: counts and times every SQL query, per kind of query and per connection (see getStatistics).
+//   sqlite: settings of the database connections (see SQLiteOpenOptions); with the octree backend they only
+//            apply while the cells are loaded.
+//
+struct AMRgridOptions
+{
+    enum Backend {
+        SQLiteBackend,
+        OctreeBackend,
+        SnapshotBackend
+    };
+
+    AMRgridOptions();
+
+    Backend backend;
+    int cellCacheSize;
+    bool singlePrecision;
+    bool levelOfDetail;
+    bool periodic;
+    int prefetchThreads;
+    int prefetchRegions;
+    bool statistics;
+    SQLiteOpenOptions sqlite;
+};
+
+class CellCache;
+class CellPrefetcher;
+
 class AMRgrid : public Referenced
 {
 public:
-    AMRgrid(std::string filename, int nRefinement);
+    AMRgrid(std::string filename, int nRefinement, AMRgridOptions options = AMRgridOptions());
     virtual ~AMRgrid();
 	
     void setMaxRefinementLevel(int nLevels);
     int getMaxRefinementLevel();
     void setMinCellSize(int nLevels);
     double getMinCellSize();
+    bool isPeriodic();
 
     std::vector<AMRcell> getCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    CellSet getCellSetRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, bool withProperties = false);
     std::vector<AMRcell> getNearestNeighbors(double x, double y, double z);
     AMRcell selectNearestNeighbor(double x, double y, double z);
+    AMRcell selectNearestNeighbor(double x, double y, double z, LocalProperties &lp);
     AMRcell getCellWithIndex(int idx);
     std::vector<LocalProperties> getLocalPropertiesRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    void visitCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, AMRcellVisitor &visitor);
+    void visitCellsIndexRange(long firstIndex, long lastIndex, double minDensity, AMRcellVisitor &visitor);
+    bool hasDensityAbove(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, double minDensity);
     LocalProperties getLocalProperties(double x, double y, double z);
     LocalProperties getLocalPropertiesFromIndex(int idx);
     double getDensity(double x, double y, double z);
     std::vector<double> getMagneticField(double x, double y, double z);
 
+    LocalProperties getLocalPropertiesAtLevel(double x, double y, double z, int level);
+    CellSet getCellSetRegionAtLevel(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, int level);
+    int getMaxLevelOfDetail();
+
+    std::vector<CellCrossing> traverseSegment(double x0, double y0, double z0, double x1, double y1, double z1);
+
+    void getLocalPropertiesBatch(const double *x, const double *y, const double *z, long n, double *rho, double *Bx, double *By, double *Bz);
+    void getMagneticFieldBatch(const double *x, const double *y, const double *z, long n, double *Bx, double *By, double *Bz);
+    void getDensityBatch(const double *x, const double *y, const double *z, long n, double *rho);
+    void getLocalPropertiesBatch(const double *x, const double *y, const double *z, long n, float *rho, float *Bx, float *By, float *Bz);
+    void getMagneticFieldBatch(const double *x, const double *y, const double *z, long n, float *Bx, float *By, float *Bz);
+    void getDensityBatch(const double *x, const double *y, const double *z, long n, float *rho);
+    std::vector<LocalProperties> getLocalPropertiesBatch(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &z);
+    std::vector<double> getMagneticFieldBatch(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &z);
+    std::vector<double> getDensityBatch(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &z);
+
     int getGridSize();
+
+    std::vector<SQLiteConnectionStatistics> getStatistics();
+    std::string getStatisticsJSON();
+    void resetStatistics();
+    static std::string getQueryKind(int kind);
+    unsigned long long getCellCacheHits();
+    unsigned long long getCellCacheMisses();
+    void resetCellCacheCounters();
+
+    void prefetch(double x, double y, double z, double dx, double dy, double dz, double distance);
+    void prefetchRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    void waitForPrefetch();
+    unsigned long long getPrefetchHits();
+    unsigned long long getPrefetchMisses();
     void close();
 	
 private:
+    // slots of the prepared statement cache of SQLiteDB
+    enum StatementSlot {
+        RegionStatement = 0,
+        CellStatement,
+        CellTreeStatement,
+        CountStatement,
+        RegionJoinStatement,
+        IndexRangeStatement,
+        DensityAboveStatement
+    };
+
+    SQLiteDB& database();
+    long selectNearestPosition(double x, double y, double z);
+    AMRcell selectNearestWithProperties(double x, double y, double z, LocalProperties &lp);
+    void getLocalPropertiesSorted(const double *x, const double *y, const double *z, const long *points, long n, LocalProperties *lp);
+    template<typename T> void localPropertiesBatch(const double *x, const double *y, const double *z, long n, T *rho, T *Bx, T *By, T *Bz);
+    AMRcell selectNearestPeriodic(double x, double y, double z, LocalProperties &lp);
+    std::vector<CellCrossing> traverseSegmentInCube(double x0, double y0, double z0, double x1, double y1, double z1);
+
     SQLiteDB *DB;
+    LinearOctree *octree;
+    LevelPyramid *pyramid;
+    CellCache *cellCache;
+    CellPrefetcher *prefetcher;
+    std::string indexRangeQuery;
+    std::string densityAboveQuery;
     int refinementLevel;
     double minCellSize;
+    bool periodic;
 
 };
 
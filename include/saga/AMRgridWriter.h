@@ -0,0 +1,73 @@
+#ifndef SAGA_AMRGRIDWRITER_H
+#define SAGA_AMRGRIDWRITER_H
+
+#include <string>
+#include <vector>
+
+#include "saga/CellSet.h"
+#include "saga/PackedRtree.h"
+#include "saga/Referenced.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Options chosen when creating a SAGA database with AMRgridWriter.
+//   batchSize: number of cells buffered before their rows are written.
+//   transactionSize: number of cells written per transaction; bounds the dirty pages SQLite keeps in
+//            memory, the journal being disabled.
+//   pageSize: page size of the database file in bytes (PRAGMA page_size), a power of 2 from 512 to 65536.
+//
+struct AMRgridWriterOptions
+{
+    AMRgridWriterOptions();
+
+    int batchSize;
+    long transactionSize;
+    int pageSize;
+};
+
+/*********************************************************************************************************/
+// Writes a SAGA database (tables Cell and Cell_tree) from cells given one by one or in batches.
+// Cells are numbered 1, 2, ... in the order they are added. Like those of any SAGA grid, they must be cubes
+// of size 2^-level aligned on the lattice of their level, which CellSet and the octree backends rely on.
+// Their values are buffered and written by prepared statements inserting many rows at once, in large
+// transactions without journal or sync; their bounds are kept and the R-tree is packed from all of them
+// when the writer is closed (see PackedRtree), which is far faster than inserting them one by one and
+// gives a better tree.
+// The file is only valid once close() has returned: a database left by a crash must be written again.
+// The destructor closes the writer if needed.
+//
+class AMRgridWriter : public Referenced
+{
+public:
+    AMRgridWriter(std::string filename, AMRgridWriterOptions options = AMRgridWriterOptions());
+    virtual ~AMRgridWriter();
+
+    long addCell(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, double rho, double Bx, double By, double Bz);
+    void addCells(long n, const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, const double *rho, const double *Bx, const double *By, const double *Bz);
+    void addCells(const CellSet &cells);
+
+    void flush();
+    void close();
+    long getNumberOfCells() const;
+
+private:
+    void execute(const char *sql);
+    void writeRows(long first, long n, sqlite3_stmt *statement);
+    void release();
+
+    AMRgridWriterOptions options;
+    sqlite3 *db;
+    sqlite3_stmt *insertRows;
+    sqlite3_stmt *insertRow;
+    std::vector<double> values;        // rho, Bx, By, Bz of the buffered cells
+    PackedRtree tree;
+    long nCells;
+    long nWritten;
+    long nInTransaction;
+};
+
+} // namespace
+
+#endif
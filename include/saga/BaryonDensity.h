@@ -2,6 +2,7 @@
 
 #include "saga/Referenced.h"
 #include "saga/AMRgrid.h"
+#include "saga/FieldInterpolator.h"
 
 #include <vector>
 #include <string>
@@ -14,10 +15,13 @@ namespace saga {
 class BaryonDensity: public Referenced {
 private:
 	ref_ptr<AMRgrid> TheGrid;
+	ref_ptr<FieldInterpolator> Interpolator;
 public:
-	BaryonDensity(ref_ptr<AMRgrid> grid);
-	virtual ~MagneticField();
-    std::vector<double> getDensity(double x, double y, double z) const;
+	BaryonDensity(ref_ptr<AMRgrid> grid, bool interpolate = false);
+	virtual ~BaryonDensity();
+	void setInterpolation(bool interpolate);
+	bool getInterpolation() const;
+    double getDensity(double x, double y, double z) const;
 };
 
 
@@ -0,0 +1,57 @@
+#ifndef SAGA_CELLCACHE_H
+#define SAGA_CELLCACHE_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include "saga/AMRcell.h"
+#include "saga/LocalProperties.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Hit and miss counters of one thread; written only by their thread, read by anyone.
+//
+struct CellCacheCounters
+{
+    CellCacheCounters() : hits(0), misses(0) {}
+    std::atomic<unsigned long long> hits;
+    std::atomic<unsigned long long> misses;
+};
+
+/*********************************************************************************************************/
+// Per-thread cache of the cells most recently returned by a grid, exploiting the locality of trajectories.
+// Each thread has its own entries, so lookups need no locking. A point is served from a cached cell only
+// if it lies in the serving box of the cell (see servingBox), so the answer is always the query's.
+//
+class CellCache
+{
+public:
+    CellCache(int nEntries);
+    ~CellCache();
+
+    bool lookup(double x, double y, double z, LocalProperties &lp);
+    void insert(AMRcell &cell, const LocalProperties &lp, double halfWidth);
+    static bool servingBox(AMRcell &cell, double halfWidth, double box[6]);
+
+    unsigned long long getHits() const;
+    unsigned long long getMisses() const;
+    void resetCounters();
+
+private:
+    struct Entry;
+    struct ThreadEntries;
+    ThreadEntries& local();
+
+    unsigned long id;
+    int size;
+    mutable std::mutex mutex;
+    std::vector<std::shared_ptr<CellCacheCounters> > counters;
+};
+
+} // namespace
+
+#endif
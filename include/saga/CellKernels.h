@@ -0,0 +1,27 @@
+#ifndef SAGA_CELLKERNELS_H
+#define SAGA_CELLKERNELS_H
+
+#include <string>
+#include <stdint.h>
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Kernels over columns of cells or points (see CellSet), used to select the cells around a point.
+// Each kernel has an AVX-512, an AVX2 and a scalar implementation; the widest one supported by the CPU is
+// selected the first time a kernel runs. All of them compute the same operations in the same order, so
+// their results are identical bit for bit: distances are sqrt(dx^2 + dy^2 + dz^2), as in
+// AMRcell::distanceToPoint, and box tests are inclusive, as in the R-tree queries.
+//
+void distancesToPoint(const double *cx, const double *cy, const double *cz, long n, double x, double y, double z, double *d);
+long selectNearestCentre(const double *cx, const double *cy, const double *cz, const int32_t *indices, long n, double x, double y, double z);
+void boxesOverlapBox(const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, long n, const double box[6], unsigned char *overlap);
+void pointsInBox(const double *x, const double *y, const double *z, long n, const double box[6], unsigned char *inside);
+
+std::string getKernelInstructionSet();
+void setKernelInstructionSet(std::string name);
+
+} // namespace
+
+#endif
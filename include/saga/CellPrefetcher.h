@@ -0,0 +1,87 @@
+#ifndef SAGA_CELLPREFETCHER_H
+#define SAGA_CELLPREFETCHER_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include "saga/AMRcell.h"
+#include "saga/LocalProperties.h"
+
+
+namespace saga {
+
+class AMRgrid;
+
+/*********************************************************************************************************/
+// Background fetching of the cells of regions the caller expects to reach, shared by all threads.
+// Requested regions are queued and fetched by a pool of I/O threads (one database connection each); the
+// most recent regions are kept, and the oldest are dropped. A point is served from a region only if the
+// neighbourhood searched by AMRgrid (a box of half width halfWidth around the point) lies inside it:
+// every cell overlapping the neighbourhood then belongs to the region, and the nearest one is selected
+// with the rule of the queries, so the answer is the same as theirs.
+// Requests are hints: one covered by a region already fetched or queued is ignored, and when the queue is
+// full the oldest pending request is dropped.
+// The list of fetched regions is published as an immutable snapshot, and each thread keeps the last one
+// it read until a newer one is published, so lookups take no lock.
+//
+class CellPrefetcher
+{
+public:
+    CellPrefetcher(AMRgrid *grid, int nThreads, int nRegions);
+    ~CellPrefetcher();
+
+    void request(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    bool covers(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    bool lookup(double x, double y, double z, double halfWidth, AMRcell &cell, LocalProperties &lp);
+    void wait();
+
+    unsigned long long getHits() const;
+    unsigned long long getMisses() const;
+    unsigned long long getFetchedRegions() const;
+    unsigned long long getDroppedRequests() const;
+    void resetCounters();
+
+private:
+    struct Region;
+    class RegionCollector;
+    typedef std::shared_ptr<const Region> RegionPtr;
+    typedef std::vector<RegionPtr> RegionList;
+    struct ThreadView;
+
+    void run();
+    static bool inside(const double *box, const double *outer);
+    bool coveredLocked(const double *box) const;
+    void publishLocked();
+    const RegionList& snapshot();
+
+    AMRgrid *grid;
+    int maxRegions;
+    size_t maxPending;
+    std::vector<std::thread> threads;
+
+    mutable std::mutex mutex;
+    std::condition_variable pending;
+    std::condition_variable idle;
+    std::deque<std::vector<double> > queue;
+    std::vector<std::vector<double> > running;
+    std::deque<RegionPtr> regions;      // most recent first
+    bool stopping;
+
+    unsigned long id;
+    std::shared_ptr<const RegionList> published;    // swapped atomically
+    std::atomic<unsigned long> version;
+
+    std::atomic<unsigned long long> hits;
+    std::atomic<unsigned long long> misses;
+    std::atomic<unsigned long long> fetched;
+    std::atomic<unsigned long long> dropped;
+};
+
+} // namespace
+
+#endif
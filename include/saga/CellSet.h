@@ -0,0 +1,79 @@
+#ifndef SAGA_CELLSET_H
+#define SAGA_CELLSET_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "saga/AMRcell.h"
+#include "saga/LocalProperties.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Compact encoding of a cell in 16 bytes. The cells of a SAGA grid are cubes of size 2^-level aligned
+// on the lattice of their level, so the Morton key of their integer coordinates at that level, the level
+// and the index give back every field of AMRcell exactly.
+//
+struct CompactCell
+{
+    uint64_t key;
+    int32_t index;
+    uint8_t level;
+
+    static int octreeLevel(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    static CompactCell encode(int index, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    static CompactCell fromCell(AMRcell &cell);
+    AMRcell toCell() const;
+};
+
+/*********************************************************************************************************/
+// Structure of arrays holding the cells returned by region queries, about 13 bytes per cell instead of
+// the 88 of an AMRcell, and 45 with the local properties. Searches in the set run the vector kernels of
+// CellKernels over the decoded centres or bounds.
+// getCell rebuilds an AMRcell from the compact encoding, for code written against the AMRcell getters.
+//
+class CellSet
+{
+public:
+    CellSet();
+    ~CellSet();
+
+    size_t size() const;
+    bool empty() const;
+    bool hasProperties() const;
+    void clear();
+    void reserve(size_t n, bool withProperties = false);
+    void push_back(const CompactCell &cell);
+    void push_back(const CompactCell &cell, LocalProperties lp);
+
+    CompactCell getCompactCell(size_t i) const;
+    AMRcell getCell(size_t i) const;
+    LocalProperties getLocalProperties(size_t i) const;
+    double getCellSize(size_t i) const;
+    void getCentres(double *x, double *y, double *z) const;
+    void getBounds(double *xmin, double *xmax, double *ymin, double *ymax, double *zmin, double *zmax) const;
+    long findNearest(double x, double y, double z) const;
+    void findInBox(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, std::vector<long> &positions) const;
+
+    const uint64_t* getKeys() const;
+    const uint8_t* getLevels() const;
+    const int32_t* getIndices() const;
+    const double* getDensities() const;
+    const double* getBx() const;
+    const double* getBy() const;
+    const double* getBz() const;
+
+private:
+    std::vector<uint64_t> keys;
+    std::vector<uint8_t> levels;
+    std::vector<int32_t> indices;
+    std::vector<double> rho;
+    std::vector<double> Bx;
+    std::vector<double> By;
+    std::vector<double> Bz;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SAGA_FIELDINTERPOLATOR_H
+#define SAGA_FIELDINTERPOLATOR_H
+
+#include <vector>
+
+#include "saga/Referenced.h"
+#include "saga/AMRgrid.h"
+#include "saga/LocalProperties.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Smooth reconstruction of the local properties from the cell-centred values of the grid.
+// For each refinement level l, the properties are interpolated trilinearly between the 8 nearest centres
+// of the lattice of cells of size 2^-l, each evaluated with the usual nearest-cell lookup; this gives a
+// continuous field per level. The levels of the cells at the 8 nearest centres of the finest lattice,
+// interpolated in the same way, give a continuous level at the point, and the fields of the two levels
+// around it are blended by its fractional part. Away from refinement boundaries the point is served by
+// its own level only, and across them the resolution changes over one finest cell, without a jump.
+// Near the boundary of the unit cube the stencils are clamped inside the grid, or wrapped around it if
+// the grid is periodic.
+// A stencil depends only on its level and lattice indices, so each thread reuses the stencils it used
+// last for as long as the point stays between the same centres; the lattice centres themselves are
+// served without a query when they fall in the serving box of a cell met recently (see CellCache).
+//
+class FieldInterpolator : public Referenced
+{
+public:
+    FieldInterpolator(ref_ptr<AMRgrid> grid, int nStencils = 4);
+    ~FieldInterpolator();
+
+    LocalProperties getLocalProperties(double x, double y, double z);
+
+private:
+    struct Stencil;
+    struct KnownCell;
+    struct ThreadStencils;
+    ThreadStencils& local();
+    Stencil& getStencil(ThreadStencils &t, int level, long i0, long j0, long k0);
+    void sampleCentre(ThreadStencils &t, double x, double y, double z, double values[4], int &level);
+
+    ref_ptr<AMRgrid> TheGrid;
+    unsigned long id;
+    int size;
+    int finestLevel;
+    bool periodic;
+};
+
+} // namespace
+
+#endif
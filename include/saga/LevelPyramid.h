@@ -0,0 +1,57 @@
+#ifndef SAGA_LEVELPYRAMID_H
+#define SAGA_LEVELPYRAMID_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "saga/CellSet.h"
+#include "saga/LinearOctree.h"
+#include "saga/LocalProperties.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Level-of-detail pyramid of the grid.
+// Level l holds every node of the octree at depth l that is either a leaf cell of the grid or the parent
+// of finer cells; the latter carry the plain average of their 8 children, which have equal volumes. Both
+// the density and the magnetic field are thus averaged weighted by volume: the density of a node is the
+// mass of its cells over its volume, so every level conserves the mass of the grid. A mass-weighted
+// density (sum of m rho over sum of m) would not, and is not what the nodes hold.
+// The nodes of a level are in Morton order and the 8 children of a node are stored consecutively at the
+// next level, so a query at level L descends from the root through at most L+1 nodes and never reads
+// anything finer.
+// Points are located geometrically: a point on a face between two nodes belongs to the upper one, except
+// on the upper boundary of the unit cube.
+//
+class LevelPyramid
+{
+public:
+    LevelPyramid();
+    ~LevelPyramid();
+
+    void build(const LinearOctree &octree);
+    int getMaxLevel() const;
+    long size() const;
+
+    CompactCell getCell(double x, double y, double z, int level, LocalProperties &lp) const;
+    void getCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, int level, CellSet &cells) const;
+
+private:
+    struct Level
+    {
+        std::vector<uint64_t> keys;
+        std::vector<int32_t> indices;      // index of the cell for leaves, -1 for parents
+        std::vector<int64_t> children;     // position of the first child at the next level, -1 for leaves
+        std::vector<double> rho, Bx, By, Bz;
+    };
+
+    void addNode(int level, uint64_t key, int32_t index, const LocalProperties &lp);
+    void findRegion(int level, long pos, const double *box, int maxLevel, CellSet &cells) const;
+
+    std::vector<Level> levels;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef SAGA_LINEAROCTREE_H
+#define SAGA_LINEAROCTREE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "saga/AMRcell.h"
+#include "saga/CellSet.h"
+#include "saga/LocalProperties.h"
+#include "saga/SQLiteInterface.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Header of the binary snapshot of a LinearOctree (native byte order).
+// The header is followed by the columns, each starting at a multiple of 8 bytes:
+//   keys         uint64[nCells]   Morton key of the minimum corner of each cell at level maxLevel, sorted
+//   cellIndices  int32[nCells]    index (rowid) of each cell in the SAGA database
+//   levels       uint8[nCells]    refinement level of each cell
+//   byCellIndex  int64[nCells]    positions sorted by cell index
+//   rho, Bx, By, Bz               valueBytes * nCells each: double (8) or float (4)
+//   directory    int64[8^directoryLevel + 1]   first position of each node at level directoryLevel
+//
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t nCells;
+    uint64_t fileSize;
+    uint32_t maxLevel;
+    uint32_t directoryLevel;
+    uint32_t valueBytes;
+    uint32_t reserved[5];
+};
+
+/*********************************************************************************************************/
+// Pointerless octree holding the leaf cells of the grid in memory.
+// Cells are stored in arrays sorted by the Morton key of their minimum corner (at the finest level of the
+// grid); the refinement level of each cell gives the extent of its key range. Region queries descend the
+// implicit octree with binary searches over the keys, narrowed by a directory of the coarse nodes, so no
+// SQL is needed once the grid is loaded.
+// The arrays live in a single buffer with the layout of the snapshot file, so that a snapshot can be
+// mapped read-only and queried in place.
+// The values can be stored in single precision, halving the memory and bandwidth they take; they are
+// then rounded to the nearest float, a relative error of at most 2^-24 (6e-8).
+// The grid is assumed to fill the unit cube, as the SAGA databases do.
+//
+class LinearOctree
+{
+public:
+    static const uint32_t snapshotVersion = 1;
+
+    LinearOctree();
+    ~LinearOctree();
+
+    void load(SQLiteDB *DB, int valueBytes = sizeof(double));
+    void openSnapshot(std::string filename);
+    void writeSnapshot(std::string filename) const;
+    long size() const;
+    int getMaxLevel() const;
+    int getValueBytes() const;
+
+    long findCellIndex(int idx) const;
+    void findCellsIndexRange(long firstIndex, long lastIndex, std::vector<long> &positions) const;
+    void findCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, std::vector<long> &positions) const;
+    AMRcell getCell(long pos) const;
+    CompactCell getCompactCell(long pos) const;
+    LocalProperties getLocalProperties(long pos) const;
+
+private:
+    static uint64_t layoutSize(uint64_t nCells, int directoryLevel, uint64_t valueBytes, uint64_t offsets[9]);
+    void setColumns(const char *base);
+    bool validColumns() const;
+    void release();
+    void findCellsNode(int level, uint64_t ix, uint64_t iy, uint64_t iz, long lo, long hi, const double *box, std::vector<long> &positions) const;
+
+    // storage: either an owned buffer or a read-only mapping of a snapshot
+    std::vector<uint64_t> buffer;
+    void *mapping;
+    size_t mappingSize;
+
+    long nCells;
+    int maxLevel;
+    int directoryLevel;
+    int valueBytes;
+    const uint64_t *keys;
+    const int32_t *cellIndices;
+    const unsigned char *levels;
+    const int64_t *byCellIndex;
+    const void *rho;
+    const void *Bx;
+    const void *By;
+    const void *Bz;
+    const int64_t *directory;
+};
+
+} // namespace
+
+#endif
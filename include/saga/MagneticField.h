@@ -2,6 +2,7 @@
 
 #include "saga/Referenced.h"
 #include "saga/AMRgrid.h"
+#include "saga/FieldInterpolator.h"
 
 #include <vector>
 #include <string>
@@ -14,9 +15,12 @@ namespace saga {
 class MagneticField: public Referenced {
 private:
 	ref_ptr<AMRgrid> TheGrid;
+	ref_ptr<FieldInterpolator> Interpolator;
 public:
-	MagneticField(ref_ptr<AMRgrid> grid);
+	MagneticField(ref_ptr<AMRgrid> grid, bool interpolate = false);
 	virtual ~MagneticField() { }
+	void setInterpolation(bool interpolate);
+	bool getInterpolation() const;
     std::vector<double> getField(double x, double y, double z) const;
 };
 
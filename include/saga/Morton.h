@@ -0,0 +1,92 @@
+#ifndef SAGA_MORTON_H
+#define SAGA_MORTON_H
+
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Morton (Z-order) keys for integer cell coordinates.
+// Each dimension uses up to mortonMaxLevel bits, so that a key fits in 63 bits. The x coordinate occupies
+// the most significant bit of each triplet, followed by y and z.
+//
+const int mortonMaxLevel = 21;
+
+inline uint64_t mortonSpread(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+inline uint64_t mortonCompact(uint64_t v)
+{
+    v &= 0x1249249249249249ULL;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return v;
+}
+
+inline uint64_t mortonEncode(uint64_t ix, uint64_t iy, uint64_t iz)
+{
+    return (mortonSpread(ix) << 2) | (mortonSpread(iy) << 1) | mortonSpread(iz);
+}
+
+inline void mortonDecode(uint64_t key, uint64_t &ix, uint64_t &iy, uint64_t &iz)
+{
+    ix = mortonCompact(key >> 2);
+    iy = mortonCompact(key >> 1);
+    iz = mortonCompact(key);
+}
+
+/*********************************************************************************************************/
+// Hilbert keys for integer cell coordinates of level mortonMaxLevel (Skilling's transpose, then the bits
+// interleaved as in mortonEncode). Consecutive keys are adjacent cells, so the Hilbert order keeps
+// runs of cells more compact than the Morton order, which jumps at every octant boundary.
+//
+inline uint64_t hilbertEncode(uint64_t ix, uint64_t iy, uint64_t iz)
+{
+    uint64_t X[3] = {ix & 0x1fffff, iy & 0x1fffff, iz & 0x1fffff};
+    for (uint64_t Q=(uint64_t) 1 << (mortonMaxLevel - 1); Q>1; Q>>=1) {
+        uint64_t P = Q - 1;
+        // if bit Q of X[i] is set, invert the low bits of X[0], else exchange them with those of X[i]
+        for (int i=0; i<3; i++) {
+            uint64_t set = 0 - ((X[i] & Q) != 0);
+            uint64_t t = (X[0] ^ X[i]) & P & ~set;
+            X[0] ^= (P & set) | t;
+            X[i] ^= t;
+        }
+    }
+    X[1] ^= X[0];
+    X[2] ^= X[1];
+    uint64_t t = 0;
+    for (uint64_t Q=(uint64_t) 1 << (mortonMaxLevel - 1); Q>1; Q>>=1) {
+        if (X[2] & Q)
+            t ^= Q - 1;
+    }
+    return mortonEncode(X[0] ^ t, X[1] ^ t, X[2] ^ t);
+}
+
+/*********************************************************************************************************/
+// Integer coordinate of level mortonMaxLevel of a position in grid units, clamped to the unit cube; the
+// Hilbert keys of cell centres are built from it wherever cells are ordered along the curve
+//
+inline uint64_t hilbertCoordinate(double x)
+{
+    double n = ldexp(1., mortonMaxLevel);
+    return (uint64_t) std::min(std::max(floor(x * n), 0.), n - 1);
+}
+
+} // namespace
+
+#endif
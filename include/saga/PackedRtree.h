@@ -0,0 +1,54 @@
+#ifndef SAGA_PACKEDRTREE_H
+#define SAGA_PACKEDRTREE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "sqlite3/sqlite3.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Bottom-up build of the SQLite R-tree of the cells (Cell_tree).
+// Inserting the cells one by one lets SQLite split nodes as they fill up, which leaves nodes half empty
+// and overlapping. Here all the boxes are known beforehand: they are sorted along the Hilbert curve of
+// their centres and cut into full leaves, whose bounding boxes are packed the same way into the level
+// above, up to the root. The nodes are then written directly into the tables backing the virtual table
+// (<name>_node, <name>_rowid and <name>_parent), in the format of the SQLite R-tree module, so the result
+// is an ordinary R-tree that SQLite queries and updates as usual.
+// Coordinates are stored as floats, rounded outwards as SQLite does.
+//
+class PackedRtree
+{
+public:
+    PackedRtree();
+    ~PackedRtree();
+
+    void reserve(size_t n);
+    void add(int64_t id, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax);
+    size_t size() const;
+    void clear();
+
+    void write(sqlite3 *db, std::string name);
+    long getNumberOfNodes() const;
+    int getDepth() const;
+
+private:
+    void writeNodes(sqlite3 *db, std::string name);
+
+    struct Entry
+    {
+        int64_t id;
+        float box[6];
+    };
+
+    std::vector<Entry> entries;
+    long nNodes;
+    int depth;
+};
+
+} // namespace
+
+#endif
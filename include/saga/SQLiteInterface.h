@@ -2,6 +2,8 @@
 #define SAGA_SQLITEINTERFACE_H
 
 #include <vector>
+#include <atomic>
+#include <string>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
@@ -17,27 +19,138 @@
 
 namespace saga {
 
+/*********************************************************************************************************/
+// Read-only view of the current row of a statement being stepped.
+// Values are read directly from the statement, without any conversion to text or heap allocation.
+// The view is only valid inside SQLiteRowVisitor::visitRow.
+//
+class SQLiteRow
+{
+public:
+    SQLiteRow(sqlite3_stmt *statement) : stmt(statement) {}
+
+    int getColumnCount() const { return sqlite3_column_count(stmt); }
+    double getDouble(int col) const { return sqlite3_column_double(stmt, col); }
+    sqlite3_int64 getInt64(int col) const { return sqlite3_column_int64(stmt, col); }
+    int getInt(int col) const { return sqlite3_column_int(stmt, col); }
+    const char* getText(int col) const { return (const char*) sqlite3_column_text(stmt, col); }
+
+private:
+    sqlite3_stmt *stmt;
+};
+
+/*********************************************************************************************************/
+// Interface for callers that consume query results row by row.
+// visitRow returns false to stop the iteration before the last row.
+//
+class SQLiteRowVisitor
+{
+public:
+    virtual ~SQLiteRowVisitor() {}
+    virtual bool visitRow(const SQLiteRow &row) = 0;
+};
+
+
+/*********************************************************************************************************/
+// Settings applied to every connection of an SQLiteDB.
+//   immutable: opens the file with the immutable=1 URI parameter, promising SQLite that it does not change
+//            while open; no file locks are taken and no change detection is done, so threads never wait
+//            on each other. Leave it off only if the database may be written during the run.
+//   mmapSize: maximum number of bytes of the file read through a memory mapping (PRAGMA mmap_size);
+//            0 reads through the page cache only.
+//   cacheSize: page cache size of each connection (PRAGMA cache_size): pages if positive, KiB if negative,
+//            SQLite default if 0.
+//   sharedCache: connections of the same process share one page cache (serialised by a mutex).
+//   busyTimeout: milliseconds SQLite waits on a locked database before giving up (not immutable only).
+//   preload: reads the whole file into memory once when the database is opened; all connections then
+//            query that single read-only image and never touch the disk (immutable is implied).
+//
+struct SQLiteOpenOptions
+{
+    SQLiteOpenOptions();
+
+    bool immutable;
+    long long mmapSize;
+    int cacheSize;
+    bool sharedCache;
+    int busyTimeout;
+    bool preload;
+};
+
+/*********************************************************************************************************/
+// Statistics of one kind of query on one connection.
+// Kinds are the slots of the prepared statement cache; the last kind (maxCachedStatements) collects the
+// uncached queries run through query(). Latencies are binned in powers of two: histogram[i] counts the
+// queries that took less than 2^i microseconds (and at least 2^(i-1)).
+//
+struct SQLiteQueryStatistics
+{
+    static const int nLatencyBuckets = 32;
+
+    SQLiteQueryStatistics();
+
+    unsigned long long count;
+    unsigned long long rows;
+    double seconds;
+    unsigned long long histogram[nLatencyBuckets];
+};
+
+/*********************************************************************************************************/
+// Statistics of one connection, i.e. of the thread (or threads, one after the other) using it.
+//   busyRetries: times a locked database made the connection sleep before retrying
+//   bytesRead: bytes of pages read into the page cache of the connection (pages reached through the 
+//            memory mapping of mmapSize are not read into the cache and are not counted)
+//
+struct SQLiteConnectionStatistics
+{
+    int connection;
+    unsigned long long busyRetries;
+    unsigned long long bytesRead;
+    std::vector<SQLiteQueryStatistics> queries;
+};
+
+struct SQLiteConnection;
+class SQLiteConnectionPool;
+
+/*********************************************************************************************************/
+// Read-only SAGA database.
+// Each SQLiteDB owns a pool of connections; a thread gets its own connection (and cache of prepared 
+// statements) the first time it queries the database, so any number of databases can be queried 
+// concurrently from OpenMP, std::thread or Python threads.
+// When statistics are enabled, every query is counted and timed on the connection that runs it; when they 
+// are disabled, step() costs a single extra test. Enable them before querying.
+//
 class SQLiteDB
 {
 public:
+    static const int maxCachedStatements = 16;
+
     SQLiteDB();
     ~SQLiteDB();
-	
-    bool open(std::string filename);
+
+    bool open(std::string filename, SQLiteOpenOptions options = SQLiteOpenOptions());
     bool close();
     std::vector<std::vector<std::string> > query(char* queryString);
-    
-    #ifdef _OPENMP
-        sqlite3** getSQLiteDatabase();
-    #else
-        sqlite3* getSQLiteDatabase();
-    #endif
-    
+    int query(const char* queryString, SQLiteRowVisitor &visitor);
+    sqlite3_stmt* prepareCached(int slot, const char* queryString);
+    int step(sqlite3_stmt *statement, SQLiteRowVisitor &visitor);
 
-};
+    sqlite3* getSQLiteDatabase();
+    int getNumberOfConnections();
 
+    void setStatisticsEnabled(bool enabled);
+    bool getStatisticsEnabled() const;
+    std::vector<SQLiteConnectionStatistics> getStatistics();
+    void resetStatistics();
 
-} // namespace
+private:
+    SQLiteConnection* connection();
+    void record(sqlite3_stmt *statement, int nRows, long long nanoseconds);
 
+    SQLiteConnectionPool *pool;
+    std::atomic<bool> statisticsEnabled;    // read by every query, relaxed
+};
+
+} // namespace
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,40 @@
+#ifndef SAGA_SQLITEMEMORYIMAGE_H
+#define SAGA_SQLITEMEMORYIMAGE_H
+
+#include <string>
+#include <vector>
+
+#include "sqlite3/sqlite3.h"
+
+
+namespace saga {
+
+/*********************************************************************************************************/
+// Read-only copy of a database file held in memory, served to SQLite through a VFS of its own.
+// The file is read once, sequentially; every connection opened with getVFSName() then reads its pages
+// straight from the same image (through xFetch, without copying, when mmap_size allows it), so all
+// threads share one copy of the database and never touch the disk.
+// The image must outlive every connection opened on it.
+//
+class SQLiteMemoryImage
+{
+public:
+    SQLiteMemoryImage();
+    ~SQLiteMemoryImage();
+
+    void load(std::string filename);
+    const char* getVFSName() const;
+    size_t size() const;
+
+private:
+    SQLiteMemoryImage(const SQLiteMemoryImage&);
+    SQLiteMemoryImage& operator=(const SQLiteMemoryImage&);
+
+    std::vector<char> data;
+    std::string vfsName;
+    sqlite3_vfs *vfs;
+};
+
+} // namespace
+
+#endif
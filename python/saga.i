@@ -23,10 +23,16 @@ using std::ptrdiff_t;
 %{
 #include "saga/LocalProperties.h"
 #include "saga/AMRcell.h"
+#include "saga/CellSet.h"
+#include "saga/LevelPyramid.h"
+#include "saga/LinearOctree.h"
 #include "saga/AMRgrid.h"
+#include "saga/AMRgridWriter.h"
 #include "saga/Referenced.h"
 #include "saga/SQLiteInterface.h"
+#include "saga/FieldInterpolator.h"
 #include "saga/MagneticField.h"
+#include "saga/BaryonDensity.h"
 %}
 
 
@@ -47,14 +53,30 @@ using std::ptrdiff_t;
 
 %include "saga/LocalProperties.h"
 %include "saga/AMRcell.h"
+%include "saga/CellSet.h"
+%template(DoubleVector) std::vector<double>;
+%template(LocalPropertiesVector) std::vector<saga::LocalProperties>;
 %include "saga/SQLiteInterface.h"
+%template(SQLiteQueryStatisticsVector) std::vector<saga::SQLiteQueryStatistics>;
+%template(SQLiteConnectionStatisticsVector) std::vector<saga::SQLiteConnectionStatistics>;
+%include "saga/LinearOctree.h"
+%include "saga/LevelPyramid.h"
 
 %include "saga/AMRgrid.h"
 REF_PTR(AMRgrid, saga::AMRgrid)
 
+%include "saga/AMRgridWriter.h"
+REF_PTR(AMRgridWriter, saga::AMRgridWriter)
+
+%include "saga/FieldInterpolator.h"
+REF_PTR(FieldInterpolator, saga::FieldInterpolator)
+
 %include "saga/MagneticField.h"
 REF_PTR(MagneticField, saga::MagneticField)
 
+%include "saga/BaryonDensity.h"
+REF_PTR(BaryonDensity, saga::BaryonDensity)
+
 
 
 
@@ -1,23 +1,460 @@
 #include "saga/AMRgrid.h"
+#include "saga/CellCache.h"
+#include "saga/CellPrefetcher.h"
+#include "saga/CellKernels.h"
+#include "saga/Morton.h"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 
 
 namespace saga{
 
+/*********************************************************************************************************/ 
+// SQL of the statements kept in the prepared statement cache of each connection
+//
+static const char* regionQuery = "SELECT * FROM Cell_tree WHERE maxX >= ?1 AND minX <= ?2 AND maxY >= ?3 AND minY <= ?4 AND maxZ >= ?5 AND minZ <= ?6;";
+static const char* cellQuery = "SELECT * FROM Cell WHERE rowid = ?1;";
+static const char* cellTreeQuery = "SELECT * FROM Cell_tree WHERE id = ?1 LIMIT 1;";
+static const char* countQuery = "SELECT COUNT(*) FROM Cell_tree_rowid;";
+static const char* regionJoinQuery = "SELECT t.id, t.minX, t.maxX, t.minY, t.maxY, t.minZ, t.maxZ, c.* FROM Cell_tree AS t JOIN Cell AS c ON c.rowid = t.id WHERE t.maxX >= ?1 AND t.minX <= ?2 AND t.maxY >= ?3 AND t.minY <= ?4 AND t.maxZ >= ?5 AND t.minZ <= ?6;";
+
+// scan of a range of cell indices, driven by Cell so that the density filter (on the first column of Cell,
+// whose name is looked up when the grid is opened) runs before the R-tree is consulted
+static const char* indexRangeQueryFormat = "SELECT c.rowid, t.minX, t.maxX, t.minY, t.maxY, t.minZ, t.maxZ, c.* FROM Cell AS c CROSS JOIN Cell_tree AS t ON t.id = c.rowid WHERE c.rowid BETWEEN ?1 AND ?2 AND c.\"%s\" > ?3 ORDER BY c.rowid;";
+
+// existence of a cell denser than ?7 in a region; stops at the first one found
+static const char* densityAboveQueryFormat = "SELECT 1 FROM Cell_tree AS t CROSS JOIN Cell AS c ON c.rowid = t.id WHERE t.maxX >= ?1 AND t.minX <= ?2 AND t.maxY >= ?3 AND t.minY <= ?4 AND t.maxZ >= ?5 AND t.minZ <= ?6 AND c.\"%s\" > ?7 LIMIT 1;";
+
+/*********************************************************************************************************/ 
+// Binds the bounds of a box to the parameters ?1-?6 of a region statement
+//
+static void bindRegion(sqlite3_stmt *statement, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    sqlite3_bind_double(statement, 1, xmin);
+    sqlite3_bind_double(statement, 2, xmax);
+    sqlite3_bind_double(statement, 3, ymin);
+    sqlite3_bind_double(statement, 4, ymax);
+    sqlite3_bind_double(statement, 5, zmin);
+    sqlite3_bind_double(statement, 6, zmax);
+}
+
+/*********************************************************************************************************/ 
+// Selection rule for the nearest neighbour: the cell whose center is closest to the point wins; ties are
+// broken by the lowest cell index, so that the result does not depend on the order of the rows.
+// The candidates are gathered in columns and the rule applied by selectNearestCentre (see CellKernels).
+// Each thread reuses its own buffers.
+//
+struct NearestCandidates
+{
+    void add(AMRcell &cell)
+    {
+        cx.push_back(cell.getXcenter());
+        cy.push_back(cell.getYcenter());
+        cz.push_back(cell.getZcenter());
+        indices.push_back(cell.getCellIndex());
+        cells.push_back(cell);
+    }
+
+    // candidate seen across a face of the periodic box, at the position of its image
+    void add(AMRcell &cell, const double *offset)
+    {
+        cx.push_back(cell.getXcenter() + offset[0]);
+        cy.push_back(cell.getYcenter() + offset[1]);
+        cz.push_back(cell.getZcenter() + offset[2]);
+        indices.push_back(cell.getCellIndex());
+        cells.push_back(cell);
+    }
+
+    long select(double x, double y, double z) const
+    {
+        return selectNearestCentre(cx.data(), cy.data(), cz.data(), indices.data(), indices.size(), x, y, z);
+    }
+
+    std::vector<double> cx, cy, cz;
+    std::vector<int32_t> indices;
+    std::vector<AMRcell> cells;
+    std::vector<long> positions;
+    std::vector<LocalProperties> properties;
+};
+
+static NearestCandidates& threadCandidates()
+{
+    static thread_local NearestCandidates candidates;
+    candidates.cx.clear();
+    candidates.cy.clear();
+    candidates.cz.clear();
+    candidates.indices.clear();
+    candidates.cells.clear();
+    candidates.positions.clear();
+    candidates.properties.clear();
+    return candidates;
+}
+
+/*********************************************************************************************************/ 
+// Row visitors used by the queries below.
+// Columns of Cell_tree: id, minX, maxX, minY, maxY, minZ, maxZ
+// Columns of Cell: rho, Bx, By, Bz
+//
+class CellCollector : public SQLiteRowVisitor
+{
+public:
+    CellCollector(std::vector<AMRcell> &c) : cells(c) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        cells.push_back(AMRcell(row.getInt(0), row.getDouble(1), row.getDouble(2), row.getDouble(3), row.getDouble(4), row.getDouble(5), row.getDouble(6)));
+        return true;
+    }
+private:
+    std::vector<AMRcell> &cells;
+};
+
+/*********************************************************************************************************/ 
+// Periodic mode: a box split at the faces of the unit cube into at most 8 parts, each translated into the
+// cube; offset translates what is found in a part back next to the box. Along an axis, a box as wide as
+// the cube covers it once.
+//
+struct PeriodicSplit
+{
+    PeriodicSplit(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax) : n(1)
+    {
+        double lo[3] = {xmin, ymin, zmin};
+        double hi[3] = {xmax, ymax, zmax};
+        for (int a=0; a<3; a++) {
+            double l[2], h[2], o[2];
+            int m = splitAxis(lo[a], hi[a], l, h, o);
+            for (int p=n-1; p>=0; p--) {
+                for (int q=m-1; q>=0; q--) {
+                    int k = p * m + q;
+                    for (int b=0; b<6; b++)
+                        box[k][b] = box[p][b];
+                    for (int b=0; b<3; b++)
+                        offset[k][b] = offset[p][b];
+                    box[k][2 * a] = l[q];
+                    box[k][2 * a + 1] = h[q];
+                    offset[k][a] = o[q];
+                }
+            }
+            n *= m;
+        }
+    }
+
+    static int splitAxis(double lo, double hi, double *l, double *h, double *o)
+    {
+        if (hi - lo >= 1) {
+            l[0] = 0;
+            h[0] = 1;
+            o[0] = 0;
+            return 1;
+        }
+        double k = floor(lo);
+        l[0] = lo - k;
+        h[0] = hi - k;
+        o[0] = k;
+        if (h[0] <= 1)
+            return 1;
+        l[1] = 0;
+        h[1] = h[0] - 1;
+        o[1] = k + 1;
+        h[0] = 1;
+        return 2;
+    }
+
+    int n;
+    double box[8][6];
+    double offset[8][3];
+};
+
+static bool insideUnitCube(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    return xmin >= 0 && xmax <= 1 && ymin >= 0 && ymax <= 1 && zmin >= 0 && zmax <= 1;
+}
+
+static inline double wrapPeriodic(double x)
+{
+    return x - floor(x);
+}
+
+// Periodic mode: candidates of the nearest-neighbour search found in one part of a split box
+class PeriodicCandidateCollector : public AMRcellVisitor
+{
+public:
+    PeriodicCandidateCollector(NearestCandidates &c, const double *o) : candidates(c), offset(o) {}
+    bool visitCell(AMRcell &cell, LocalProperties &lp)
+    {
+        candidates.add(cell, offset);
+        candidates.properties.push_back(lp);
+        return true;
+    }
+private:
+    NearestCandidates &candidates;
+    const double *offset;
+};
+
+// Periodic mode: forwards each cell once over the parts of a split box
+class UniqueCellVisitor : public AMRcellVisitor
+{
+public:
+    UniqueCellVisitor(AMRcellVisitor &v) : visitor(v), stopped(false) {}
+    bool visitCell(AMRcell &cell, LocalProperties &lp)
+    {
+        if (! seen.insert(cell.getCellIndex()).second)
+            return true;
+        stopped = ! visitor.visitCell(cell, lp);
+        return ! stopped;
+    }
+    AMRcellVisitor &visitor;
+    std::unordered_set<int> seen;
+    bool stopped;
+};
+
+// Rows of the region query, or of the joined region query if the properties are wanted
+class CellSetCollector : public SQLiteRowVisitor
+{
+public:
+    CellSetCollector(CellSet &c, bool p) : cells(c), withProperties(p) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        CompactCell cell = CompactCell::encode(row.getInt(0), row.getDouble(1), row.getDouble(2), row.getDouble(3), row.getDouble(4), row.getDouble(5), row.getDouble(6));
+        if (withProperties)
+            cells.push_back(cell, LocalProperties(row.getDouble(7), row.getDouble(8), row.getDouble(9), row.getDouble(10)));
+        else
+            cells.push_back(cell);
+        return true;
+    }
+private:
+    CellSet &cells;
+    bool withProperties;
+};
+
+class PropertiesReader : public SQLiteRowVisitor
+{
+public:
+    PropertiesReader() : found(false) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        lp = LocalProperties(row.getDouble(0), row.getDouble(1), row.getDouble(2), row.getDouble(3));
+        found = true;
+        return false;
+    }
+    bool found;
+    LocalProperties lp;
+};
+
+// Rows of the joined region query: Cell_tree columns followed by Cell columns
+class CandidateCollector : public SQLiteRowVisitor
+{
+public:
+    CandidateCollector(NearestCandidates &c) : candidates(c) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        AMRcell cell(row.getInt(0), row.getDouble(1), row.getDouble(2), row.getDouble(3), row.getDouble(4), row.getDouble(5), row.getDouble(6));
+        candidates.add(cell);
+        candidates.properties.push_back(LocalProperties(row.getDouble(7), row.getDouble(8), row.getDouble(9), row.getDouble(10)));
+        return true;
+    }
+private:
+    NearestCandidates &candidates;
+};
+
+class RegionStreamer : public SQLiteRowVisitor
+{
+public:
+    RegionStreamer(AMRcellVisitor &v) : visitor(v) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        AMRcell cell(row.getInt(0), row.getDouble(1), row.getDouble(2), row.getDouble(3), row.getDouble(4), row.getDouble(5), row.getDouble(6));
+        LocalProperties lp(row.getDouble(7), row.getDouble(8), row.getDouble(9), row.getDouble(10));
+        return visitor.visitCell(cell, lp);
+    }
+private:
+    AMRcellVisitor &visitor;
+};
+
+class PropertiesCollector : public AMRcellVisitor
+{
+public:
+    PropertiesCollector(std::vector<LocalProperties> &p) : properties(p) {}
+    bool visitCell(AMRcell &cell, LocalProperties &lp)
+    {
+        properties.push_back(lp);
+        return true;
+    }
+private:
+    std::vector<LocalProperties> &properties;
+};
+
+class ColumnNameReader : public SQLiteRowVisitor
+{
+public:
+    bool visitRow(const SQLiteRow &row)
+    {
+        // PRAGMA table_info: cid, name, type, ...
+        if (row.getInt(0) == 0 && row.getText(1) != NULL)
+            name = row.getText(1);
+        return true;
+    }
+    std::string name;
+};
+
+// Cells of a region indexed by refinement level and integer coordinates, for point location in memory
+class CellLocator : public AMRcellVisitor
+{
+public:
+    bool visitCell(AMRcell &cell, LocalProperties &lp)
+    {
+        CompactCell c = CompactCell::fromCell(cell);
+        if (levels.size() <= c.level)
+            levels.resize(c.level + 1);
+        levels[c.level][c.key] = cells.size();
+        cells.push_back(cell);
+        properties.push_back(lp);
+        return true;
+    }
+
+    // cell containing a point; on a face between cells, the one lying in the direction (dx,dy,dz)
+    long locate(double x, double y, double z, double dx, double dy, double dz) const
+    {
+        for (int level=0; level<levels.size(); level++) {
+            uint64_t ix, iy, iz;
+            if (levels[level].empty() || ! coordinate(x, dx, level, ix) || ! coordinate(y, dy, level, iy) || ! coordinate(z, dz, level, iz))
+                continue;
+            std::unordered_map<uint64_t, long>::const_iterator it = levels[level].find(mortonEncode(ix, iy, iz));
+            if (it != levels[level].end())
+                return it->second;
+        }
+        return -1;
+    }
+
+    std::vector<AMRcell> cells;
+    std::vector<LocalProperties> properties;
+
+private:
+    static bool coordinate(double x, double d, int level, uint64_t &i)
+    {
+        double u = ldexp(x, level);
+        double v = (d < 0) ? ceil(u) - 1 : floor(u);
+        if (v < 0 || v >= ldexp(1., level))
+            return false;
+        i = (uint64_t) v;
+        return true;
+    }
+
+    std::vector<std::unordered_map<uint64_t, long> > levels;
+};
+
+class IntegerReader : public SQLiteRowVisitor
+{
+public:
+    IntegerReader() : value(0) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        value = row.getInt64(0);
+        return false;
+    }
+    sqlite3_int64 value;
+};
+
+
+/*********************************************************************************************************/ 
+// Options
+AMRgridOptions::AMRgridOptions()
+{
+    backend = SQLiteBackend;
+    cellCacheSize = 4;
+    singlePrecision = false;
+    levelOfDetail = false;
+    periodic = false;
+    prefetchThreads = 0;
+    prefetchRegions = 64;
+    statistics = false;
+}
+
 /*********************************************************************************************************/ 
 // Constructor
-AMRgrid::AMRgrid(std::string filename, int nLevels)
+// Input:
+//   filename: SAGA database
+//   nLevels: maximum level of refinement of the grid
+//   options: backend answering the queries (SQLite by default)
+//
+// With SnapshotBackend, filename is a snapshot written by ConvertToSnapshot instead of a database.
+//
+AMRgrid::AMRgrid(std::string filename, int nLevels, AMRgridOptions options)
 {
-    saga::SQLiteDB *DB = new saga::SQLiteDB();
-    DB->open(filename);
+    octree = NULL;
+    pyramid = NULL;
+    prefetcher = NULL;
+    DB = NULL;
+    periodic = options.periodic;
+    cellCache = (options.cellCacheSize > 0) ? new CellCache(options.cellCacheSize) : NULL;
     setMaxRefinementLevel(nLevels);
     setMinCellSize(nLevels);
+
+    // the destructor does not run if the constructor throws: release what was allocated
+    try {
+        if (options.backend == AMRgridOptions::SnapshotBackend) {
+            octree = new LinearOctree();
+            octree->openSnapshot(filename);
+            if (options.levelOfDetail) {
+                pyramid = new LevelPyramid();
+                pyramid->build(*octree);
+            }
+            return;
+        }
+
+        DB = new saga::SQLiteDB();
+        DB->open(filename, options.sqlite);
+        DB->setStatisticsEnabled(options.statistics);
+
+        ColumnNameReader density;
+        DB->query("PRAGMA table_info(Cell);", density);
+        if (density.name.empty() || density.name.find('"') != std::string::npos)
+            throw std::runtime_error("Unexpected layout of the Cell table.");
+        std::vector<char> sql(strlen(densityAboveQueryFormat) + strlen(indexRangeQueryFormat) + density.name.size());
+        snprintf(&sql[0], sql.size(), indexRangeQueryFormat, density.name.c_str());
+        indexRangeQuery = &sql[0];
+        snprintf(&sql[0], sql.size(), densityAboveQueryFormat, density.name.c_str());
+        densityAboveQuery = &sql[0];
+
+        if (options.backend == AMRgridOptions::OctreeBackend) {
+            octree = new LinearOctree();
+            octree->load(DB, options.singlePrecision ? sizeof(float) : sizeof(double));
+            close();
+        }
+
+        if (options.levelOfDetail) {
+            pyramid = new LevelPyramid();
+            if (octree != NULL) {
+                pyramid->build(*octree);
+            } else {
+                LinearOctree cells;
+                cells.load(DB);
+                pyramid->build(cells);
+            }
+        }
+
+        if (octree == NULL && options.prefetchThreads > 0)
+            prefetcher = new CellPrefetcher(this, options.prefetchThreads, options.prefetchRegions);
+    } catch (...) {
+        close();
+        delete octree;
+        delete pyramid;
+        delete cellCache;
+        throw;
+    }
 }
 
 /*********************************************************************************************************/ 
 // Destructor
 AMRgrid::~AMRgrid()
 {
-    DB->close();
+    close();
+    delete octree;
+    delete pyramid;
+    delete cellCache;
 }
 
 /*********************************************************************************************************/ 
@@ -54,6 +491,14 @@ void AMRgrid::setMinCellSize(int nLevels)
     minCellSize = 1 / pow(2, nLevels);
 }
 
+/*********************************************************************************************************/ 
+// Returns whether the unit cube is treated as a periodic box
+//
+bool AMRgrid::isPeriodic()
+{
+    return periodic;
+}
+
 
 /*********************************************************************************************************/ 
 // Given a range in space returns a vector with the indexes of the closest cells.
@@ -65,16 +510,90 @@ void AMRgrid::setMinCellSize(int nLevels)
 //
 std::vector<AMRcell> AMRgrid::getCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
 {
-    char query[512];
-    sprintf(query, "SELECT * FROM Cell_tree WHERE maxX >= %lf AND minX <= %lf AND maxY >= %lf AND minY <= %lf AND maxZ >= %lf AND minZ <= %lf;", xmin, xmax, ymin, ymax, zmin, zmax);
+    if (periodic && ! insideUnitCube(xmin, xmax, ymin, ymax, zmin, zmax)) {
+        PeriodicSplit split(xmin, xmax, ymin, ymax, zmin, zmax);
+        std::vector<AMRcell> cells;
+        std::unordered_set<int> seen;
+        for (int i=0; i<split.n; i++) {
+            double *b = split.box[i];
+            std::vector<AMRcell> part = getCellsRegion(b[0], b[1], b[2], b[3], b[4], b[5]);
+            for (size_t j=0; j<part.size(); j++) {
+                if (seen.insert(part[j].getCellIndex()).second)
+                    cells.push_back(part[j]);
+            }
+        }
+        return cells;
+    }
+
+    if (octree != NULL) {
+        std::vector<long> positions;
+        octree->findCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, positions);
+        std::vector<AMRcell> cells;
+        cells.reserve(positions.size());
+        for (int i=0; i<positions.size(); i++)
+            cells.push_back(octree->getCell(positions[i]));
+        return cells;
+    }
+
+    sqlite3_stmt *statement = database().prepareCached(RegionStatement, regionQuery);
+    bindRegion(statement, xmin, xmax, ymin, ymax, zmin, zmax);
 
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
     std::vector<AMRcell> cells;
+    CellCollector collector(cells);
+    DB->step(statement, collector);
+
+    return cells;
+}
 
-    for (int i=0; i<queryResults.size(); i++){
-        AMRcell *cell = new AMRcell(atoi(queryResults[i][0].c_str()), atof(queryResults[i][1].c_str()), atof(queryResults[i][2].c_str()), atof(queryResults[i][3].c_str()), atof(queryResults[i][4].c_str()), atof(queryResults[i][5].c_str()), atof(queryResults[i][6].c_str()));
-        cells.push_back(*cell);
+/*********************************************************************************************************/ 
+// Given a range in space returns the cells in it in compact form, the same cells as getCellsRegion.
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+//   withProperties: whether to store the local properties of the cells as well
+// Output:
+//   cells: compact cells, with their properties if requested
+//
+CellSet AMRgrid::getCellSetRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, bool withProperties)
+{
+    CellSet cells;
+    if (periodic && ! insideUnitCube(xmin, xmax, ymin, ymax, zmin, zmax)) {
+        PeriodicSplit split(xmin, xmax, ymin, ymax, zmin, zmax);
+        std::unordered_set<int> seen;
+        for (int i=0; i<split.n; i++) {
+            double *b = split.box[i];
+            CellSet part = getCellSetRegion(b[0], b[1], b[2], b[3], b[4], b[5], withProperties);
+            for (size_t j=0; j<part.size(); j++) {
+                if (! seen.insert(part.getIndices()[j]).second)
+                    continue;
+                if (withProperties)
+                    cells.push_back(part.getCompactCell(j), part.getLocalProperties(j));
+                else
+                    cells.push_back(part.getCompactCell(j));
+            }
+        }
+        return cells;
+    }
+
+    if (octree != NULL) {
+        std::vector<long> positions;
+        octree->findCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, positions);
+        cells.reserve(positions.size(), withProperties);
+        for (int i=0; i<positions.size(); i++) {
+            if (withProperties)
+                cells.push_back(octree->getCompactCell(positions[i]), octree->getLocalProperties(positions[i]));
+            else
+                cells.push_back(octree->getCompactCell(positions[i]));
+        }
+        return cells;
     }
+
+    sqlite3_stmt *statement = withProperties ? database().prepareCached(RegionJoinStatement, regionJoinQuery) : database().prepareCached(RegionStatement, regionQuery);
+    bindRegion(statement, xmin, xmax, ymin, ymax, zmin, zmax);
+
+    CellSetCollector collector(cells, withProperties);
+    DB->step(statement, collector);
+
     return cells;
 }
 
@@ -87,6 +606,11 @@ std::vector<AMRcell> AMRgrid::getCellsRegion(double xmin, double xmax, double ym
 //
 std::vector<AMRcell>  AMRgrid::getNearestNeighbors(double x, double y, double z)
 {
+    if (periodic) {
+        x = wrapPeriodic(x);
+        y = wrapPeriodic(y);
+        z = wrapPeriodic(z);
+    }
     double prefactor = 0.5;
     double xmin = x - prefactor * minCellSize;
     double xmax = x + prefactor * minCellSize;
@@ -107,17 +631,47 @@ std::vector<AMRcell>  AMRgrid::getNearestNeighbors(double x, double y, double z)
 //
 AMRcell AMRgrid::selectNearestNeighbor(double x, double y, double z)
 {
-    std::vector<AMRcell> cells = getNearestNeighbors(x, y, z);
-    double d = 1.;
-    int idx;
-    for (int i=0; i<cells.size(); i++) {
-        double dc = cells[i].distanceToPoint(x, y, z);
-        if(d >= dc) {
-            d = dc;
-            idx = i;
+    if (periodic) {
+        x = wrapPeriodic(x);
+        y = wrapPeriodic(y);
+        z = wrapPeriodic(z);
+        double h = 0.5 * minCellSize;
+        if (! insideUnitCube(x - h, x + h, y - h, y + h, z - h, z + h)) {
+            LocalProperties lp;
+            return selectNearestPeriodic(x, y, z, lp);
         }
-    }       
-    return cells[idx];
+    }
+
+    std::vector<AMRcell> cells = getNearestNeighbors(x, y, z);
+    if (cells.empty())
+        throw std::runtime_error("No cell found around the requested position.");
+
+    NearestCandidates &candidates = threadCandidates();
+    for (int i=0; i<cells.size(); i++)
+        candidates.add(cells[i]);
+    return cells[candidates.select(x, y, z)];
+}
+
+/*********************************************************************************************************/ 
+// Given a point with coordinates (x,y,z), returns the nearest neighbor and its local properties, found
+// with a single lookup; the cell is also offered to the cell cache.
+// Input:
+//   (x,y,z): point coordinates in grid units
+// Output:
+//   lp: local properties of the cell
+//   nearest cell
+//
+AMRcell AMRgrid::selectNearestNeighbor(double x, double y, double z, LocalProperties &lp)
+{
+    if (periodic) {
+        x = wrapPeriodic(x);
+        y = wrapPeriodic(y);
+        z = wrapPeriodic(z);
+    }
+    AMRcell cell = selectNearestWithProperties(x, y, z, lp);
+    if (cellCache != NULL)
+        cellCache->insert(cell, lp, 0.5 * minCellSize);
+    return cell;
 }
 
 
@@ -130,17 +684,23 @@ AMRcell AMRgrid::selectNearestNeighbor(double x, double y, double z)
 //
 AMRcell AMRgrid::getCellWithIndex(int idx)
 {
-    char query[512];
-    sprintf(query,"SELECT * FROM Cell_tree WHERE id = %i LIMIT 1;", idx);
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
-    double xmin = atof(queryResults[0][1].c_str());
-    double xmax = atof(queryResults[0][2].c_str());
-    double ymin = atof(queryResults[0][3].c_str());
-    double ymax = atof(queryResults[0][4].c_str());
-    double zmin = atof(queryResults[0][5].c_str());
-    double zmax = atof(queryResults[0][6].c_str());
-    
-    return AMRcell(idx, xmin, xmax, ymin, ymax, zmin, zmax);
+    if (octree != NULL) {
+        long pos = octree->findCellIndex(idx);
+        if (pos < 0)
+            throw std::runtime_error("No cell with the requested index.");
+        return octree->getCell(pos);
+    }
+
+    sqlite3_stmt *statement = database().prepareCached(CellTreeStatement, cellTreeQuery);
+    sqlite3_bind_int64(statement, 1, idx);
+
+    std::vector<AMRcell> cells;
+    CellCollector collector(cells);
+    DB->step(statement, collector);
+    if (cells.empty())
+        throw std::runtime_error("No cell with the requested index.");
+
+    return cells[0];
 }
 
 /*********************************************************************************************************/ 
@@ -156,20 +716,306 @@ AMRcell AMRgrid::getCellWithIndex(int idx)
 std::vector<LocalProperties> AMRgrid::getLocalPropertiesRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
 {
     std::vector<LocalProperties> LP;
-    std::vector<AMRcell> cells = getCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax);
-    for (int i=0; i<cells.size(); i++) {
-        int index = cells[i].getCellIndex();
-        char query[512] = "";
-        sprintf(query, "SELECT * FROM Cell WHERE rowid = %i;", index);
-        std::vector<std::vector<std::string> > queryResults = DB->query(query);
-        LocalProperties *lp = new LocalProperties(atof(queryResults[0][0].c_str()), atof(queryResults[0][1].c_str()), atof(queryResults[0][2].c_str()), atof(queryResults[0][3].c_str()));
-        LP.push_back(*lp);
-        delete lp;
-    }
+    PropertiesCollector collector(LP);
+    visitCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, collector);
 
 	return LP;  
 }
 
+/*********************************************************************************************************/ 
+// Given a range in space, streams the cells in it together with their local properties.
+// Geometry and properties come from a single joined query, without one extra query per cell.
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+//   visitor: receives each cell; returning false from visitCell stops the query
+//
+void AMRgrid::visitCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, AMRcellVisitor &visitor)
+{
+    if (periodic && ! insideUnitCube(xmin, xmax, ymin, ymax, zmin, zmax)) {
+        PeriodicSplit split(xmin, xmax, ymin, ymax, zmin, zmax);
+        UniqueCellVisitor unique(visitor);
+        for (int i=0; i<split.n && ! unique.stopped; i++) {
+            double *b = split.box[i];
+            visitCellsRegion(b[0], b[1], b[2], b[3], b[4], b[5], unique);
+        }
+        return;
+    }
+
+    if (octree != NULL) {
+        std::vector<long> positions;
+        octree->findCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, positions);
+        for (int i=0; i<positions.size(); i++) {
+            AMRcell cell = octree->getCell(positions[i]);
+            LocalProperties lp = octree->getLocalProperties(positions[i]);
+            if (! visitor.visitCell(cell, lp))
+                break;
+        }
+        return;
+    }
+
+    sqlite3_stmt *statement = database().prepareCached(RegionJoinStatement, regionJoinQuery);
+    bindRegion(statement, xmin, xmax, ymin, ymax, zmin, zmax);
+
+    RegionStreamer streamer(visitor);
+    DB->step(statement, streamer);
+}
+
+/*********************************************************************************************************/ 
+// Streams the cells whose index lies in a range and whose density exceeds a threshold, in index order.
+// The threshold is applied inside the scan: rejected cells cost neither a lookup in the R-tree nor a
+// call to the visitor. Disjoint ranges can be scanned concurrently by different threads.
+// Input:
+//   firstIndex, lastIndex: range of cell indices (inclusive)
+//   minDensity: only cells with density > minDensity are visited (-HUGE_VAL for all cells)
+//   visitor: receives each cell; returning false from visitCell stops the scan
+//
+void AMRgrid::visitCellsIndexRange(long firstIndex, long lastIndex, double minDensity, AMRcellVisitor &visitor)
+{
+    if (octree != NULL) {
+        std::vector<long> positions;
+        octree->findCellsIndexRange(firstIndex, lastIndex, positions);
+        for (int i=0; i<positions.size(); i++) {
+            LocalProperties lp = octree->getLocalProperties(positions[i]);
+            if (! (lp.getDensity() > minDensity))
+                continue;
+            AMRcell cell = octree->getCell(positions[i]);
+            if (! visitor.visitCell(cell, lp))
+                break;
+        }
+        return;
+    }
+
+    sqlite3_stmt *statement = database().prepareCached(IndexRangeStatement, indexRangeQuery.c_str());
+    sqlite3_bind_int64(statement, 1, firstIndex);
+    sqlite3_bind_int64(statement, 2, lastIndex);
+    sqlite3_bind_double(statement, 3, minDensity);
+
+    RegionStreamer streamer(visitor);
+    DB->step(statement, streamer);
+}
+
+/*********************************************************************************************************/ 
+// Tells whether any cell overlapping a range in space is denser than a threshold.
+// The test runs inside the query and stops at the first match, without transferring the cells.
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+//   minDensity: density threshold in simulation units
+// Output:
+//   true if a cell with density > minDensity overlaps the range
+//
+bool AMRgrid::hasDensityAbove(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, double minDensity)
+{
+    if (periodic && ! insideUnitCube(xmin, xmax, ymin, ymax, zmin, zmax)) {
+        PeriodicSplit split(xmin, xmax, ymin, ymax, zmin, zmax);
+        for (int i=0; i<split.n; i++) {
+            double *b = split.box[i];
+            if (hasDensityAbove(b[0], b[1], b[2], b[3], b[4], b[5], minDensity))
+                return true;
+        }
+        return false;
+    }
+
+    if (octree != NULL) {
+        std::vector<long> positions;
+        octree->findCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, positions);
+        for (int i=0; i<positions.size(); i++) {
+            if (octree->getLocalProperties(positions[i]).getDensity() > minDensity)
+                return true;
+        }
+        return false;
+    }
+
+    sqlite3_stmt *statement = database().prepareCached(DensityAboveStatement, densityAboveQuery.c_str());
+    bindRegion(statement, xmin, xmax, ymin, ymax, zmin, zmax);
+    sqlite3_bind_double(statement, 7, minDensity);
+
+    IntegerReader reader;
+    return DB->step(statement, reader) > 0;
+}
+
+/*********************************************************************************************************/ 
+// Given a point with coordinates (x,y,z), returns the local properties at a maximum refinement level:
+// those of the cell containing the point if it is not finer than the level, otherwise the averages over
+// the node of that level containing the point (see LevelPyramid). Only nodes down to the level are read.
+// Requires AMRgridOptions::levelOfDetail.
+// Input:
+//   (x,y,z): point coordinates in grid units
+//   level: maximum refinement level, 0 for the whole box
+// Output:
+//    LocalProperties: density, (Bx,By,Bz) [magnetic field] in simulation units.
+//
+LocalProperties AMRgrid::getLocalPropertiesAtLevel(double x, double y, double z, int level)
+{
+    if (pyramid == NULL)
+        throw std::runtime_error("The grid was opened without levelOfDetail.");
+    if (periodic) {
+        x = wrapPeriodic(x);
+        y = wrapPeriodic(y);
+        z = wrapPeriodic(z);
+    }
+    LocalProperties lp;
+    pyramid->getCell(x, y, z, level, lp);
+    return lp;
+}
+
+/*********************************************************************************************************/ 
+// Given a range in space returns the nodes overlapping it at a maximum refinement level, with their local
+// properties; leaf cells keep their index, averaged nodes have index -1. Requires
+// AMRgridOptions::levelOfDetail.
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+//   level: maximum refinement level
+// Output:
+//   cells: nodes in Morton order
+//
+CellSet AMRgrid::getCellSetRegionAtLevel(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, int level)
+{
+    if (pyramid == NULL)
+        throw std::runtime_error("The grid was opened without levelOfDetail.");
+    CellSet cells;
+    if (periodic && ! insideUnitCube(xmin, xmax, ymin, ymax, zmin, zmax)) {
+        PeriodicSplit split(xmin, xmax, ymin, ymax, zmin, zmax);
+        std::set<std::pair<int, uint64_t> > seen;
+        for (int i=0; i<split.n; i++) {
+            double *b = split.box[i];
+            CellSet part;
+            pyramid->getCellsRegion(b[0], b[1], b[2], b[3], b[4], b[5], level, part);
+            for (size_t j=0; j<part.size(); j++) {
+                CompactCell node = part.getCompactCell(j);
+                if (seen.insert(std::make_pair((int) node.level, node.key)).second)
+                    cells.push_back(node, part.getLocalProperties(j));
+            }
+        }
+        return cells;
+    }
+    pyramid->getCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, level, cells);
+    return cells;
+}
+
+/*********************************************************************************************************/ 
+// Returns the finest level of the level-of-detail pyramid, beyond which queries at a level return the
+// cells of the grid (-1 without AMRgridOptions::levelOfDetail)
+//
+int AMRgrid::getMaxLevelOfDetail()
+{
+    return (pyramid != NULL) ? pyramid->getMaxLevel() : -1;
+}
+
+/*********************************************************************************************************/ 
+// Returns the cells crossed by the segment from p0 to p1, in order, with the parametric positions at which
+// the segment enters and leaves each of them, and their properties.
+// The cells around the segment are fetched with a single region query; the segment is then walked from cell
+// to cell in memory: the exit point of each cell is the nearest of its faces along the direction of the
+// segment, and the next cell is the one containing that point, on the side the segment is heading to.
+// Cells are located geometrically, so the grid must be made of dyadic cells filling the unit cube.
+// Input:
+//   (x0,y0,z0): start of the segment in grid units
+//   (x1,y1,z1): end of the segment in grid units
+// Output:
+//   crossings with tEntry of the first equal to 0, tExit of the last equal to 1, and tExit of each equal
+//   to tEntry of the next
+//
+std::vector<CellCrossing> AMRgrid::traverseSegment(double x0, double y0, double z0, double x1, double y1, double z1)
+{
+    if (! periodic || insideUnitCube(std::min(x0, x1), std::max(x0, x1), std::min(y0, y1), std::max(y0, y1), std::min(z0, z1), std::max(z0, z1)))
+        return traverseSegmentInCube(x0, y0, z0, x1, y1, z1);
+
+    // periodic mode: the segment is cut where it crosses the faces of the periodic images of the cube,
+    // and each piece is walked in the image of the cube it lies in
+    double p0[3] = {x0, y0, z0};
+    double d[3] = {x1 - x0, y1 - y0, z1 - z0};
+    std::vector<double> cuts(1, 0.);
+    for (int a=0; a<3; a++) {
+        if (d[a] == 0)
+            continue;
+        double lo = std::min(p0[a], p0[a] + d[a]);
+        double hi = std::max(p0[a], p0[a] + d[a]);
+        for (double k=ceil(lo); k<=hi; k++) {
+            double t = (k - p0[a]) / d[a];
+            if (t > 0 && t < 1)
+                cuts.push_back(t);
+        }
+    }
+    cuts.push_back(1.);
+    std::sort(cuts.begin(), cuts.end());
+
+    std::vector<CellCrossing> crossings;
+    for (size_t i=0; i+1<cuts.size(); i++) {
+        double ta = cuts[i];
+        double tb = cuts[i + 1];
+        if (tb <= ta)
+            continue;
+        double a[3], b[3];
+        for (int k=0; k<3; k++) {
+            double image = floor(p0[k] + 0.5 * (ta + tb) * d[k]);
+            a[k] = std::min(std::max(p0[k] + ta * d[k] - image, 0.), 1.);
+            b[k] = std::min(std::max(p0[k] + tb * d[k] - image, 0.), 1.);
+        }
+        std::vector<CellCrossing> piece = traverseSegmentInCube(a[0], a[1], a[2], b[0], b[1], b[2]);
+        for (size_t j=0; j<piece.size(); j++) {
+            CellCrossing &c = piece[j];
+            c.tEntry = (c.tEntry == 0) ? ta : ta + c.tEntry * (tb - ta);
+            c.tExit = (c.tExit == 1) ? tb : ta + c.tExit * (tb - ta);
+            if (! crossings.empty() && crossings.back().cell.getCellIndex() == c.cell.getCellIndex())
+                crossings.back().tExit = c.tExit;
+            else
+                crossings.push_back(c);
+        }
+    }
+    return crossings;
+}
+
+/*********************************************************************************************************/ 
+// Walks a segment lying in the unit cube (see traverseSegment)
+//
+std::vector<CellCrossing> AMRgrid::traverseSegmentInCube(double x0, double y0, double z0, double x1, double y1, double z1)
+{
+    double dx = x1 - x0;
+    double dy = y1 - y0;
+    double dz = z1 - z0;
+
+    CellLocator locator;
+    visitCellsRegion(std::min(x0, x1), std::max(x0, x1), std::min(y0, y1), std::max(y0, y1), std::min(z0, z1), std::max(z0, z1), locator);
+
+    std::vector<CellCrossing> crossings;
+    double t = 0;
+    while (true) {
+        long i = locator.locate(x0 + t * dx, y0 + t * dy, z0 + t * dz, dx, dy, dz);
+        if (i < 0)
+            throw std::runtime_error("The segment leaves the grid.");
+        AMRcell &cell = locator.cells[i];
+
+        double tExit = 1;
+        if (dx > 0) tExit = std::min(tExit, (cell.getXmax() - x0) / dx);
+        if (dx < 0) tExit = std::min(tExit, (cell.getXmin() - x0) / dx);
+        if (dy > 0) tExit = std::min(tExit, (cell.getYmax() - y0) / dy);
+        if (dy < 0) tExit = std::min(tExit, (cell.getYmin() - y0) / dy);
+        if (dz > 0) tExit = std::min(tExit, (cell.getZmax() - z0) / dz);
+        if (dz < 0) tExit = std::min(tExit, (cell.getZmin() - z0) / dz);
+        // rounding may leave the point on the face just crossed
+        if (tExit <= t)
+            tExit = std::min(1., nextafter(t, 2.));
+
+        crossings.push_back(CellCrossing(cell, locator.properties[i], t, tExit));
+        if (tExit >= 1)
+            break;
+        t = tExit;
+    }
+
+    // consecutive pieces in the same cell, left by the rounding fallback, are merged
+    std::vector<CellCrossing> merged;
+    for (size_t i=0; i<crossings.size(); i++) {
+        if (! merged.empty() && merged.back().cell.getCellIndex() == crossings[i].cell.getCellIndex())
+            merged.back().tExit = crossings[i].tExit;
+        else
+            merged.push_back(crossings[i]);
+    }
+    return merged;
+}
+
 /*********************************************************************************************************/
 // Given a point with coordinates (x,y,z), returns the local properties for this point.
 // Input:
@@ -181,15 +1027,59 @@ std::vector<LocalProperties> AMRgrid::getLocalPropertiesRegion(double xmin, doub
 //
 LocalProperties AMRgrid::getLocalProperties(double x, double y, double z)
 {
+    if (periodic) {
+        x = wrapPeriodic(x);
+        y = wrapPeriodic(y);
+        z = wrapPeriodic(z);
+    }
+    double prefactor = 0.5;
+    LocalProperties lp;
+    if (cellCache != NULL && cellCache->lookup(x, y, z, lp))
+        return lp;
 
-    char query[512];
-    AMRcell cell = selectNearestNeighbor(x, y, z);
-    //std::cout << "cell index: " << cell.getCellIndex() << std::endl;
-    sprintf(query, "SELECT * FROM Cell WHERE rowid = %i;", cell.getCellIndex());
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
+    AMRcell cell = selectNearestWithProperties(x, y, z, lp);
+    if (cellCache != NULL)
+        cellCache->insert(cell, lp, prefactor * minCellSize);
+    return lp;
+}
 
-    return LocalProperties(atof(queryResults[0][0].c_str()), atof(queryResults[0][1].c_str()), atof(queryResults[0][2].c_str()), atof(queryResults[0][3].c_str()));
+/*********************************************************************************************************/
+// Returns the nearest neighbor of a point and its local properties, from the prefetched regions or the
+// backend (no cell cache)
+// Input:
+//   (x,y,z): point coordinates in grid units, inside the unit cube in periodic mode
+// Output:
+//   lp: local properties of the cell
+//   nearest cell
+//
+AMRcell AMRgrid::selectNearestWithProperties(double x, double y, double z, LocalProperties &lp)
+{
+    double prefactor = 0.5;
+    AMRcell cell(0, 0, 0, 0, 0, 0, 0);
+    double h = prefactor * minCellSize;
+    if (periodic && ! insideUnitCube(x - h, x + h, y - h, y + h, z - h, z + h)) {
+        cell = selectNearestPeriodic(x, y, z, lp);
+    } else if (prefetcher != NULL && prefetcher->lookup(x, y, z, h, cell, lp)) {
+        // answered by the cells fetched in the background
+    } else if (octree != NULL) {
+        long pos = selectNearestPosition(x, y, z);
+        cell = octree->getCell(pos);
+        lp = octree->getLocalProperties(pos);
+    } else {
+        sqlite3_stmt *statement = database().prepareCached(RegionJoinStatement, regionJoinQuery);
+        bindRegion(statement, x - prefactor * minCellSize, x + prefactor * minCellSize, y - prefactor * minCellSize, y + prefactor * minCellSize, z - prefactor * minCellSize, z + prefactor * minCellSize);
 
+        // candidates and their properties come from the same joined rows
+        NearestCandidates &candidates = threadCandidates();
+        CandidateCollector collector(candidates);
+        DB->step(statement, collector);
+        if (candidates.cells.empty())
+            throw std::runtime_error("No cell found around the requested position.");
+        long best = candidates.select(x, y, z);
+        cell = candidates.cells[best];
+        lp = candidates.properties[best];
+    }
+    return cell;
 }
 
 /*********************************************************************************************************/
@@ -203,12 +1093,21 @@ LocalProperties AMRgrid::getLocalProperties(double x, double y, double z)
 //
 LocalProperties AMRgrid::getLocalPropertiesFromIndex(int index)
 {
+    if (octree != NULL) {
+        long pos = octree->findCellIndex(index);
+        if (pos < 0)
+            throw std::runtime_error("No cell with the requested index.");
+        return octree->getLocalProperties(pos);
+    }
 
-    char query[512];
-    sprintf(query,"SELECT * FROM Cell WHERE rowid = %i;", index);
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
+    sqlite3_stmt *statement = database().prepareCached(CellStatement, cellQuery);
+    sqlite3_bind_int64(statement, 1, index);
+    PropertiesReader reader;
+    DB->step(statement, reader);
+    if (! reader.found)
+        throw std::runtime_error("No cell with the requested index.");
 
-    return LocalProperties(atof(queryResults[0][0].c_str()), atof(queryResults[0][1].c_str()), atof(queryResults[0][2].c_str()), atof(queryResults[0][3].c_str()));
+    return reader.lp;
 
 }
 
@@ -224,12 +1123,7 @@ LocalProperties AMRgrid::getLocalPropertiesFromIndex(int index)
 double AMRgrid::getDensity(double x, double y, double z)
 {
 
-    char query[512];
-    AMRcell cell = selectNearestNeighbor(x, y, z);
-    sprintf(query,"SELECT * FROM Cell WHERE rowid = %i;", cell.getCellIndex());
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
-
-    return atof(queryResults[0][1].c_str());
+    return getLocalProperties(x, y, z).getDensity();
 
 }
 
@@ -244,20 +1138,205 @@ double AMRgrid::getDensity(double x, double y, double z)
 //
 std::vector<double> AMRgrid::getMagneticField(double x, double y, double z)
 {
-    char query[512];
-    AMRcell cell = selectNearestNeighbor(x, y, z);
-    sprintf(query,"SELECT * FROM Cell WHERE rowid = %i;", cell.getCellIndex());
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
+    LocalProperties lp = getLocalProperties(x, y, z);
 
     std::vector<double> b;
-    b.push_back(atof(queryResults[0][2].c_str()));
-    b.push_back(atof(queryResults[0][3].c_str()));
-    b.push_back(atof(queryResults[0][4].c_str()));
+    b.push_back(lp.getBx());
+    b.push_back(lp.getBy());
+    b.push_back(lp.getBz());
 
     return b;
 }
 
 
+/*********************************************************************************************************/
+// Returns the local properties at points listed in spatial order. Each query also serves, without a query
+// of their own, the next points of the list lying in the serving box of its cell (see
+// CellCache::servingBox), which are found by the pointsInBox kernel.
+// Input:
+//   (x,y,z): arrays with the point coordinates in grid units
+//   points: positions in (x,y,z) of the n points
+// Output:
+//   lp: array of the n local properties, in the order of points
+//
+void AMRgrid::getLocalPropertiesSorted(const double *x, const double *y, const double *z, const long *points, long n, LocalProperties *lp)
+{
+    static thread_local std::vector<double> px, py, pz;
+    static thread_local std::vector<unsigned char> served, inside;
+    px.resize(n);
+    py.resize(n);
+    pz.resize(n);
+    served.assign(n, 0);
+    inside.resize(n);
+    for (long j=0; j<n; j++) {
+        px[j] = periodic ? wrapPeriodic(x[points[j]]) : x[points[j]];
+        py[j] = periodic ? wrapPeriodic(y[points[j]]) : y[points[j]];
+        pz[j] = periodic ? wrapPeriodic(z[points[j]]) : z[points[j]];
+    }
+
+    double h = 0.5 * minCellSize;
+    for (long j=0; j<n; j++) {
+        if (served[j])
+            continue;
+        AMRcell cell = selectNearestWithProperties(px[j], py[j], pz[j], lp[j]);
+        double box[6];
+        if (j + 1 == n || ! CellCache::servingBox(cell, h, box))
+            continue;
+        pointsInBox(&px[j + 1], &py[j + 1], &pz[j + 1], n - j - 1, box, &inside[j + 1]);
+        for (long k=j+1; k<n; k++) {
+            if (inside[k] && ! served[k]) {
+                lp[k] = lp[j];
+                served[k] = 1;
+            }
+        }
+    }
+}
+
+/*********************************************************************************************************/
+// Given n points, returns the local properties at each of them (structure of arrays).
+// The points are processed in Morton order, so that consecutive points fall in the same cells and pages,
+// and are distributed in contiguous chunks over the OpenMP threads; within a chunk, the points falling in
+// the cell found for another one are served without a query (see getLocalPropertiesSorted).
+// Input:
+//   (x,y,z): arrays with the n point coordinates in grid units
+//   n: number of points
+// Output:
+//   rho, Bx, By, Bz: arrays of n values in simulation units; any of them may be NULL if not needed
+// 
+// Unit conversion is done offline
+// The outputs are doubles or floats; floats halve the memory and bandwidth of large batches.
+//
+template<typename T>
+void AMRgrid::localPropertiesBatch(const double *x, const double *y, const double *z, long n, T *rho, T *Bx, T *By, T *Bz)
+{
+    // spatial order of the queries
+    std::vector<std::pair<uint64_t, long> > order(n);
+    double scale = (double) (((uint64_t) 1) << mortonMaxLevel);
+    uint64_t maxCoordinate = (((uint64_t) 1) << mortonMaxLevel) - 1;
+    for (long i=0; i<n; i++) {
+        uint64_t ix = (uint64_t) std::min(std::max(x[i] * scale, 0.), (double) maxCoordinate);
+        uint64_t iy = (uint64_t) std::min(std::max(y[i] * scale, 0.), (double) maxCoordinate);
+        uint64_t iz = (uint64_t) std::min(std::max(z[i] * scale, 0.), (double) maxCoordinate);
+        order[i] = std::make_pair(mortonEncode(ix, iy, iz), i);
+    }
+    std::sort(order.begin(), order.end());
+
+    // exceptions cannot leave a parallel region: the first one is rethrown at the end
+    bool failed = false;
+    std::string error;
+    const long chunk = 256;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c=0; c<n; c+=chunk) {
+        long m = std::min(chunk, n - c);
+        long points[chunk];
+        LocalProperties lp[chunk];
+        for (long j=0; j<m; j++)
+            points[j] = order[c + j].second;
+        try {
+            getLocalPropertiesSorted(x, y, z, points, m, lp);
+            for (long j=0; j<m; j++) {
+                long i = points[j];
+                if (rho != NULL) rho[i] = lp[j].getDensity();
+                if (Bx != NULL) Bx[i] = lp[j].getBx();
+                if (By != NULL) By[i] = lp[j].getBy();
+                if (Bz != NULL) Bz[i] = lp[j].getBz();
+            }
+        } catch (std::exception &e) {
+            #pragma omp critical(AMRgridBatch)
+            {
+                if (! failed)
+                    error = e.what();
+                failed = true;
+            }
+        }
+    }
+    if (failed)
+        throw std::runtime_error(error);
+}
+
+void AMRgrid::getLocalPropertiesBatch(const double *x, const double *y, const double *z, long n, double *rho, double *Bx, double *By, double *Bz)
+{
+    localPropertiesBatch(x, y, z, n, rho, Bx, By, Bz);
+}
+
+void AMRgrid::getLocalPropertiesBatch(const double *x, const double *y, const double *z, long n, float *rho, float *Bx, float *By, float *Bz)
+{
+    localPropertiesBatch(x, y, z, n, rho, Bx, By, Bz);
+}
+
+/*********************************************************************************************************/
+// Given n points, returns the magnetic field at each of them. See getLocalPropertiesBatch.
+//
+void AMRgrid::getMagneticFieldBatch(const double *x, const double *y, const double *z, long n, double *Bx, double *By, double *Bz)
+{
+    getLocalPropertiesBatch(x, y, z, n, NULL, Bx, By, Bz);
+}
+
+/*********************************************************************************************************/
+// Given n points, returns the density at each of them. See getLocalPropertiesBatch.
+//
+void AMRgrid::getDensityBatch(const double *x, const double *y, const double *z, long n, double *rho)
+{
+    getLocalPropertiesBatch(x, y, z, n, rho, NULL, NULL, NULL);
+}
+
+void AMRgrid::getMagneticFieldBatch(const double *x, const double *y, const double *z, long n, float *Bx, float *By, float *Bz)
+{
+    getLocalPropertiesBatch(x, y, z, n, NULL, Bx, By, Bz);
+}
+
+void AMRgrid::getDensityBatch(const double *x, const double *y, const double *z, long n, float *rho)
+{
+    getLocalPropertiesBatch(x, y, z, n, rho, NULL, NULL, NULL);
+}
+
+/*********************************************************************************************************/
+// Vector versions of the batch queries, convenient from Python.
+// The magnetic field is returned as (Bx, By, Bz) triplets, one after the other.
+//
+std::vector<LocalProperties> AMRgrid::getLocalPropertiesBatch(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &z)
+{
+    long n = std::min(x.size(), std::min(y.size(), z.size()));
+    if (n == 0)
+        return std::vector<LocalProperties>();
+    std::vector<double> rho(n), Bx(n), By(n), Bz(n);
+    getLocalPropertiesBatch(&x[0], &y[0], &z[0], n, &rho[0], &Bx[0], &By[0], &Bz[0]);
+
+    std::vector<LocalProperties> lp;
+    lp.reserve(n);
+    for (long i=0; i<n; i++)
+        lp.push_back(LocalProperties(rho[i], Bx[i], By[i], Bz[i]));
+    return lp;
+}
+
+std::vector<double> AMRgrid::getMagneticFieldBatch(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &z)
+{
+    long n = std::min(x.size(), std::min(y.size(), z.size()));
+    if (n == 0)
+        return std::vector<double>();
+    std::vector<double> Bx(n), By(n), Bz(n);
+    getMagneticFieldBatch(&x[0], &y[0], &z[0], n, &Bx[0], &By[0], &Bz[0]);
+
+    std::vector<double> b(3 * n);
+    for (long i=0; i<n; i++) {
+        b[3 * i] = Bx[i];
+        b[3 * i + 1] = By[i];
+        b[3 * i + 2] = Bz[i];
+    }
+    return b;
+}
+
+std::vector<double> AMRgrid::getDensityBatch(const std::vector<double> &x, const std::vector<double> &y, const std::vector<double> &z)
+{
+    long n = std::min(x.size(), std::min(y.size(), z.size()));
+    if (n == 0)
+        return std::vector<double>();
+    std::vector<double> rho(n);
+    getDensityBatch(&x[0], &y[0], &z[0], n, &rho[0]);
+    return rho;
+}
+
+
 /*********************************************************************************************************/ 
 // Get size of the table
 // Input:
@@ -266,21 +1345,267 @@ std::vector<double> AMRgrid::getMagneticField(double x, double y, double z)
 //
 int AMRgrid::getGridSize()
 {
+    if (octree != NULL)
+        return (int) octree->size();
+
 
-    int size=-1;
-    char query[512];
-    sprintf(query,"SELECT COUNT(*) FROM Cell_tree_rowid;");
-    std::vector<std::vector<std::string> > queryResults = DB->query(query);
+    IntegerReader reader;
+    sqlite3_stmt *statement = database().prepareCached(CountStatement, countQuery);
+    DB->step(statement, reader);
 
-    return atoi(queryResults[0][0].c_str());
+    return (int) reader.value;
 }
 
 
 /*********************************************************************************************************/ 
-// Closes the AMRgrid. Equivalent to closing the SQL file.
+// Returns the statistics of the SQL queries of each connection (empty without statistics, or once the
+// database is closed, as with the octree backends). Entry k of SQLiteConnectionStatistics::queries
+// holds the queries of kind k, named by getQueryKind(k).
+//
+std::vector<SQLiteConnectionStatistics> AMRgrid::getStatistics()
+{
+    if (DB == NULL || ! DB->getStatisticsEnabled())
+        return std::vector<SQLiteConnectionStatistics>();
+    return DB->getStatistics();
+}
+
+void AMRgrid::resetStatistics()
+{
+    if (DB != NULL)
+        DB->resetStatistics();
+    resetCellCacheCounters();
+    if (prefetcher != NULL)
+        prefetcher->resetCounters();
+}
+
+/*********************************************************************************************************/ 
+// Returns the name of a kind of query, i.e. of a slot of the prepared statement cache
+//
+std::string AMRgrid::getQueryKind(int kind)
+{
+    switch (kind) {
+        case RegionStatement: return "region";
+        case CellStatement: return "cell";
+        case CellTreeStatement: return "cellTree";
+        case CountStatement: return "count";
+        case RegionJoinStatement: return "regionJoin";
+        case IndexRangeStatement: return "indexRange";
+        case DensityAboveStatement: return "densityAbove";
+        case SQLiteDB::maxCachedStatements: return "uncached";
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "slot%d", kind);
+    return name;
+}
+
+/*********************************************************************************************************/ 
+// Returns the statistics of the queries and of the cell cache as a JSON document:
+//   {"cellCache": {"hits": n, "misses": n},
+//    "prefetch": {"hits": n, "misses": n, "regions": n, "dropped": n},    (if prefetching)
+//    "connections": [{"connection": n, "busyRetries": n, "bytesRead": n,
+//                     "queries": {"<kind>": {"count": n, "rows": n, "seconds": t,
+//                                            "latencyHistogram": [[upper bound in us, count], ...]}}}]}
+// Only kinds that ran at least once, and non-empty histogram buckets, are listed.
+//
+std::string AMRgrid::getStatisticsJSON()
+{
+    std::ostringstream json;
+    json << "{\"cellCache\": {\"hits\": " << getCellCacheHits() << ", \"misses\": " << getCellCacheMisses() << "},\n";
+    if (prefetcher != NULL)
+        json << " \"prefetch\": {\"hits\": " << prefetcher->getHits() << ", \"misses\": " << prefetcher->getMisses() << ", \"regions\": " << prefetcher->getFetchedRegions() << ", \"dropped\": " << prefetcher->getDroppedRequests() << "},\n";
+    json << " \"connections\": [";
+    std::vector<SQLiteConnectionStatistics> statistics = getStatistics();
+    for (size_t n=0; n<statistics.size(); n++) {
+        const SQLiteConnectionStatistics &s = statistics[n];
+        json << (n > 0 ? ",\n  " : "\n  ");
+        json << "{\"connection\": " << s.connection << ", \"busyRetries\": " << s.busyRetries << ", \"bytesRead\": " << s.bytesRead << ", \"queries\": {";
+        bool first = true;
+        for (size_t k=0; k<s.queries.size(); k++) {
+            const SQLiteQueryStatistics &q = s.queries[k];
+            if (q.count == 0)
+                continue;
+            json << (first ? "" : ", ") << "\"" << getQueryKind(k) << "\": {\"count\": " << q.count << ", \"rows\": " << q.rows << ", \"seconds\": " << q.seconds << ", \"latencyHistogram\": [";
+            bool firstBucket = true;
+            for (int i=0; i<SQLiteQueryStatistics::nLatencyBuckets; i++) {
+                if (q.histogram[i] == 0)
+                    continue;
+                json << (firstBucket ? "" : ", ") << "[" << (1ULL << i) << ", " << q.histogram[i] << "]";
+                firstBucket = false;
+            }
+            json << "]}";
+            first = false;
+        }
+        json << "}}";
+    }
+    json << "]}\n";
+    return json.str();
+}
+
+/*********************************************************************************************************/ 
+// Statistics of the per-thread cell cache of getLocalProperties, summed over all threads
+//
+unsigned long long AMRgrid::getCellCacheHits()
+{
+    return (cellCache != NULL) ? cellCache->getHits() : 0;
+}
+
+unsigned long long AMRgrid::getCellCacheMisses()
+{
+    return (cellCache != NULL) ? cellCache->getMisses() : 0;
+}
+
+void AMRgrid::resetCellCacheCounters()
+{
+    if (cellCache != NULL)
+        cellCache->resetCounters();
+}
+
+/*********************************************************************************************************/ 
+// Announces the path of a particle, so that the cells ahead of it are fetched in the background (see
+// AMRgridOptions::prefetchThreads; without prefetching, does nothing). The region fetched reaches the
+// given distance along the direction and is as wide, sideways, as half of it, for curved paths; nothing
+// is fetched while the first half of the path lies in a region already fetched or queued, so the hint
+// can be given at every step.
+// Input:
+//   (x,y,z): position in grid units
+//   (dx,dy,dz): direction, of any norm
+//   distance: length of the path ahead in grid units
+//
+void AMRgrid::prefetch(double x, double y, double z, double dx, double dy, double dz, double distance)
+{
+    double norm = sqrt(dx * dx + dy * dy + dz * dz);
+    if (prefetcher == NULL || norm == 0 || distance <= 0)
+        return;
+    if (periodic) {
+        x = wrapPeriodic(x);
+        y = wrapPeriodic(y);
+        z = wrapPeriodic(z);
+    }
+    double p[3] = {x, y, z};
+    double u[3] = {dx / norm, dy / norm, dz / norm};
+    double h = 0.5 * minCellSize;
+    double near[6], far[6];
+    for (int k=0; k<3; k++) {
+        double mid = p[k] + 0.5 * distance * u[k];
+        double end = p[k] + distance * u[k];
+        near[2 * k] = std::min(p[k], mid) - h;
+        near[2 * k + 1] = std::max(p[k], mid) + h;
+        far[2 * k] = std::min(p[k], end) - h - 0.25 * distance;
+        far[2 * k + 1] = std::max(p[k], end) + h + 0.25 * distance;
+    }
+    if (prefetcher->covers(near[0], near[1], near[2], near[3], near[4], near[5]))
+        return;
+    prefetcher->request(far[0], far[1], far[2], far[3], far[4], far[5]);
+}
+
+/*********************************************************************************************************/ 
+// Requests the background fetch of a region (see prefetch)
+// Input:
+//   (x,y,z)(min,max): bounds of the region in grid units
+//
+void AMRgrid::prefetchRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    if (prefetcher != NULL)
+        prefetcher->request(xmin, xmax, ymin, ymax, zmin, zmax);
+}
+
+/*********************************************************************************************************/ 
+// Blocks until the regions requested have been fetched
+//
+void AMRgrid::waitForPrefetch()
+{
+    if (prefetcher != NULL)
+        prefetcher->wait();
+}
+
+/*********************************************************************************************************/ 
+// Points of getLocalProperties answered, or not, from the prefetched regions (after the cell cache)
+//
+unsigned long long AMRgrid::getPrefetchHits()
+{
+    return (prefetcher != NULL) ? prefetcher->getHits() : 0;
+}
+
+unsigned long long AMRgrid::getPrefetchMisses()
+{
+    return (prefetcher != NULL) ? prefetcher->getMisses() : 0;
+}
+
+
+/*********************************************************************************************************/ 
+// Returns the database answering the SQLite queries, or throws if the grid was closed (or the octree
+// backend released it after loading the cells)
+//
+SQLiteDB& AMRgrid::database()
+{
+    if (DB == NULL)
+        throw std::runtime_error("The database of the grid is closed.");
+    return *DB;
+}
+
+/*********************************************************************************************************/ 
+// Closes the AMRgrid. Equivalent to closing the SQL file. Later queries needing the database throw.
 void AMRgrid::close()
 {
-    DB->close();
+    // the I/O threads of the prefetcher query the database
+    delete prefetcher;
+    prefetcher = NULL;
+    if (DB != NULL) {
+        DB->close();
+        delete DB;
+        DB = NULL;
+    }
+}
+
+/*********************************************************************************************************/ 
+// Octree backend: returns the position of the nearest neighbor of a point, with the same neighbourhood and
+// selection rule as the SQLite queries.
+// Input:
+//   (x,y,z): point coordinates in grid units
+// Output:
+//   position of the cell in the octree
+//
+long AMRgrid::selectNearestPosition(double x, double y, double z)
+{
+    double prefactor = 0.5;
+    NearestCandidates &candidates = threadCandidates();
+    octree->findCellsRegion(x - prefactor * minCellSize, x + prefactor * minCellSize, y - prefactor * minCellSize, y + prefactor * minCellSize, z - prefactor * minCellSize, z + prefactor * minCellSize, candidates.positions);
+    if (candidates.positions.empty())
+        throw std::runtime_error("No cell found around the requested position.");
+
+    for (int i=0; i<candidates.positions.size(); i++) {
+        AMRcell cell = octree->getCell(candidates.positions[i]);
+        candidates.add(cell);
+    }
+    return candidates.positions[candidates.select(x, y, z)];
+}
+
+/*********************************************************************************************************/ 
+// Periodic mode: nearest neighbour of a point whose neighbourhood straddles faces of the cube. The parts
+// of the neighbourhood are queried one by one and the cells found across a face compete with the
+// position of their image next to the point.
+// Input:
+//   (x,y,z): point coordinates in grid units, in the unit cube
+// Output:
+//   lp: local properties of the cell
+//   nearest cell
+//
+AMRcell AMRgrid::selectNearestPeriodic(double x, double y, double z, LocalProperties &lp)
+{
+    double h = 0.5 * minCellSize;
+    PeriodicSplit split(x - h, x + h, y - h, y + h, z - h, z + h);
+    NearestCandidates &candidates = threadCandidates();
+    for (int i=0; i<split.n; i++) {
+        double *b = split.box[i];
+        PeriodicCandidateCollector collector(candidates, split.offset[i]);
+        visitCellsRegion(b[0], b[1], b[2], b[3], b[4], b[5], collector);
+    }
+    if (candidates.cells.empty())
+        throw std::runtime_error("No cell found around the requested position.");
+
+    long best = candidates.select(x, y, z);
+    lp = candidates.properties[best];
+    return candidates.cells[best];
 }
 
 } // namespace
\ No newline at end of file
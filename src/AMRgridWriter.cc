@@ -0,0 +1,221 @@
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+#include "saga/AMRgridWriter.h"
+
+
+namespace saga{
+
+// rows inserted by one statement: 5 parameters each, below the 999 parameters SQLite accepts by default
+static const int rowsPerStatement = 100;
+
+/*********************************************************************************************************/
+// Default options
+//
+AMRgridWriterOptions::AMRgridWriterOptions()
+{
+    batchSize = 65536;
+    transactionSize = 1 << 22;
+    pageSize = 4096;
+}
+
+/*********************************************************************************************************/
+// Constructor: creates the database, with its table of cells
+// Input:
+//   filename: SAGA database to write (overwritten)
+//   options: see AMRgridWriterOptions
+//
+AMRgridWriter::AMRgridWriter(std::string filename, AMRgridWriterOptions opt) : options(opt), db(NULL), insertRows(NULL), insertRow(NULL), nCells(0), nWritten(0), nInTransaction(0)
+{
+    if (options.batchSize < 1 || options.transactionSize < 1)
+        throw std::runtime_error("Invalid options of the grid writer.");
+
+    remove(filename.c_str());
+    if (sqlite3_open(filename.c_str(), &db) != SQLITE_OK) {
+        sqlite3_close(db);
+        db = NULL;
+        throw std::runtime_error("Cannot create " + filename + ".");
+    }
+    try {
+        char pragmas[160];
+        snprintf(pragmas, sizeof(pragmas), "PRAGMA page_size=%d; PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; PRAGMA locking_mode=EXCLUSIVE;", options.pageSize);
+        execute(pragmas);
+        execute("CREATE TABLE Cell(rho REAL, Bx REAL, By REAL, Bz REAL);");
+
+        std::string sql = "INSERT INTO Cell(rowid, rho, Bx, By, Bz) VALUES (?, ?, ?, ?, ?)";
+        if (sqlite3_prepare_v2(db, (sql + ";").c_str(), -1, &insertRow, NULL) != SQLITE_OK)
+            throw std::runtime_error(std::string("Failed to write the cells: ") + sqlite3_errmsg(db));
+        for (int i=1; i<rowsPerStatement; i++)
+            sql += ", (?, ?, ?, ?, ?)";
+        if (sqlite3_prepare_v2(db, (sql + ";").c_str(), -1, &insertRows, NULL) != SQLITE_OK)
+            throw std::runtime_error(std::string("Failed to write the cells: ") + sqlite3_errmsg(db));
+        execute("BEGIN;");
+    } catch (std::runtime_error &e) {
+        release();
+        throw;
+    }
+}
+
+/*********************************************************************************************************/
+// Destructor: closes the writer if needed
+//
+AMRgridWriter::~AMRgridWriter()
+{
+    try {
+        close();
+    } catch (std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+void AMRgridWriter::execute(const char *sql)
+{
+    if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+        throw std::runtime_error(std::string("Failed to write the cells: ") + sqlite3_errmsg(db));
+}
+
+/*********************************************************************************************************/
+// Adds a cell
+// Input:
+//   (x,y,z)(min,max): bounds of the cell in grid units, those of a cell of the octree of the unit box (see
+//                     CompactCell::octreeLevel)
+//   rho, Bx, By, Bz: density and magnetic field in the cell
+// Output:
+//   index of the cell
+//
+long AMRgridWriter::addCell(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, double rho, double Bx, double By, double Bz)
+{
+    if (db == NULL)
+        throw std::runtime_error("The grid writer is closed.");
+    if (CompactCell::octreeLevel(xmin, xmax, ymin, ymax, zmin, zmax) < 0)
+        throw std::runtime_error("Invalid bounds of a cell: not a cube of dyadic size aligned with the octree of the unit box.");
+
+    nCells++;
+    tree.add(nCells, xmin, xmax, ymin, ymax, zmin, zmax);
+    values.push_back(rho);
+    values.push_back(Bx);
+    values.push_back(By);
+    values.push_back(Bz);
+    if (values.size() >= 4 * (size_t) options.batchSize)
+        flush();
+    return nCells;
+}
+
+/*********************************************************************************************************/
+// Adds a batch of cells, given by columns or as a cell set with its local properties. Their indices
+// follow that of the last cell added.
+// Input:
+//   n: number of cells
+//   (x,y,z)(min,max): bounds of the cells in grid units
+//   rho, Bx, By, Bz: density and magnetic field in the cells
+//
+void AMRgridWriter::addCells(long n, const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, const double *rho, const double *Bx, const double *By, const double *Bz)
+{
+    for (long i=0; i<n; i++)
+        addCell(xmin[i], xmax[i], ymin[i], ymax[i], zmin[i], zmax[i], rho[i], Bx[i], By[i], Bz[i]);
+}
+
+void AMRgridWriter::addCells(const CellSet &cells)
+{
+    if (cells.empty())
+        return;
+    if (! cells.hasProperties())
+        throw std::runtime_error("The cell set holds no local properties.");
+    long n = cells.size();
+    std::vector<double> bounds(6 * n);
+    double *b = &bounds[0];
+    cells.getBounds(b, b + n, b + 2 * n, b + 3 * n, b + 4 * n, b + 5 * n);
+    addCells(n, b, b + n, b + 2 * n, b + 3 * n, b + 4 * n, b + 5 * n, cells.getDensities(), cells.getBx(), cells.getBy(), cells.getBz());
+}
+
+/*********************************************************************************************************/
+// Writes the rows of the buffered cells, committing the transaction once it holds transactionSize cells
+//
+// If a write fails, the rows written before it cannot be told apart from the others without a journal:
+// the writer is then closed, the file being invalid, so that no later flush inserts them again.
+//
+void AMRgridWriter::flush()
+{
+    if (db == NULL)
+        return;
+    try {
+        long n = values.size() / 4;
+        long i = 0;
+        for (; i+rowsPerStatement<=n; i+=rowsPerStatement)
+            writeRows(i, rowsPerStatement, insertRows);
+        for (; i<n; i++)
+            writeRows(i, 1, insertRow);
+        values.clear();
+        nWritten += n;
+        nInTransaction += n;
+        if (nInTransaction >= options.transactionSize) {
+            execute("COMMIT; BEGIN;");
+            nInTransaction = 0;
+        }
+    } catch (std::runtime_error &e) {
+        release();
+        throw;
+    }
+}
+
+void AMRgridWriter::writeRows(long first, long n, sqlite3_stmt *statement)
+{
+    for (long r=0; r<n; r++) {
+        const double *v = &values[4 * (first + r)];
+        int p = 5 * r + 1;
+        sqlite3_bind_int64(statement, p, nWritten + first + r + 1);
+        sqlite3_bind_double(statement, p + 1, v[0]);
+        sqlite3_bind_double(statement, p + 2, v[1]);
+        sqlite3_bind_double(statement, p + 3, v[2]);
+        sqlite3_bind_double(statement, p + 4, v[3]);
+    }
+    if (sqlite3_step(statement) != SQLITE_DONE) {
+        sqlite3_reset(statement);
+        throw std::runtime_error(std::string("Failed to write the cells: ") + sqlite3_errmsg(db));
+    }
+    sqlite3_reset(statement);
+}
+
+/*********************************************************************************************************/
+// Writes the remaining cells and the R-tree, and closes the database
+//
+void AMRgridWriter::close()
+{
+    if (db == NULL)
+        return;
+    try {
+        flush();
+        tree.write(db, "Cell_tree");
+        execute("COMMIT;");
+    } catch (std::runtime_error &e) {
+        release();
+        throw;
+    }
+    release();
+}
+
+/*********************************************************************************************************/
+// Closes the database without writing anything more, and drops the buffered cells
+//
+void AMRgridWriter::release()
+{
+    sqlite3_finalize(insertRow);
+    sqlite3_finalize(insertRows);
+    sqlite3_close(db);
+    insertRow = NULL;
+    insertRows = NULL;
+    db = NULL;
+    values.clear();
+    tree.clear();
+}
+
+/*********************************************************************************************************/
+// Returns the number of cells added
+//
+long AMRgridWriter::getNumberOfCells() const
+{
+    return nCells;
+}
+
+} // namespace
@@ -1,27 +1,44 @@
-#include "saga/MagneticField.h"
+#include "saga/BaryonDensity.h"
 
 
 
 namespace saga {
 
 /*********************************************************************************************************/ 
-// Constructor Magnetic Field
-BaryonDensity::BaryonDensity(ref_ptr<AMRgrid> grid)
+// Constructor Baryon Density
+// Input:
+//   grid: AMR grid
+//   interpolate: whether the density is interpolated between cell centres (see FieldInterpolator) 
+//                instead of taken from the nearest cell
+BaryonDensity::BaryonDensity(ref_ptr<AMRgrid> grid, bool interpolate)
 {
     TheGrid = grid;
+    setInterpolation(interpolate);
 }
 
 /*********************************************************************************************************/ 
-// Destructor Magnetic Field
-MagneticField::~MagneticField()
+// Destructor Baryon Density
+BaryonDensity::~BaryonDensity()
 {
 }
 
+/*********************************************************************************************************/ 
+// Switches between the value of the nearest cell and the interpolated density
+void BaryonDensity::setInterpolation(bool interpolate)
+{
+    Interpolator = interpolate ? new FieldInterpolator(TheGrid) : NULL;
+}
+
+bool BaryonDensity::getInterpolation() const
+{
+    return Interpolator.valid();
+}
+
 /*********************************************************************************************************/ 
 // Get density
-double MagneticField::getDensity(double x, double y, double z) const
+double BaryonDensity::getDensity(double x, double y, double z) const
 {
-    LocalProperties lp = TheGrid->getLocalProperties(x, y, z);
+    LocalProperties lp = Interpolator.valid() ? Interpolator->getLocalProperties(x, y, z) : TheGrid->getLocalProperties(x, y, z);
 	return lp.getDensity();
 }
 
@@ -0,0 +1,197 @@
+#include "saga/CellCache.h"
+
+
+namespace saga{
+
+// maximum number of grids whose entries a thread keeps at the same time
+static const size_t maxGridsPerThread = 8;
+
+// margin, relative to the cell size, kept inside the serving box of a cell; far above the rounding errors
+// of the neighbourhoods and distances computed by the queries
+static const double servingMargin = 1e-6;
+
+static std::atomic<unsigned long> nextCacheId(1);
+
+struct CellCache::Entry
+{
+    double box[6];              // serving box of the cell
+    LocalProperties lp;
+};
+
+struct CellCache::ThreadEntries
+{
+    unsigned long owner;
+    int nValid;
+    int next;
+    int last;
+    std::vector<Entry> entries;
+    std::shared_ptr<CellCacheCounters> counters;
+};
+
+static inline void increment(std::atomic<unsigned long long> &counter)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/*********************************************************************************************************/
+// Constructor
+// Input:
+//   nEntries: number of cells kept per thread
+//
+CellCache::CellCache(int nEntries)
+{
+    id = nextCacheId++;
+    size = nEntries;
+}
+
+/*********************************************************************************************************/
+// Destructor
+CellCache::~CellCache()
+{
+}
+
+/*********************************************************************************************************/
+// Returns the entries of the calling thread, creating them on first use
+//
+CellCache::ThreadEntries& CellCache::local()
+{
+    static thread_local std::vector<ThreadEntries> caches;
+    for (size_t i=0; i<caches.size(); i++) {
+        if (caches[i].owner == id)
+            return caches[i];
+    }
+
+    if (caches.size() >= maxGridsPerThread)
+        caches.erase(caches.begin());
+    ThreadEntries t;
+    t.owner = id;
+    t.nValid = 0;
+    t.next = 0;
+    t.last = 0;
+    t.entries.resize(size);
+    t.counters = std::make_shared<CellCacheCounters>();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.push_back(t.counters);
+    }
+    caches.push_back(t);
+    return caches.back();
+}
+
+/*********************************************************************************************************/
+// Looks up a point in the cells cached by the calling thread.
+// Input:
+//   (x,y,z): point coordinates in grid units
+// Output:
+//   lp: local properties of the cached cell, if found
+//   true in case of a hit
+//
+bool CellCache::lookup(double x, double y, double z, LocalProperties &lp)
+{
+    ThreadEntries &t = local();
+
+    // most recent entry first
+    for (int n=0; n<t.nValid; n++) {
+        int i = (t.last - n + size) % size;
+        const Entry &e = t.entries[i];
+        if (x >= e.box[0] && x <= e.box[1] && y >= e.box[2] && y <= e.box[3] && z >= e.box[4] && z <= e.box[5]) {
+            t.last = i;
+            lp = e.lp;
+            increment(t.counters->hits);
+            return true;
+        }
+    }
+    increment(t.counters->misses);
+    return false;
+}
+
+/*********************************************************************************************************/
+// Returns the box of the points whose nearest cell is, for AMRgrid, the given cell (boundaries included):
+// - for a coarse cell, the points whose neighbourhood (a box of half width halfWidth) lies strictly
+//   inside the cell, so that no other cell is a candidate;
+// - for a cell of the finest level (of size 2 * halfWidth), the points inside it: the centre of any other
+//   candidate, of the same level across a face or coarser, is at least as far.
+// Both keep a small margin from the faces, where the index decides between equally distant cells.
+// Input:
+//   cell: cell selected by a query
+//   halfWidth: half width of the neighbourhood searched around each point, half the finest cell size
+// Output:
+//   box: serving box, {xmin, xmax, ymin, ymax, zmin, zmax}
+//   false for cells smaller than those of the finest level, which the grid should not hold
+//
+bool CellCache::servingBox(AMRcell &cell, double halfWidth, double box[6])
+{
+    double cellSize = cell.getXmax() - cell.getXmin();
+    if (cellSize < 2 * halfWidth)
+        return false;
+    double pad = ((cellSize > 2 * halfWidth) ? halfWidth : 0) + servingMargin * cellSize;
+    box[0] = cell.getXmin() + pad;
+    box[1] = cell.getXmax() - pad;
+    box[2] = cell.getYmin() + pad;
+    box[3] = cell.getYmax() - pad;
+    box[4] = cell.getZmin() + pad;
+    box[5] = cell.getZmax() - pad;
+    return true;
+}
+
+/*********************************************************************************************************/
+// Stores a cell returned by a query in the entries of the calling thread, replacing the oldest one.
+// Input:
+//   cell: cell selected by the query
+//   lp: local properties of the cell
+//   halfWidth: half width of the neighbourhood searched around each point, half the finest cell size
+//
+void CellCache::insert(AMRcell &cell, const LocalProperties &lp, double halfWidth)
+{
+    double box[6];
+    if (size <= 0 || ! servingBox(cell, halfWidth, box))
+        return;
+
+    ThreadEntries &t = local();
+    Entry &e = t.entries[t.next];
+    for (int k=0; k<6; k++)
+        e.box[k] = box[k];
+    e.lp = lp;
+    t.last = t.next;
+    t.next = (t.next + 1) % size;
+    if (t.nValid < size)
+        t.nValid++;
+}
+
+/*********************************************************************************************************/
+// Returns the number of hits, summed over all threads
+//
+unsigned long long CellCache::getHits() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long n = 0;
+    for (size_t i=0; i<counters.size(); i++)
+        n += counters[i]->hits.load(std::memory_order_relaxed);
+    return n;
+}
+
+/*********************************************************************************************************/
+// Returns the number of misses, summed over all threads
+//
+unsigned long long CellCache::getMisses() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long long n = 0;
+    for (size_t i=0; i<counters.size(); i++)
+        n += counters[i]->misses.load(std::memory_order_relaxed);
+    return n;
+}
+
+/*********************************************************************************************************/
+// Sets the counters of all threads to zero. Lookups running concurrently may be lost.
+//
+void CellCache::resetCounters()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i=0; i<counters.size(); i++) {
+        counters[i]->hits.store(0, std::memory_order_relaxed);
+        counters[i]->misses.store(0, std::memory_order_relaxed);
+    }
+}
+
+} // namespace
@@ -0,0 +1,308 @@
+#include <atomic>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "saga/CellKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define SAGA_X86_KERNELS
+    #include <immintrin.h>
+#endif
+
+
+namespace saga{
+
+/*********************************************************************************************************/
+// Scalar implementations; the vector ones process their tails with them
+//
+static void distancesScalar(const double *cx, const double *cy, const double *cz, long n, double x, double y, double z, double *d)
+{
+    for (long i=0; i<n; i++) {
+        double dx = cx[i] - x;
+        double dy = cy[i] - y;
+        double dz = cz[i] - z;
+        d[i] = sqrt(dx * dx + dy * dy + dz * dz);
+    }
+}
+
+static void boxesOverlapScalar(const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, long n, const double box[6], unsigned char *overlap)
+{
+    for (long i=0; i<n; i++)
+        overlap[i] = xmax[i] >= box[0] && xmin[i] <= box[1] && ymax[i] >= box[2] && ymin[i] <= box[3] && zmax[i] >= box[4] && zmin[i] <= box[5];
+}
+
+static void pointsInBoxScalar(const double *x, const double *y, const double *z, long n, const double box[6], unsigned char *inside)
+{
+    for (long i=0; i<n; i++)
+        inside[i] = x[i] >= box[0] && x[i] <= box[1] && y[i] >= box[2] && y[i] <= box[3] && z[i] >= box[4] && z[i] <= box[5];
+}
+
+#ifdef SAGA_X86_KERNELS
+
+/*********************************************************************************************************/
+// AVX2: 4 cells per instruction. No FMA, so that the roundings are those of the scalar code.
+//
+__attribute__((target("avx2")))
+static void distancesAVX2(const double *cx, const double *cy, const double *cz, long n, double x, double y, double z, double *d)
+{
+    __m256d px = _mm256_set1_pd(x);
+    __m256d py = _mm256_set1_pd(y);
+    __m256d pz = _mm256_set1_pd(z);
+    long i = 0;
+    for (; i+4<=n; i+=4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(cx + i), px);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(cy + i), py);
+        __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(cz + i), pz);
+        __m256d s = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+        _mm256_storeu_pd(d + i, _mm256_sqrt_pd(s));
+    }
+    distancesScalar(cx + i, cy + i, cz + i, n - i, x, y, z, d + i);
+}
+
+// mask of the lanes with lo <= v <= hi
+__attribute__((target("avx2")))
+static inline __m256d betweenAVX2(__m256d v, __m256d lo, __m256d hi)
+{
+    return _mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ), _mm256_cmp_pd(v, hi, _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2")))
+static inline void storeMaskAVX2(__m256d mask, unsigned char *out)
+{
+    int bits = _mm256_movemask_pd(mask);
+    for (int k=0; k<4; k++)
+        out[k] = (bits >> k) & 1;
+}
+
+__attribute__((target("avx2")))
+static void boxesOverlapAVX2(const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, long n, const double box[6], unsigned char *overlap)
+{
+    __m256d b[6];
+    for (int k=0; k<6; k++)
+        b[k] = _mm256_set1_pd(box[k]);
+    long i = 0;
+    for (; i+4<=n; i+=4) {
+        __m256d m = _mm256_and_pd(_mm256_cmp_pd(_mm256_loadu_pd(xmax + i), b[0], _CMP_GE_OQ), _mm256_cmp_pd(_mm256_loadu_pd(xmin + i), b[1], _CMP_LE_OQ));
+        m = _mm256_and_pd(m, _mm256_and_pd(_mm256_cmp_pd(_mm256_loadu_pd(ymax + i), b[2], _CMP_GE_OQ), _mm256_cmp_pd(_mm256_loadu_pd(ymin + i), b[3], _CMP_LE_OQ)));
+        m = _mm256_and_pd(m, _mm256_and_pd(_mm256_cmp_pd(_mm256_loadu_pd(zmax + i), b[4], _CMP_GE_OQ), _mm256_cmp_pd(_mm256_loadu_pd(zmin + i), b[5], _CMP_LE_OQ)));
+        storeMaskAVX2(m, overlap + i);
+    }
+    boxesOverlapScalar(xmin + i, xmax + i, ymin + i, ymax + i, zmin + i, zmax + i, n - i, box, overlap + i);
+}
+
+__attribute__((target("avx2")))
+static void pointsInBoxAVX2(const double *x, const double *y, const double *z, long n, const double box[6], unsigned char *inside)
+{
+    __m256d b[6];
+    for (int k=0; k<6; k++)
+        b[k] = _mm256_set1_pd(box[k]);
+    long i = 0;
+    for (; i+4<=n; i+=4) {
+        __m256d m = betweenAVX2(_mm256_loadu_pd(x + i), b[0], b[1]);
+        m = _mm256_and_pd(m, betweenAVX2(_mm256_loadu_pd(y + i), b[2], b[3]));
+        m = _mm256_and_pd(m, betweenAVX2(_mm256_loadu_pd(z + i), b[4], b[5]));
+        storeMaskAVX2(m, inside + i);
+    }
+    pointsInBoxScalar(x + i, y + i, z + i, n - i, box, inside + i);
+}
+
+/*********************************************************************************************************/
+// AVX-512: 8 cells per instruction. The file is built with -ffp-contract=off, so that the FMA enabled by
+// the target is not used and the roundings are those of the scalar code.
+//
+__attribute__((target("avx512f")))
+static void distancesAVX512(const double *cx, const double *cy, const double *cz, long n, double x, double y, double z, double *d)
+{
+    __m512d px = _mm512_set1_pd(x);
+    __m512d py = _mm512_set1_pd(y);
+    __m512d pz = _mm512_set1_pd(z);
+    long i = 0;
+    for (; i+8<=n; i+=8) {
+        __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(cx + i), px);
+        __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(cy + i), py);
+        __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(cz + i), pz);
+        __m512d s = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+        _mm512_storeu_pd(d + i, _mm512_sqrt_pd(s));
+    }
+    distancesScalar(cx + i, cy + i, cz + i, n - i, x, y, z, d + i);
+}
+
+static inline void storeMask8(__mmask8 mask, unsigned char *out)
+{
+    for (int k=0; k<8; k++)
+        out[k] = (mask >> k) & 1;
+}
+
+__attribute__((target("avx512f")))
+static void boxesOverlapAVX512(const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, long n, const double box[6], unsigned char *overlap)
+{
+    __m512d b[6];
+    for (int k=0; k<6; k++)
+        b[k] = _mm512_set1_pd(box[k]);
+    long i = 0;
+    for (; i+8<=n; i+=8) {
+        __mmask8 m = _mm512_cmp_pd_mask(_mm512_loadu_pd(xmax + i), b[0], _CMP_GE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, _mm512_loadu_pd(xmin + i), b[1], _CMP_LE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, _mm512_loadu_pd(ymax + i), b[2], _CMP_GE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, _mm512_loadu_pd(ymin + i), b[3], _CMP_LE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, _mm512_loadu_pd(zmax + i), b[4], _CMP_GE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, _mm512_loadu_pd(zmin + i), b[5], _CMP_LE_OQ);
+        storeMask8(m, overlap + i);
+    }
+    boxesOverlapScalar(xmin + i, xmax + i, ymin + i, ymax + i, zmin + i, zmax + i, n - i, box, overlap + i);
+}
+
+__attribute__((target("avx512f")))
+static void pointsInBoxAVX512(const double *x, const double *y, const double *z, long n, const double box[6], unsigned char *inside)
+{
+    __m512d b[6];
+    for (int k=0; k<6; k++)
+        b[k] = _mm512_set1_pd(box[k]);
+    long i = 0;
+    for (; i+8<=n; i+=8) {
+        __m512d vx = _mm512_loadu_pd(x + i);
+        __m512d vy = _mm512_loadu_pd(y + i);
+        __m512d vz = _mm512_loadu_pd(z + i);
+        __mmask8 m = _mm512_cmp_pd_mask(vx, b[0], _CMP_GE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, vx, b[1], _CMP_LE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, vy, b[2], _CMP_GE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, vy, b[3], _CMP_LE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, vz, b[4], _CMP_GE_OQ);
+        m = _mm512_mask_cmp_pd_mask(m, vz, b[5], _CMP_LE_OQ);
+        storeMask8(m, inside + i);
+    }
+    pointsInBoxScalar(x + i, y + i, z + i, n - i, box, inside + i);
+}
+
+#endif
+
+/*********************************************************************************************************/
+// Implementations of the kernels for one instruction set
+//
+struct KernelTable
+{
+    const char *name;
+    void (*distances)(const double*, const double*, const double*, long, double, double, double, double*);
+    void (*boxesOverlap)(const double*, const double*, const double*, const double*, const double*, const double*, long, const double*, unsigned char*);
+    void (*pointsInBox)(const double*, const double*, const double*, long, const double*, unsigned char*);
+};
+
+static const KernelTable scalarKernels = {"scalar", distancesScalar, boxesOverlapScalar, pointsInBoxScalar};
+#ifdef SAGA_X86_KERNELS
+static const KernelTable avx2Kernels = {"avx2", distancesAVX2, boxesOverlapAVX2, pointsInBoxAVX2};
+static const KernelTable avx512Kernels = {"avx512", distancesAVX512, boxesOverlapAVX512, pointsInBoxAVX512};
+#endif
+
+// kernels of an instruction set, or NULL if the CPU does not support it
+static const KernelTable* findKernels(std::string name)
+{
+    if (name == "scalar")
+        return &scalarKernels;
+#ifdef SAGA_X86_KERNELS
+    __builtin_cpu_init();
+    if (name == "avx512" && __builtin_cpu_supports("avx512f"))
+        return &avx512Kernels;
+    if (name == "avx2" && __builtin_cpu_supports("avx2"))
+        return &avx2Kernels;
+#endif
+    return NULL;
+}
+
+static std::atomic<const KernelTable*>& currentKernels()
+{
+    static std::atomic<const KernelTable*> kernels(findKernels("avx512") != NULL ? findKernels("avx512") : findKernels("avx2") != NULL ? findKernels("avx2") : &scalarKernels);
+    return kernels;
+}
+
+/*********************************************************************************************************/
+// Distances between a point and the centres of n cells
+// Input:
+//   (cx,cy,cz): arrays with the n centres
+//   (x,y,z): point coordinates in grid units
+// Output:
+//   d: array of n distances
+//
+void distancesToPoint(const double *cx, const double *cy, const double *cz, long n, double x, double y, double z, double *d)
+{
+    currentKernels().load(std::memory_order_relaxed)->distances(cx, cy, cz, n, x, y, z, d);
+}
+
+/*********************************************************************************************************/
+// Selects the cell whose centre is the nearest to a point; ties are broken by the lowest index, as in
+// AMRgrid.
+// Input:
+//   (cx,cy,cz): arrays with the n centres
+//   indices: array with the n cell indices
+//   (x,y,z): point coordinates in grid units
+// Output:
+//   position of the nearest cell in the arrays, or -1 if n is 0
+//
+long selectNearestCentre(const double *cx, const double *cy, const double *cz, const int32_t *indices, long n, double x, double y, double z)
+{
+    const long stackSize = 64;
+    double stackDistances[stackSize];
+    std::vector<double> heapDistances;
+    double *d = stackDistances;
+    if (n > stackSize) {
+        heapDistances.resize(n);
+        d = &heapDistances[0];
+    }
+    distancesToPoint(cx, cy, cz, n, x, y, z, d);
+
+    long best = (n > 0) ? 0 : -1;
+    for (long i=1; i<n; i++) {
+        if (d[i] < d[best] || (d[i] == d[best] && indices[i] < indices[best]))
+            best = i;
+    }
+    return best;
+}
+
+/*********************************************************************************************************/
+// Tests which of n cells overlap a box, boundaries included
+// Input:
+//   (x,y,z)(min,max): arrays with the bounds of the n cells
+//   box: bounds of the box, {xmin, xmax, ymin, ymax, zmin, zmax}
+// Output:
+//   overlap: array of n flags
+//
+void boxesOverlapBox(const double *xmin, const double *xmax, const double *ymin, const double *ymax, const double *zmin, const double *zmax, long n, const double box[6], unsigned char *overlap)
+{
+    currentKernels().load(std::memory_order_relaxed)->boxesOverlap(xmin, xmax, ymin, ymax, zmin, zmax, n, box, overlap);
+}
+
+/*********************************************************************************************************/
+// Tests which of n points lie in a box, boundaries included
+// Input:
+//   (x,y,z): arrays with the n point coordinates
+//   box: bounds of the box, {xmin, xmax, ymin, ymax, zmin, zmax}
+// Output:
+//   inside: array of n flags
+//
+void pointsInBox(const double *x, const double *y, const double *z, long n, const double box[6], unsigned char *inside)
+{
+    currentKernels().load(std::memory_order_relaxed)->pointsInBox(x, y, z, n, box, inside);
+}
+
+/*********************************************************************************************************/
+// Returns the instruction set of the kernels in use: avx512, avx2 or scalar
+//
+std::string getKernelInstructionSet()
+{
+    return currentKernels().load()->name;
+}
+
+/*********************************************************************************************************/
+// Selects the instruction set of the kernels, for all threads, e.g. to compare them
+// Input:
+//   name: avx512, avx2 or scalar
+//
+void setKernelInstructionSet(std::string name)
+{
+    const KernelTable *kernels = findKernels(name);
+    if (kernels == NULL)
+        throw std::runtime_error("Instruction set not supported: " + name);
+    currentKernels().store(kernels);
+}
+
+} // namespace
@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <cmath>
+
+#include "saga/CellPrefetcher.h"
+#include "saga/AMRgrid.h"
+#include "saga/CellKernels.h"
+
+
+namespace saga{
+
+// maximum number of prefetchers whose snapshot a thread keeps at the same time
+static const size_t maxPrefetchersPerThread = 8;
+
+static std::atomic<unsigned long> nextPrefetcherId(1);
+
+/*********************************************************************************************************/
+// Cells of a fetched region, with their bounds and centres as columns for the cell kernels, and a uniform
+// grid of buckets listing the cells overlapping each of them. A region is never modified once published,
+// so lookups read it without locking.
+//
+struct CellPrefetcher::Region
+{
+    double box[6];
+    std::vector<AMRcell> cells;
+    std::vector<LocalProperties> properties;
+    std::vector<double> xmin, xmax, ymin, ymax, zmin, zmax;
+    std::vector<double> cx, cy, cz;
+    std::vector<int32_t> indices;
+
+    int nBuckets;                       // per dimension
+    std::vector<long> bucketStart;      // nBuckets^3 + 1 offsets into bucketCells
+    std::vector<long> bucketCells;
+
+    void bucketRange(const double *b, int lo[3], int hi[3]) const;
+    void buildBuckets();
+};
+
+/*********************************************************************************************************/
+// Buckets overlapped by a box, clamped to the region
+//
+void CellPrefetcher::Region::bucketRange(const double *b, int lo[3], int hi[3]) const
+{
+    for (int k=0; k<3; k++) {
+        double width = (box[2 * k + 1] - box[2 * k]) / nBuckets;
+        lo[k] = (width > 0) ? (int) std::min(std::max(floor((b[2 * k] - box[2 * k]) / width), 0.), nBuckets - 1.) : 0;
+        hi[k] = (width > 0) ? (int) std::min(std::max(floor((b[2 * k + 1] - box[2 * k]) / width), 0.), nBuckets - 1.) : 0;
+    }
+}
+
+/*********************************************************************************************************/
+// Fills the buckets, about 4 cells each, so that a lookup tests a few cells instead of the whole region
+//
+void CellPrefetcher::Region::buildBuckets()
+{
+    long n = cells.size();
+    nBuckets = std::min(std::max((int) cbrt(n / 4.), 1), 64);
+    long nb = (long) nBuckets * nBuckets * nBuckets;
+    std::vector<long> counts(nb + 1, 0);
+    for (int pass=0; pass<2; pass++) {
+        for (long i=0; i<n; i++) {
+            double b[6] = {xmin[i], xmax[i], ymin[i], ymax[i], zmin[i], zmax[i]};
+            int lo[3], hi[3];
+            bucketRange(b, lo, hi);
+            for (int bx=lo[0]; bx<=hi[0]; bx++)
+                for (int by=lo[1]; by<=hi[1]; by++)
+                    for (int bz=lo[2]; bz<=hi[2]; bz++) {
+                        long j = ((long) bx * nBuckets + by) * nBuckets + bz;
+                        if (pass == 0)
+                            counts[j + 1]++;
+                        else
+                            bucketCells[counts[j]++] = i;
+                    }
+        }
+        if (pass == 0) {
+            for (long j=0; j<nb; j++)
+                counts[j + 1] += counts[j];
+            bucketStart = counts;
+            bucketCells.resize(counts[nb]);
+        }
+    }
+}
+
+/*********************************************************************************************************/
+// Snapshot of the regions last read by a thread, and the version it was published with
+//
+struct CellPrefetcher::ThreadView
+{
+    unsigned long owner;
+    unsigned long version;
+    std::shared_ptr<const RegionList> regions;
+};
+
+class CellPrefetcher::RegionCollector : public AMRcellVisitor
+{
+public:
+    RegionCollector(Region &r) : region(r) {}
+    bool visitCell(AMRcell &cell, LocalProperties &lp)
+    {
+        region.cells.push_back(cell);
+        region.properties.push_back(lp);
+        region.xmin.push_back(cell.getXmin());
+        region.xmax.push_back(cell.getXmax());
+        region.ymin.push_back(cell.getYmin());
+        region.ymax.push_back(cell.getYmax());
+        region.zmin.push_back(cell.getZmin());
+        region.zmax.push_back(cell.getZmax());
+        region.cx.push_back(cell.getXcenter());
+        region.cy.push_back(cell.getYcenter());
+        region.cz.push_back(cell.getZcenter());
+        region.indices.push_back(cell.getCellIndex());
+        return true;
+    }
+private:
+    Region &region;
+};
+
+/*********************************************************************************************************/
+// Constructor: starts the I/O threads
+// Input:
+//   grid: grid whose cells are fetched (SQLite backend), which must outlive the prefetcher
+//   nThreads: number of I/O threads
+//   nRegions: number of fetched regions kept
+//
+CellPrefetcher::CellPrefetcher(AMRgrid *g, int nThreads, int nRegions) : grid(g), stopping(false), version(0), hits(0), misses(0), fetched(0), dropped(0)
+{
+    id = nextPrefetcherId++;
+    published.reset(new RegionList());
+    maxRegions = std::max(nRegions, 1);
+    maxPending = 4 * std::max(nThreads, 1);
+    for (int i=0; i<std::max(nThreads, 1); i++)
+        threads.push_back(std::thread(&CellPrefetcher::run, this));
+}
+
+/*********************************************************************************************************/
+// Destructor: drops the pending requests and waits for the fetches running
+//
+CellPrefetcher::~CellPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        queue.clear();
+    }
+    pending.notify_all();
+    for (size_t i=0; i<threads.size(); i++)
+        threads[i].join();
+}
+
+bool CellPrefetcher::inside(const double *box, const double *outer)
+{
+    return box[0] >= outer[0] && box[1] <= outer[1] && box[2] >= outer[2] && box[3] <= outer[3] && box[4] >= outer[4] && box[5] <= outer[5];
+}
+
+bool CellPrefetcher::coveredLocked(const double *box) const
+{
+    for (size_t i=0; i<regions.size(); i++) {
+        if (inside(box, regions[i]->box))
+            return true;
+    }
+    for (size_t i=0; i<queue.size(); i++) {
+        if (inside(box, &queue[i][0]))
+            return true;
+    }
+    for (size_t i=0; i<running.size(); i++) {
+        if (inside(box, &running[i][0]))
+            return true;
+    }
+    return false;
+}
+
+/*********************************************************************************************************/
+// Publishes the current regions as a new snapshot; called with the mutex held
+//
+void CellPrefetcher::publishLocked()
+{
+    std::shared_ptr<const RegionList> list(new RegionList(regions.begin(), regions.end()));
+    std::atomic_store(&published, list);
+    version.fetch_add(1, std::memory_order_release);
+}
+
+/*********************************************************************************************************/
+// Returns the regions as last published, most recent first, without locking unless a new snapshot has
+// been published since the calling thread read one; valid until the next call from the thread
+//
+const CellPrefetcher::RegionList& CellPrefetcher::snapshot()
+{
+    static thread_local std::vector<ThreadView> views;
+    unsigned long current = version.load(std::memory_order_acquire);
+    ThreadView *view = NULL;
+    for (size_t i=0; i<views.size() && view == NULL; i++) {
+        if (views[i].owner == id)
+            view = &views[i];
+    }
+    if (view == NULL) {
+        if (views.size() >= maxPrefetchersPerThread)
+            views.erase(views.begin());
+        ThreadView v;
+        v.owner = id;
+        v.regions = std::atomic_load(&published);
+        v.version = current;
+        views.push_back(v);
+        return *views.back().regions;
+    }
+    if (view->version != current) {
+        view->regions = std::atomic_load(&published);
+        view->version = current;
+    }
+    return *view->regions;
+}
+
+/*********************************************************************************************************/
+// Queues the fetch of a region, unless it lies inside a region fetched or queued
+// Input:
+//   (x,y,z)(min,max): bounds of the region in grid units
+//
+void CellPrefetcher::request(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    double box[6] = {xmin, xmax, ymin, ymax, zmin, zmax};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || coveredLocked(box))
+            return;
+        if (queue.size() >= maxPending) {
+            queue.pop_front();
+            dropped++;
+        }
+        queue.push_back(std::vector<double>(box, box + 6));
+    }
+    pending.notify_one();
+}
+
+/*********************************************************************************************************/
+// Whether a box lies inside a region fetched or queued
+//
+bool CellPrefetcher::covers(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    double box[6] = {xmin, xmax, ymin, ymax, zmin, zmax};
+    std::lock_guard<std::mutex> lock(mutex);
+    return coveredLocked(box);
+}
+
+/*********************************************************************************************************/
+// Looks up a point in the fetched regions, the most recent first
+// Input:
+//   (x,y,z): point coordinates in grid units
+//   halfWidth: half width of the neighbourhood searched around the point
+// Output:
+//   cell, lp: nearest cell and its local properties, if found
+//   true in case of a hit
+//
+bool CellPrefetcher::lookup(double x, double y, double z, double halfWidth, AMRcell &cell, LocalProperties &lp)
+{
+    double box[6] = {x - halfWidth, x + halfWidth, y - halfWidth, y + halfWidth, z - halfWidth, z + halfWidth};
+    const Region *region = NULL;
+    const RegionList &list = snapshot();
+    for (size_t i=0; i<list.size(); i++) {
+        if (inside(box, list[i]->box)) {
+            region = list[i].get();
+            break;
+        }
+    }
+    if (region == NULL || region->cells.empty()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // cells listed in the buckets overlapped by the neighbourhood, once each
+    static thread_local std::vector<long> listed;
+    listed.clear();
+    int lo[3], hi[3];
+    region->bucketRange(box, lo, hi);
+    for (int bx=lo[0]; bx<=hi[0]; bx++)
+        for (int by=lo[1]; by<=hi[1]; by++)
+            for (int bz=lo[2]; bz<=hi[2]; bz++) {
+                long j = ((long) bx * region->nBuckets + by) * region->nBuckets + bz;
+                listed.insert(listed.end(), region->bucketCells.begin() + region->bucketStart[j], region->bucketCells.begin() + region->bucketStart[j + 1]);
+            }
+    if (lo[0] != hi[0] || lo[1] != hi[1] || lo[2] != hi[2]) {
+        std::sort(listed.begin(), listed.end());
+        listed.erase(std::unique(listed.begin(), listed.end()), listed.end());
+    }
+
+    // candidates: those overlapping the neighbourhood
+    static thread_local std::vector<double> bxmin, bxmax, bymin, bymax, bzmin, bzmax;
+    static thread_local std::vector<unsigned char> overlap;
+    static thread_local std::vector<double> cx, cy, cz;
+    static thread_local std::vector<int32_t> indices;
+    static thread_local std::vector<long> positions;
+    long n = listed.size();
+    bxmin.resize(n);
+    bxmax.resize(n);
+    bymin.resize(n);
+    bymax.resize(n);
+    bzmin.resize(n);
+    bzmax.resize(n);
+    overlap.resize(n);
+    for (long i=0; i<n; i++) {
+        long c = listed[i];
+        bxmin[i] = region->xmin[c];
+        bxmax[i] = region->xmax[c];
+        bymin[i] = region->ymin[c];
+        bymax[i] = region->ymax[c];
+        bzmin[i] = region->zmin[c];
+        bzmax[i] = region->zmax[c];
+    }
+    if (n > 0)
+        boxesOverlapBox(&bxmin[0], &bxmax[0], &bymin[0], &bymax[0], &bzmin[0], &bzmax[0], n, box, &overlap[0]);
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    indices.clear();
+    positions.clear();
+    for (long i=0; i<n; i++) {
+        if (overlap[i]) {
+            long c = listed[i];
+            cx.push_back(region->cx[c]);
+            cy.push_back(region->cy[c]);
+            cz.push_back(region->cz[c]);
+            indices.push_back(region->indices[c]);
+            positions.push_back(c);
+        }
+    }
+    if (positions.empty()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    long best = positions[selectNearestCentre(&cx[0], &cy[0], &cz[0], &indices[0], positions.size(), x, y, z)];
+    cell = region->cells[best];
+    lp = region->properties[best];
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/*********************************************************************************************************/
+// Blocks until no request is pending or running
+//
+void CellPrefetcher::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]{ return queue.empty() && running.empty(); });
+}
+
+/*********************************************************************************************************/
+// Loop of an I/O thread: fetches the most recent request first, the older ones being the least likely to
+// be still ahead of the caller
+//
+void CellPrefetcher::run()
+{
+    while (true) {
+        std::vector<double> box;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pending.wait(lock, [this]{ return stopping || ! queue.empty(); });
+            if (stopping)
+                return;
+            box = queue.back();
+            queue.pop_back();
+            running.push_back(box);
+        }
+
+        std::shared_ptr<Region> region = std::make_shared<Region>();
+        for (int k=0; k<6; k++)
+            region->box[k] = box[k];
+        RegionCollector collector(*region);
+        try {
+            grid->visitCellsRegion(box[0], box[1], box[2], box[3], box[4], box[5], collector);
+            region->buildBuckets();
+        } catch (std::exception &e) {
+            region.reset();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running.erase(std::find(running.begin(), running.end(), box));
+            if (region) {
+                regions.push_front(region);
+                if (regions.size() > (size_t) maxRegions)
+                    regions.pop_back();
+                publishLocked();
+                fetched++;
+            }
+        }
+        idle.notify_all();
+    }
+}
+
+/*********************************************************************************************************/
+// Counters: points served and not served, regions fetched and requests dropped
+//
+unsigned long long CellPrefetcher::getHits() const
+{
+    return hits.load(std::memory_order_relaxed);
+}
+
+unsigned long long CellPrefetcher::getMisses() const
+{
+    return misses.load(std::memory_order_relaxed);
+}
+
+unsigned long long CellPrefetcher::getFetchedRegions() const
+{
+    return fetched.load();
+}
+
+unsigned long long CellPrefetcher::getDroppedRequests() const
+{
+    return dropped.load();
+}
+
+void CellPrefetcher::resetCounters()
+{
+    hits = 0;
+    misses = 0;
+    fetched = 0;
+    dropped = 0;
+}
+
+} // namespace
@@ -0,0 +1,326 @@
+#include <cmath>
+#include <stdexcept>
+
+#include "saga/CellSet.h"
+#include "saga/CellKernels.h"
+#include "saga/Morton.h"
+
+
+namespace saga{
+
+/*********************************************************************************************************/
+// Sizes 2^-level of the cells of each level
+//
+struct LevelSizes
+{
+    LevelSizes()
+    {
+        for (int level=0; level<=mortonMaxLevel; level++)
+            size[level] = ldexp(1., -level);
+    }
+    double size[mortonMaxLevel + 1];
+};
+
+static const LevelSizes levelSizes;
+
+/*********************************************************************************************************/
+// Returns the level of a cell of the octree of the unit box: a cube of size 2^-level, with level at most
+// mortonMaxLevel, aligned on the lattice of its level
+// Input:
+//   (x,y,z)(min,max): bounds of the cell in grid units
+// Output:
+//   level of the cell, or -1 if the bounds are not those of such a cell
+//
+int CompactCell::octreeLevel(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    double size = xmax - xmin;
+    if (! (size > 0 && size <= 1))
+        return -1;
+    int level = (int) floor(-log2(size) + 0.5);
+    if (level > mortonMaxLevel || levelSizes.size[level] != size || ymax - ymin != size || zmax - zmin != size)
+        return -1;
+    double fx = ldexp(xmin, level);
+    double fy = ldexp(ymin, level);
+    double fz = ldexp(zmin, level);
+    if (fx != floor(fx) || fy != floor(fy) || fz != floor(fz) || fx < 0 || fy < 0 || fz < 0 || xmax > 1 || ymax > 1 || zmax > 1)
+        return -1;
+    return level;
+}
+
+/*********************************************************************************************************/
+// Encodes a cell of the octree of the unit box (see octreeLevel)
+// Input:
+//   index: index of the cell
+//   (x,y,z)(min,max): bounds of the cell in grid units
+// Output:
+//   compact cell
+//
+CompactCell CompactCell::encode(int index, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    int level = octreeLevel(xmin, xmax, ymin, ymax, zmin, zmax);
+    if (level < 0)
+        throw std::runtime_error("Only cubic cells of dyadic size aligned with the octree of the unit box can be encoded compactly.");
+
+    CompactCell c;
+    c.key = mortonEncode((uint64_t) ldexp(xmin, level), (uint64_t) ldexp(ymin, level), (uint64_t) ldexp(zmin, level));
+    c.index = index;
+    c.level = level;
+    return c;
+}
+
+CompactCell CompactCell::fromCell(AMRcell &cell)
+{
+    return encode(cell.getCellIndex(), cell.getXmin(), cell.getXmax(), cell.getYmin(), cell.getYmax(), cell.getZmin(), cell.getZmax());
+}
+
+/*********************************************************************************************************/
+// Rebuilds the AMRcell
+//
+AMRcell CompactCell::toCell() const
+{
+    uint64_t ix, iy, iz;
+    mortonDecode(key, ix, iy, iz);
+    double h = levelSizes.size[level];
+    return AMRcell(index, ix * h, (ix + 1) * h, iy * h, (iy + 1) * h, iz * h, (iz + 1) * h);
+}
+
+/*********************************************************************************************************/
+// Constructor
+CellSet::CellSet()
+{
+}
+
+/*********************************************************************************************************/
+// Destructor
+CellSet::~CellSet()
+{
+}
+
+/*********************************************************************************************************/
+// Number of cells
+//
+size_t CellSet::size() const
+{
+    return keys.size();
+}
+
+bool CellSet::empty() const
+{
+    return keys.empty();
+}
+
+/*********************************************************************************************************/
+// Whether the local properties of the cells are stored along with them
+//
+bool CellSet::hasProperties() const
+{
+    return ! keys.empty() && rho.size() == keys.size();
+}
+
+void CellSet::clear()
+{
+    keys.clear();
+    levels.clear();
+    indices.clear();
+    rho.clear();
+    Bx.clear();
+    By.clear();
+    Bz.clear();
+}
+
+void CellSet::reserve(size_t n, bool withProperties)
+{
+    keys.reserve(n);
+    levels.reserve(n);
+    indices.reserve(n);
+    if (withProperties) {
+        rho.reserve(n);
+        Bx.reserve(n);
+        By.reserve(n);
+        Bz.reserve(n);
+    }
+}
+
+/*********************************************************************************************************/
+// Appends a cell, with or without its local properties. A set holds the properties of all its cells or
+// of none.
+// Input:
+//   cell: compact cell
+//   lp: local properties of the cell
+//
+void CellSet::push_back(const CompactCell &cell)
+{
+    if (! rho.empty())
+        throw std::runtime_error("The cell set holds local properties.");
+    keys.push_back(cell.key);
+    levels.push_back(cell.level);
+    indices.push_back(cell.index);
+}
+
+void CellSet::push_back(const CompactCell &cell, LocalProperties lp)
+{
+    if (rho.size() != keys.size())
+        throw std::runtime_error("The cell set holds no local properties.");
+    keys.push_back(cell.key);
+    levels.push_back(cell.level);
+    indices.push_back(cell.index);
+    rho.push_back(lp.getDensity());
+    Bx.push_back(lp.getBx());
+    By.push_back(lp.getBy());
+    Bz.push_back(lp.getBz());
+}
+
+/*********************************************************************************************************/
+// Returns the i-th cell, compact or as an AMRcell
+//
+CompactCell CellSet::getCompactCell(size_t i) const
+{
+    CompactCell c;
+    c.key = keys[i];
+    c.index = indices[i];
+    c.level = levels[i];
+    return c;
+}
+
+AMRcell CellSet::getCell(size_t i) const
+{
+    return getCompactCell(i).toCell();
+}
+
+/*********************************************************************************************************/
+// Returns the local properties of the i-th cell
+//
+LocalProperties CellSet::getLocalProperties(size_t i) const
+{
+    if (! hasProperties())
+        throw std::runtime_error("The cell set holds no local properties.");
+    return LocalProperties(rho[i], Bx[i], By[i], Bz[i]);
+}
+
+/*********************************************************************************************************/
+// Returns the size of the i-th cell
+//
+double CellSet::getCellSize(size_t i) const
+{
+    return levelSizes.size[levels[i]];
+}
+
+/*********************************************************************************************************/
+// Decodes the centres of all cells
+// Output:
+//   (x,y,z): arrays of size() coordinates in grid units
+//
+void CellSet::getCentres(double *x, double *y, double *z) const
+{
+    const uint64_t *k = keys.empty() ? NULL : &keys[0];
+    const uint8_t *l = levels.empty() ? NULL : &levels[0];
+    long n = keys.size();
+    for (long i=0; i<n; i++) {
+        double h = levelSizes.size[l[i]];
+        x[i] = (mortonCompact(k[i] >> 2) + 0.5) * h;
+        y[i] = (mortonCompact(k[i] >> 1) + 0.5) * h;
+        z[i] = (mortonCompact(k[i]) + 0.5) * h;
+    }
+}
+
+/*********************************************************************************************************/
+// Decodes the bounds of all cells
+// Output:
+//   (x,y,z)(min,max): arrays of size() coordinates in grid units
+//
+void CellSet::getBounds(double *xmin, double *xmax, double *ymin, double *ymax, double *zmin, double *zmax) const
+{
+    const uint64_t *k = keys.empty() ? NULL : &keys[0];
+    const uint8_t *l = levels.empty() ? NULL : &levels[0];
+    long n = keys.size();
+    for (long i=0; i<n; i++) {
+        double h = levelSizes.size[l[i]];
+        double ix = mortonCompact(k[i] >> 2);
+        double iy = mortonCompact(k[i] >> 1);
+        double iz = mortonCompact(k[i]);
+        xmin[i] = ix * h;
+        xmax[i] = (ix + 1) * h;
+        ymin[i] = iy * h;
+        ymax[i] = (iy + 1) * h;
+        zmin[i] = iz * h;
+        zmax[i] = (iz + 1) * h;
+    }
+}
+
+/*********************************************************************************************************/
+// Returns the position of the cell whose centre is the nearest to a point, with the tie rule of AMRgrid,
+// or -1 if the set is empty
+// Input:
+//   (x,y,z): point coordinates in grid units
+//
+long CellSet::findNearest(double x, double y, double z) const
+{
+    long n = size();
+    std::vector<double> cx(n), cy(n), cz(n);
+    getCentres(cx.data(), cy.data(), cz.data());
+    return selectNearestCentre(cx.data(), cy.data(), cz.data(), indices.data(), n, x, y, z);
+}
+
+/*********************************************************************************************************/
+// Returns the positions of the cells overlapping a box, boundaries included, in the order of the set
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+// Output:
+//   positions: positions of the cells, appended
+//
+void CellSet::findInBox(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, std::vector<long> &positions) const
+{
+    long n = size();
+    std::vector<double> bounds(6 * n);
+    std::vector<unsigned char> overlap(n);
+    double *b = bounds.data();
+    getBounds(b, b + n, b + 2 * n, b + 3 * n, b + 4 * n, b + 5 * n);
+    double box[6] = {xmin, xmax, ymin, ymax, zmin, zmax};
+    boxesOverlapBox(b, b + n, b + 2 * n, b + 3 * n, b + 4 * n, b + 5 * n, n, box, overlap.data());
+    for (long i=0; i<n; i++) {
+        if (overlap[i])
+            positions.push_back(i);
+    }
+}
+
+/*********************************************************************************************************/
+// Columns of the set: Morton keys at the level of each cell, levels, indices and, if stored, the local
+// properties. Pointers are invalidated by any change to the set.
+//
+const uint64_t* CellSet::getKeys() const
+{
+    return keys.empty() ? NULL : &keys[0];
+}
+
+const uint8_t* CellSet::getLevels() const
+{
+    return levels.empty() ? NULL : &levels[0];
+}
+
+const int32_t* CellSet::getIndices() const
+{
+    return indices.empty() ? NULL : &indices[0];
+}
+
+const double* CellSet::getDensities() const
+{
+    return rho.empty() ? NULL : &rho[0];
+}
+
+const double* CellSet::getBx() const
+{
+    return Bx.empty() ? NULL : &Bx[0];
+}
+
+const double* CellSet::getBy() const
+{
+    return By.empty() ? NULL : &By[0];
+}
+
+const double* CellSet::getBz() const
+{
+    return Bz.empty() ? NULL : &Bz[0];
+}
+
+} // namespace
@@ -0,0 +1,285 @@
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "saga/FieldInterpolator.h"
+#include "saga/CellCache.h"
+
+
+namespace saga{
+
+// maximum number of interpolators whose stencils a thread keeps at the same time
+static const size_t maxInterpolatorsPerThread = 8;
+
+// number of recently met cells whose serving boxes answer lattice centres without a query
+static const int maxKnownCells = 16;
+
+static std::atomic<unsigned long> nextInterpolatorId(1);
+
+/*********************************************************************************************************/
+// Lattice level and indices of the lower centre, and the values and cell levels at the 8 centres
+//
+struct FieldInterpolator::Stencil
+{
+    int level;
+    long i0, j0, k0;
+    double values[8][4];
+    int levels[8];
+};
+
+struct FieldInterpolator::KnownCell
+{
+    double box[6];
+    int level;
+    double values[4];
+};
+
+struct FieldInterpolator::ThreadStencils
+{
+    unsigned long owner;
+    int nValid;
+    int next;
+    std::vector<Stencil> stencils;
+    int nCells;
+    int nextCell;
+    std::vector<KnownCell> cells;
+};
+
+/*********************************************************************************************************/
+// Lower lattice index of the stencil and the weight of the upper centre along one axis
+// Input:
+//   x: coordinate of the point, inside the unit cube in periodic mode
+//   h: lattice spacing
+//   n: number of lattice cells along the axis
+//   periodic: whether the lattice wraps around the unit cube
+// Output:
+//   i0: index of the lower centre
+//   t: weight of the upper centre
+//
+static inline void stencilAxis(double x, double h, long n, bool periodic, long &i0, double &t)
+{
+    double u = x / h - 0.5;
+    i0 = (long) floor(u);
+    t = u - i0;
+    if (periodic) {
+        // the lower centre of a point below the first centre is the last one
+        if (i0 < 0)
+            i0 += n;
+        return;
+    }
+
+    // a lattice of a single cell has no second centre to interpolate with
+    if (n < 2) {
+        i0 = 0;
+        t = 0;
+        return;
+    }
+    if (i0 < 0)
+        i0 = 0;
+    if (i0 > n - 2)
+        i0 = n - 2;
+    t = u - i0;
+    if (t < 0)
+        t = 0;
+    if (t > 1)
+        t = 1;
+}
+
+/*********************************************************************************************************/
+// Lattice index of the lower (d = 0) or upper (d = 1) centre of a stencil along one axis
+//
+static inline long stencilCorner(long i0, int d, long n, bool periodic)
+{
+    return periodic ? (i0 + d) % n : std::min(i0 + d, n - 1);
+}
+
+/*********************************************************************************************************/
+// Stencil around a point on the lattice of a level, and the trilinear weights of its 8 centres
+// Input:
+//   (x,y,z): point coordinates in grid units, inside the unit cube in periodic mode
+//   level: refinement level of the lattice
+//   periodic: whether the lattice wraps around the unit cube
+// Output:
+//   (i0,j0,k0): indices of the lower centre
+//   w: weights of the centres, ordered as in Stencil
+//
+static void stencilWeights(double x, double y, double z, int level, bool periodic, long &i0, long &j0, long &k0, double w[8])
+{
+    double h = ldexp(1., -level);
+    long n = 1L << level;
+    double tx, ty, tz;
+    stencilAxis(x, h, n, periodic, i0, tx);
+    stencilAxis(y, h, n, periodic, j0, ty);
+    stencilAxis(z, h, n, periodic, k0, tz);
+    for (int c=0; c<8; c++)
+        w[c] = (((c >> 2) & 1) ? tx : 1 - tx) * (((c >> 1) & 1) ? ty : 1 - ty) * ((c & 1) ? tz : 1 - tz);
+}
+
+/*********************************************************************************************************/
+// Constructor
+// Input:
+//   grid: grid to interpolate
+//   nStencils: number of stencils cached per thread
+//
+FieldInterpolator::FieldInterpolator(ref_ptr<AMRgrid> grid, int nStencils)
+{
+    TheGrid = grid;
+    id = nextInterpolatorId++;
+    size = (nStencils > 0) ? nStencils : 1;
+    finestLevel = (int) floor(log2(1 / grid->getMinCellSize()) + 0.5);
+    periodic = grid->isPeriodic();
+}
+
+/*********************************************************************************************************/
+// Destructor
+FieldInterpolator::~FieldInterpolator()
+{
+}
+
+/*********************************************************************************************************/
+// Returns the stencils of the calling thread, creating them on first use
+//
+FieldInterpolator::ThreadStencils& FieldInterpolator::local()
+{
+    static thread_local std::vector<ThreadStencils> caches;
+    for (size_t i=0; i<caches.size(); i++) {
+        if (caches[i].owner == id)
+            return caches[i];
+    }
+
+    if (caches.size() >= maxInterpolatorsPerThread)
+        caches.erase(caches.begin());
+    ThreadStencils t;
+    t.owner = id;
+    t.nValid = 0;
+    t.next = 0;
+    t.stencils.resize(size);
+    t.nCells = 0;
+    t.nextCell = 0;
+    t.cells.resize(maxKnownCells);
+    caches.push_back(t);
+    return caches.back();
+}
+
+/*********************************************************************************************************/
+// Values and cell level at a lattice centre: from a cell met recently if the centre lies in its serving
+// box, where the grid would select it too, or else from a lookup
+// Input:
+//   t: stencils of the calling thread
+//   (x,y,z): coordinates of the centre in grid units
+// Output:
+//   values: density and magnetic field of the nearest cell
+//   level: refinement level of the nearest cell
+//
+void FieldInterpolator::sampleCentre(ThreadStencils &t, double x, double y, double z, double values[4], int &level)
+{
+    for (int n=0; n<t.nCells; n++) {
+        KnownCell &c = t.cells[n];
+        if (x >= c.box[0] && x <= c.box[1] && y >= c.box[2] && y <= c.box[3] && z >= c.box[4] && z <= c.box[5]) {
+            std::copy(c.values, c.values + 4, values);
+            level = c.level;
+            return;
+        }
+    }
+
+    LocalProperties lp;
+    AMRcell cell = TheGrid->selectNearestNeighbor(x, y, z, lp);
+    values[0] = lp.getDensity();
+    values[1] = lp.getBx();
+    values[2] = lp.getBy();
+    values[3] = lp.getBz();
+    level = (int) floor(log2(1 / (cell.getXmax() - cell.getXmin())) + 0.5);
+    level = std::max(0, std::min(level, finestLevel));
+
+    KnownCell &c = t.cells[t.nextCell];
+    if (! CellCache::servingBox(cell, 0.5 * TheGrid->getMinCellSize(), c.box))
+        return;
+    std::copy(values, values + 4, c.values);
+    c.level = level;
+    t.nextCell = (t.nextCell + 1) % maxKnownCells;
+    if (t.nCells < maxKnownCells)
+        t.nCells++;
+}
+
+/*********************************************************************************************************/
+// Returns the stencil of a level with the given lower centre, from the cache of the thread or built
+// Input:
+//   t: stencils of the calling thread
+//   level: refinement level of the lattice
+//   (i0,j0,k0): indices of the lower centre
+// Output:
+//   stencil, valid until the next call
+//
+FieldInterpolator::Stencil& FieldInterpolator::getStencil(ThreadStencils &t, int level, long i0, long j0, long k0)
+{
+    for (int n=0; n<t.nValid; n++) {
+        Stencil &s = t.stencils[n];
+        if (s.level == level && s.i0 == i0 && s.j0 == j0 && s.k0 == k0)
+            return s;
+    }
+
+    Stencil &s = t.stencils[t.next];
+    t.next = (t.next + 1) % size;
+    if (t.nValid < size)
+        t.nValid++;
+    s.level = level;
+    s.i0 = i0;
+    s.j0 = j0;
+    s.k0 = k0;
+    double h = ldexp(1., -level);
+    long n = 1L << level;
+    for (int c=0; c<8; c++) {
+        long i = stencilCorner(i0, (c >> 2) & 1, n, periodic);
+        long j = stencilCorner(j0, (c >> 1) & 1, n, periodic);
+        long k = stencilCorner(k0, c & 1, n, periodic);
+        sampleCentre(t, (i + 0.5) * h, (j + 0.5) * h, (k + 0.5) * h, s.values[c], s.levels[c]);
+    }
+    return s;
+}
+
+/*********************************************************************************************************/
+// Interpolates the local properties at a point
+// Input:
+//   (x,y,z): point coordinates in grid units
+// Output:
+//   interpolated density and magnetic field
+//
+LocalProperties FieldInterpolator::getLocalProperties(double x, double y, double z)
+{
+    ThreadStencils &t = local();
+    if (periodic) {
+        x -= floor(x);
+        y -= floor(y);
+        z -= floor(z);
+    }
+
+    // continuous level at the point, from the levels of the cells at the finest lattice centres; taken
+    // relative to the lowest of them, so that it is exact where they all agree
+    long i0, j0, k0;
+    double w[8];
+    stencilWeights(x, y, z, finestLevel, periodic, i0, j0, k0, w);
+    Stencil &finest = getStencil(t, finestLevel, i0, j0, k0);
+    int lowest = *std::min_element(finest.levels, finest.levels + 8);
+    double level = lowest;
+    for (int c=0; c<8; c++)
+        level += w[c] * (finest.levels[c] - lowest);
+
+    // blend of the fields of the two levels around it; a stencil may be evicted by the next one, so each
+    // is used as soon as it is returned
+    int levels[2] = {(int) floor(level), (int) floor(level) + 1};
+    double blend[2] = {levels[1] - level, level - levels[0]};
+    double v[4] = {0, 0, 0, 0};
+    for (int m=0; m<2; m++) {
+        if (blend[m] == 0)
+            continue;
+        stencilWeights(x, y, z, levels[m], periodic, i0, j0, k0, w);
+        Stencil &s = getStencil(t, levels[m], i0, j0, k0);
+        for (int c=0; c<8; c++) {
+            for (int q=0; q<4; q++)
+                v[q] += blend[m] * w[c] * s.values[c][q];
+        }
+    }
+    return LocalProperties(v[0], v[1], v[2], v[3]);
+}
+
+} // namespace
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "saga/LevelPyramid.h"
+#include "saga/Morton.h"
+
+
+namespace saga{
+
+/*********************************************************************************************************/
+// Integer coordinate at a level of a point of the unit interval; the upper boundary belongs to the last
+// node
+//
+static inline uint64_t nodeCoordinate(double x, int level)
+{
+    double n = ldexp(1., level);
+    return (uint64_t) std::min(floor(x * n), n - 1);
+}
+
+/*********************************************************************************************************/
+// Constructor
+LevelPyramid::LevelPyramid()
+{
+}
+
+/*********************************************************************************************************/
+// Destructor
+LevelPyramid::~LevelPyramid()
+{
+}
+
+/*********************************************************************************************************/
+// Appends a node to a level
+//
+void LevelPyramid::addNode(int level, uint64_t key, int32_t index, const LocalProperties &lp)
+{
+    LocalProperties p = lp;
+    Level &l = levels[level];
+    l.keys.push_back(key);
+    l.indices.push_back(index);
+    l.children.push_back(-1);
+    l.rho.push_back(p.getDensity());
+    l.Bx.push_back(p.getBx());
+    l.By.push_back(p.getBy());
+    l.Bz.push_back(p.getBz());
+}
+
+/*********************************************************************************************************/
+// Builds the pyramid from the cells of an octree, level by level from the root; the averages of the
+// parents are then filled from the finest level up.
+// Input:
+//   octree: cells of the grid, which must fill the unit cube
+//
+void LevelPyramid::build(const LinearOctree &octree)
+{
+    levels.clear();
+    long n = octree.size();
+    if (n == 0)
+        return;
+    int maxLevel = octree.getMaxLevel();
+    levels.resize(maxLevel + 1);
+
+    // range of the octree positions of the cells inside each node of the current level
+    std::vector<std::pair<long, long> > ranges(1, std::make_pair(0L, n));
+    addNode(0, 0, -1, LocalProperties());
+    for (int level=0; level<=maxLevel; level++) {
+        std::vector<std::pair<long, long> > next;
+        Level &l = levels[level];
+        for (long j=0; j<l.keys.size(); j++) {
+            long lo = ranges[j].first;
+            long hi = ranges[j].second;
+            CompactCell first = octree.getCompactCell(lo);
+            if (first.level == level) {
+                if (hi - lo != 1)
+                    throw std::runtime_error("The cells of the grid overlap.");
+                LocalProperties lp = octree.getLocalProperties(lo);
+                l.indices[j] = first.index;
+                l.rho[j] = lp.getDensity();
+                l.Bx[j] = lp.getBx();
+                l.By[j] = lp.getBy();
+                l.Bz[j] = lp.getBz();
+                continue;
+            }
+            if (first.level < level || level == maxLevel)
+                throw std::runtime_error("The cells of the grid overlap.");
+
+            // split the range between the 8 children, by the keys of the cells at the level of the children
+            l.children[j] = levels[level + 1].keys.size();
+            long start = lo;
+            for (uint64_t c=0; c<8; c++) {
+                uint64_t childKey = 8 * l.keys[j] + c;
+                long end = start, count = hi - start;
+                while (count > 0) {
+                    long step = count / 2;
+                    CompactCell cell = octree.getCompactCell(end + step);
+                    if (cell.level <= level)
+                        throw std::runtime_error("The cells of the grid overlap.");
+                    if ((cell.key >> (3 * (cell.level - level - 1))) <= childKey) {
+                        end += step + 1;
+                        count -= step + 1;
+                    } else {
+                        count = step;
+                    }
+                }
+                if (end == start)
+                    throw std::runtime_error("The cells of the grid do not fill the unit cube.");
+                addNode(level + 1, childKey, -1, LocalProperties());
+                next.push_back(std::make_pair(start, end));
+                start = end;
+            }
+        }
+        ranges.swap(next);
+    }
+
+    // parents: children have equal volumes, so their plain average is the volume-weighted one, which
+    // conserves mass and flux
+    for (int level=maxLevel-1; level>=0; level--) {
+        Level &l = levels[level];
+        const Level &c = levels[level + 1];
+        for (long j=0; j<l.keys.size(); j++) {
+            if (l.children[j] < 0)
+                continue;
+            long k = l.children[j];
+            double rho = 0, Bx = 0, By = 0, Bz = 0;
+            for (int i=0; i<8; i++) {
+                rho += c.rho[k + i];
+                Bx += c.Bx[k + i];
+                By += c.By[k + i];
+                Bz += c.Bz[k + i];
+            }
+            l.rho[j] = rho / 8;
+            l.Bx[j] = Bx / 8;
+            l.By[j] = By / 8;
+            l.Bz[j] = Bz / 8;
+        }
+    }
+}
+
+/*********************************************************************************************************/
+// Returns the finest level of the pyramid, that of the finest cells of the grid (-1 if it is empty)
+//
+int LevelPyramid::getMaxLevel() const
+{
+    return (int) levels.size() - 1;
+}
+
+/*********************************************************************************************************/
+// Returns the number of nodes of all levels
+//
+long LevelPyramid::size() const
+{
+    long n = 0;
+    for (int level=0; level<levels.size(); level++)
+        n += levels[level].keys.size();
+    return n;
+}
+
+/*********************************************************************************************************/
+// Given a point, returns the node containing it at a level, or the leaf cell containing it if the grid
+// is coarser there
+// Input:
+//   (x,y,z): point coordinates in grid units
+//   level: maximum level of the node
+// Output:
+//   lp: local properties (averages for a parent node)
+//   node, with the index of the cell for a leaf and -1 for a parent
+//
+CompactCell LevelPyramid::getCell(double x, double y, double z, int level, LocalProperties &lp) const
+{
+    if (levels.empty())
+        throw std::runtime_error("The level-of-detail pyramid is empty.");
+    if (level < 0)
+        throw std::runtime_error("Negative level of detail.");
+    if (x < 0 || x > 1 || y < 0 || y > 1 || z < 0 || z > 1)
+        throw std::runtime_error("The point lies outside the grid.");
+
+    long pos = 0;
+    for (int l=0; ; l++) {
+        const Level &node = levels[l];
+        if (node.children[pos] < 0 || l == level) {
+            lp = LocalProperties(node.rho[pos], node.Bx[pos], node.By[pos], node.Bz[pos]);
+            CompactCell c;
+            c.key = node.keys[pos];
+            c.index = node.indices[pos];
+            c.level = l;
+            return c;
+        }
+        uint64_t octant = ((nodeCoordinate(x, l + 1) & 1) << 2) | ((nodeCoordinate(y, l + 1) & 1) << 1) | (nodeCoordinate(z, l + 1) & 1);
+        pos = node.children[pos] + octant;
+    }
+}
+
+/*********************************************************************************************************/
+// Given a range in space, returns the nodes overlapping it at a level, or the leaf cells where the grid
+// is coarser, in Morton order
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+//   level: maximum level of the nodes
+// Output:
+//   cells: nodes with their local properties, appended
+//
+void LevelPyramid::getCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, int level, CellSet &cells) const
+{
+    if (levels.empty())
+        throw std::runtime_error("The level-of-detail pyramid is empty.");
+    if (level < 0)
+        throw std::runtime_error("Negative level of detail.");
+    double box[6] = {xmin, xmax, ymin, ymax, zmin, zmax};
+    findRegion(0, 0, box, level, cells);
+}
+
+void LevelPyramid::findRegion(int level, long pos, const double *box, int maxLevel, CellSet &cells) const
+{
+    const Level &node = levels[level];
+    uint64_t ix, iy, iz;
+    mortonDecode(node.keys[pos], ix, iy, iz);
+    double h = ldexp(1., -level);
+    if ((ix + 1) * h < box[0] || ix * h > box[1] || (iy + 1) * h < box[2] || iy * h > box[3] || (iz + 1) * h < box[4] || iz * h > box[5])
+        return;
+
+    if (node.children[pos] < 0 || level == maxLevel) {
+        CompactCell c;
+        c.key = node.keys[pos];
+        c.index = node.indices[pos];
+        c.level = level;
+        cells.push_back(c, LocalProperties(node.rho[pos], node.Bx[pos], node.By[pos], node.Bz[pos]));
+        return;
+    }
+    for (int c=0; c<8; c++)
+        findRegion(level + 1, node.children[pos] + c, box, maxLevel, cells);
+}
+
+} // namespace
@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "saga/LinearOctree.h"
+#include "saga/Morton.h"
+
+
+namespace saga{
+
+/*********************************************************************************************************/
+// Cell read from the database, before sorting
+//
+struct OctreeCell
+{
+    int level;
+    uint64_t ix, iy, iz;
+    int idx;
+    double rho, Bx, By, Bz;
+};
+
+/*********************************************************************************************************/
+// Reads the rows of Cell_tree joined with Cell, converting the bounds of each cell into its refinement
+// level and integer coordinates at that level.
+//
+class OctreeLoader : public SQLiteRowVisitor
+{
+public:
+    OctreeLoader(std::vector<OctreeCell> &c) : cells(c), maxLevel(0) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        double xmin = row.getDouble(1);
+        double ymin = row.getDouble(3);
+        double zmin = row.getDouble(5);
+        double size = row.getDouble(2) - xmin;
+
+        OctreeCell cell;
+        cell.level = (int) floor(-log2(size) + 0.5);
+        if (cell.level < 0 || cell.level > mortonMaxLevel || ldexp(1., -cell.level) != size || row.getDouble(4) - ymin != size || row.getDouble(6) - zmin != size)
+            throw std::runtime_error("Cell is not a cubic octree cell of the unit box.");
+        double fx = ldexp(xmin, cell.level);
+        double fy = ldexp(ymin, cell.level);
+        double fz = ldexp(zmin, cell.level);
+        if (fx != floor(fx) || fy != floor(fy) || fz != floor(fz) || fx < 0 || fy < 0 || fz < 0 || row.getDouble(2) > 1 || row.getDouble(4) > 1 || row.getDouble(6) > 1)
+            throw std::runtime_error("Cell is not aligned with the octree of the unit box.");
+        cell.ix = (uint64_t) fx;
+        cell.iy = (uint64_t) fy;
+        cell.iz = (uint64_t) fz;
+        cell.idx = row.getInt(0);
+        cell.rho = row.getDouble(7);
+        cell.Bx = row.getDouble(8);
+        cell.By = row.getDouble(9);
+        cell.Bz = row.getDouble(10);
+        cells.push_back(cell);
+        maxLevel = std::max(maxLevel, cell.level);
+        return true;
+    }
+    std::vector<OctreeCell> &cells;
+    int maxLevel;
+};
+
+static const char snapshotMagic[8] = {'S', 'A', 'G', 'A', 'O', 'C', 'T', '\0'};
+static const uint32_t snapshotByteOrder = 0x01020304;
+static const int maxDirectoryLevel = 5;
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~((uint64_t) 7);
+}
+
+// values of a column of doubles or floats
+static inline double getValue(const void *column, int valueBytes, long pos)
+{
+    return (valueBytes == sizeof(float)) ? ((const float*) column)[pos] : ((const double*) column)[pos];
+}
+
+static inline void setValue(void *column, int valueBytes, long pos, double value)
+{
+    if (valueBytes == sizeof(float))
+        ((float*) column)[pos] = (float) value;
+    else
+        ((double*) column)[pos] = value;
+}
+
+class KeyOrder
+{
+public:
+    KeyOrder(const std::vector<uint64_t> &k) : keys(k) {}
+    bool operator()(long a, long b) const { return keys[a] < keys[b]; }
+private:
+    const std::vector<uint64_t> &keys;
+};
+
+class CellIndexOrder
+{
+public:
+    CellIndexOrder(const int32_t *i) : indices(i) {}
+    bool operator()(int64_t a, int64_t b) const { return indices[a] < indices[b]; }
+    bool operator()(int64_t a, int idx) const { return indices[a] < idx; }
+private:
+    const int32_t *indices;
+};
+
+
+/*********************************************************************************************************/
+// Constructor
+LinearOctree::LinearOctree()
+{
+    mapping = NULL;
+    mappingSize = 0;
+    nCells = 0;
+    maxLevel = 0;
+    directoryLevel = 0;
+    valueBytes = sizeof(double);
+    keys = NULL;
+    cellIndices = NULL;
+    levels = NULL;
+    byCellIndex = NULL;
+    rho = NULL;
+    Bx = NULL;
+    By = NULL;
+    Bz = NULL;
+    directory = NULL;
+}
+
+/*********************************************************************************************************/
+// Destructor
+LinearOctree::~LinearOctree()
+{
+    release();
+}
+
+/*********************************************************************************************************/
+// Frees the buffer or unmaps the snapshot
+//
+void LinearOctree::release()
+{
+    if (mapping != NULL)
+        munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+    std::vector<uint64_t>().swap(buffer);
+}
+
+/*********************************************************************************************************/
+// Computes the offsets of the columns and the total size of the snapshot layout
+// Input:
+//   nCells: number of cells
+//   directoryLevel: level of the nodes indexed in the directory
+//   valueBytes: size of the values, 8 or 4
+// Output:
+//   offsets: offsets in bytes of keys, cellIndices, levels, byCellIndex, rho, Bx, By, Bz and directory
+//   size of the layout in bytes
+//
+uint64_t LinearOctree::layoutSize(uint64_t nCells, int directoryLevel, uint64_t valueBytes, uint64_t offsets[9])
+{
+    uint64_t columnBytes[8] = {sizeof(uint64_t), sizeof(int32_t), sizeof(unsigned char), sizeof(int64_t), valueBytes, valueBytes, valueBytes, valueBytes};
+    uint64_t offset = align8(sizeof(SnapshotHeader));
+    for (int i=0; i<8; i++) {
+        offsets[i] = offset;
+        offset = align8(offset + columnBytes[i] * nCells);
+    }
+    offsets[8] = offset;
+    offset += sizeof(int64_t) * ((((uint64_t) 1) << (3 * directoryLevel)) + 1);
+
+    return offset;
+}
+
+/*********************************************************************************************************/
+// Points the columns to a buffer with the snapshot layout, whose header is already filled
+//
+void LinearOctree::setColumns(const char *base)
+{
+    const SnapshotHeader *header = (const SnapshotHeader*) base;
+    nCells = header->nCells;
+    maxLevel = header->maxLevel;
+    directoryLevel = header->directoryLevel;
+    valueBytes = header->valueBytes;
+
+    uint64_t offsets[9];
+    layoutSize(nCells, directoryLevel, valueBytes, offsets);
+    keys = (const uint64_t*) (base + offsets[0]);
+    cellIndices = (const int32_t*) (base + offsets[1]);
+    levels = (const unsigned char*) (base + offsets[2]);
+    byCellIndex = (const int64_t*) (base + offsets[3]);
+    rho = base + offsets[4];
+    Bx = base + offsets[5];
+    By = base + offsets[6];
+    Bz = base + offsets[7];
+    directory = (const int64_t*) (base + offsets[8]);
+}
+
+/*********************************************************************************************************/
+// Loads all cells of the database and sorts them by Morton key.
+// Input:
+//   DB: open SAGA database
+//   valueBytes: sizeof(double), or sizeof(float) to store the values in single precision
+//
+void LinearOctree::load(SQLiteDB *DB, int valueBytes)
+{
+    if (valueBytes != sizeof(double) && valueBytes != sizeof(float))
+        throw std::runtime_error("Values are stored as doubles or floats.");
+
+    std::vector<OctreeCell> cells;
+    OctreeLoader loader(cells);
+    DB->query("SELECT t.id, t.minX, t.maxX, t.minY, t.maxY, t.minZ, t.maxZ, c.* FROM Cell_tree AS t JOIN Cell AS c ON c.rowid = t.id;", loader);
+
+    long n = cells.size();
+    int level = loader.maxLevel;
+    std::vector<uint64_t> unsortedKeys(n);
+    std::vector<long> order(n);
+    for (long i=0; i<n; i++) {
+        int shift = level - cells[i].level;
+        unsortedKeys[i] = mortonEncode(cells[i].ix << shift, cells[i].iy << shift, cells[i].iz << shift);
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), KeyOrder(unsortedKeys));
+
+    // allocate the buffer and fill the header
+    release();
+    int dirLevel = std::min(level, maxDirectoryLevel);
+    uint64_t offsets[9];
+    uint64_t totalSize = layoutSize(n, dirLevel, valueBytes, offsets);
+    buffer.assign(totalSize / sizeof(uint64_t), 0);
+    char *base = (char*) &buffer[0];
+    SnapshotHeader *header = (SnapshotHeader*) base;
+    memcpy(header->magic, snapshotMagic, sizeof(snapshotMagic));
+    header->version = snapshotVersion;
+    header->byteOrder = snapshotByteOrder;
+    header->nCells = n;
+    header->fileSize = totalSize;
+    header->maxLevel = level;
+    header->directoryLevel = dirLevel;
+    header->valueBytes = valueBytes;
+
+    // fill the columns
+    uint64_t *k = (uint64_t*) (base + offsets[0]);
+    int32_t *idx = (int32_t*) (base + offsets[1]);
+    unsigned char *lev = (unsigned char*) (base + offsets[2]);
+    int64_t *byIdx = (int64_t*) (base + offsets[3]);
+    char *r = base + offsets[4];
+    char *bx = base + offsets[5];
+    char *by = base + offsets[6];
+    char *bz = base + offsets[7];
+    int64_t *dir = (int64_t*) (base + offsets[8]);
+    for (long i=0; i<n; i++) {
+        const OctreeCell &cell = cells[order[i]];
+        k[i] = unsortedKeys[order[i]];
+        lev[i] = cell.level;
+        idx[i] = cell.idx;
+        setValue(r, valueBytes, i, cell.rho);
+        setValue(bx, valueBytes, i, cell.Bx);
+        setValue(by, valueBytes, i, cell.By);
+        setValue(bz, valueBytes, i, cell.Bz);
+        byIdx[i] = i;
+        if (i > 0 && k[i] == k[i - 1])
+            throw std::runtime_error("Overlapping cells in the grid.");
+    }
+    std::sort(byIdx, byIdx + n, CellIndexOrder(idx));
+
+    // directory of the nodes at dirLevel
+    int shift = 3 * (level - dirLevel);
+    uint64_t nNodes = ((uint64_t) 1) << (3 * dirLevel);
+    long pos = 0;
+    for (uint64_t j=0; j<=nNodes; j++) {
+        while (pos < n && (k[pos] >> shift) < j)
+            pos++;
+        dir[j] = pos;
+    }
+
+    setColumns(base);
+}
+
+/*********************************************************************************************************/
+// Maps a snapshot written by writeSnapshot read-only into memory. The pages are shared with other
+// processes mapping the same file. The header and the columns are checked once (see validColumns), so that
+// a truncated or corrupt file is rejected instead of making the queries read outside the mapping.
+// Input:
+//   filename: snapshot file
+//
+void LinearOctree::openSnapshot(std::string filename)
+{
+    release();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open the snapshot file.");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SnapshotHeader)) {
+        ::close(fd);
+        throw std::runtime_error("Invalid snapshot file.");
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error("Failed to map the snapshot file.");
+    mapping = map;
+    mappingSize = st.st_size;
+
+    const SnapshotHeader *header = (const SnapshotHeader*) map;
+    uint64_t offsets[9];
+    if (memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) != 0 || header->byteOrder != snapshotByteOrder) {
+        release();
+        throw std::runtime_error("Not a SAGA snapshot file.");
+    }
+    if (header->version != snapshotVersion || (header->valueBytes != sizeof(double) && header->valueBytes != sizeof(float)) || header->maxLevel > mortonMaxLevel || header->directoryLevel > header->maxLevel || header->directoryLevel > maxDirectoryLevel) {
+        release();
+        throw std::runtime_error("Unsupported SAGA snapshot version.");
+    }
+    // every cell takes at least its key, which bounds nCells before the layout is computed with it
+    if (header->fileSize != (uint64_t) st.st_size || header->nCells > (uint64_t) st.st_size / sizeof(uint64_t) || layoutSize(header->nCells, header->directoryLevel, header->valueBytes, offsets) != header->fileSize) {
+        release();
+        throw std::runtime_error("Truncated SAGA snapshot file.");
+    }
+
+    setColumns((const char*) map);
+    if (! validColumns()) {
+        release();
+        throw std::runtime_error("Corrupt SAGA snapshot file.");
+    }
+}
+
+/*********************************************************************************************************/
+// Checks the columns of a snapshot, whose offsets and lengths follow from a valid header: the keys are
+// sorted and aligned on the level of their cell, the levels lie in the octree, byCellIndex is a
+// permutation sorting the cell indices, and the directory matches the keys. The searches then stay
+// inside the columns.
+// Output:
+//   true if the columns are consistent
+//
+bool LinearOctree::validColumns() const
+{
+    for (long i=0; i<nCells; i++) {
+        if (levels[i] > maxLevel || (keys[i] >> (3 * maxLevel)) != 0)
+            return false;
+        int shift = 3 * (maxLevel - levels[i]);
+        if ((keys[i] & ((((uint64_t) 1) << shift) - 1)) != 0 || (i > 0 && keys[i] <= keys[i - 1]))
+            return false;
+    }
+
+    std::vector<unsigned char> seen(nCells, 0);
+    for (long i=0; i<nCells; i++) {
+        int64_t pos = byCellIndex[i];
+        if (pos < 0 || pos >= nCells || seen[pos])
+            return false;
+        seen[pos] = 1;
+        if (i > 0 && cellIndices[pos] < cellIndices[byCellIndex[i - 1]])
+            return false;
+    }
+
+    int shift = 3 * (maxLevel - directoryLevel);
+    uint64_t nNodes = ((uint64_t) 1) << (3 * directoryLevel);
+    long pos = 0;
+    for (uint64_t j=0; j<=nNodes; j++) {
+        while (pos < nCells && (keys[pos] >> shift) < j)
+            pos++;
+        if (directory[j] != pos)
+            return false;
+    }
+    return true;
+}
+
+/*********************************************************************************************************/
+// Writes the octree as a snapshot file, to be opened with openSnapshot
+// Input:
+//   filename: snapshot file
+//
+void LinearOctree::writeSnapshot(std::string filename) const
+{
+    const char *base = (mapping != NULL) ? (const char*) mapping : (const char*) &buffer[0];
+    uint64_t totalSize = ((const SnapshotHeader*) base)->fileSize;
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (f == NULL)
+        throw std::runtime_error("Failed to create the snapshot file.");
+    size_t written = fwrite(base, 1, totalSize, f);
+    if (fclose(f) != 0 || written != totalSize)
+        throw std::runtime_error("Failed to write the snapshot file.");
+}
+
+/*********************************************************************************************************/
+// Returns the number of cells
+//
+long LinearOctree::size() const
+{
+    return nCells;
+}
+
+/*********************************************************************************************************/
+// Returns the finest refinement level present in the grid
+//
+int LinearOctree::getMaxLevel() const
+{
+    return maxLevel;
+}
+
+/*********************************************************************************************************/
+// Returns the size in bytes of the stored values: 8 (double) or 4 (float)
+//
+int LinearOctree::getValueBytes() const
+{
+    return valueBytes;
+}
+
+/*********************************************************************************************************/
+// Returns the position of the cell with a given index (rowid in the database), or -1 if there is none.
+//
+long LinearOctree::findCellIndex(int idx) const
+{
+    const int64_t *it = std::lower_bound(byCellIndex, byCellIndex + nCells, idx, CellIndexOrder(cellIndices));
+    if (it == byCellIndex + nCells || cellIndices[*it] != idx)
+        return -1;
+    return *it;
+}
+
+/*********************************************************************************************************/
+// Returns the positions of the cells whose index lies in [firstIndex, lastIndex], in increasing index order.
+// Output:
+//   positions: positions of the cells (appended)
+//
+void LinearOctree::findCellsIndexRange(long firstIndex, long lastIndex, std::vector<long> &positions) const
+{
+    if (firstIndex > INT32_MAX || lastIndex < INT32_MIN)
+        return;
+    int first = (int) std::max(firstIndex, (long) INT32_MIN);
+    const int64_t *it = std::lower_bound(byCellIndex, byCellIndex + nCells, first, CellIndexOrder(cellIndices));
+    for (; it != byCellIndex + nCells && cellIndices[*it] <= lastIndex; it++)
+        positions.push_back(*it);
+}
+
+/*********************************************************************************************************/
+// Given a range in space returns the positions of the cells overlapping it.
+// Boundaries are inclusive, as in the R-tree queries of the SQLite backend.
+// Input:
+//   (xmin,ymin,zmin): minimum point coordinates in grid units
+//   (xmax,ymax,zmax): maximum point coordinates in grid units
+// Output:
+//   positions: positions of the cells (appended)
+//
+void LinearOctree::findCellsRegion(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, std::vector<long> &positions) const
+{
+    if (nCells == 0 || xmax < 0 || xmin > 1 || ymax < 0 || ymin > 1 || zmax < 0 || zmin > 1)
+        return;
+    double box[6] = {xmin, xmax, ymin, ymax, zmin, zmax};
+    findCellsNode(0, 0, 0, 0, 0, size(), box, positions);
+}
+
+/*********************************************************************************************************/
+// Recursive part of findCellsRegion. The node at (level, ix, iy, iz) overlaps the box and the cells inside
+// it are those at positions [lo, hi).
+//
+void LinearOctree::findCellsNode(int level, uint64_t ix, uint64_t iy, uint64_t iz, long lo, long hi, const double *box, std::vector<long> &positions) const
+{
+    if (lo >= hi)
+        return;
+
+    // the node is a leaf cell
+    if (levels[lo] == level) {
+        positions.push_back(lo);
+        return;
+    }
+    if (level >= maxLevel)
+        return;
+
+    int shift = 3 * (maxLevel - level - 1);
+    uint64_t prefix = mortonEncode(ix, iy, iz);
+    uint64_t base = prefix << (3 * (maxLevel - level));
+    double childSize = ldexp(1., -(level + 1));
+    long start = lo;
+    for (uint64_t c=0; c<8; c++) {
+        long end;
+        if (c == 7)
+            end = hi;
+        else if (level < directoryLevel)
+            end = directory[(8 * prefix + c + 1) << (3 * (directoryLevel - level - 1))];
+        else
+            end = std::lower_bound(keys + start, keys + hi, base + ((c + 1) << shift)) - keys;
+        uint64_t cx = 2 * ix + ((c >> 2) & 1);
+        uint64_t cy = 2 * iy + ((c >> 1) & 1);
+        uint64_t cz = 2 * iz + (c & 1);
+        if (start < end && (cx + 1) * childSize >= box[0] && cx * childSize <= box[1] && (cy + 1) * childSize >= box[2] && cy * childSize <= box[3] && (cz + 1) * childSize >= box[4] && cz * childSize <= box[5])
+            findCellsNode(level + 1, cx, cy, cz, start, end, box, positions);
+        start = end;
+    }
+}
+
+/*********************************************************************************************************/
+// Returns the cell at a given position
+//
+AMRcell LinearOctree::getCell(long pos) const
+{
+    uint64_t ix, iy, iz;
+    mortonDecode(keys[pos], ix, iy, iz);
+    int level = levels[pos];
+    int shift = maxLevel - level;
+    double xmin = ldexp((double) (ix >> shift), -level);
+    double ymin = ldexp((double) (iy >> shift), -level);
+    double zmin = ldexp((double) (iz >> shift), -level);
+    double size = ldexp(1., -level);
+
+    return AMRcell(cellIndices[pos], xmin, xmin + size, ymin, ymin + size, zmin, zmin + size);
+}
+
+/*********************************************************************************************************/
+// Returns the cell at a given position in compact form: its key at maxLevel drops the 3 bits per level
+// below its own
+//
+CompactCell LinearOctree::getCompactCell(long pos) const
+{
+    CompactCell c;
+    c.level = levels[pos];
+    c.key = keys[pos] >> (3 * (maxLevel - c.level));
+    c.index = cellIndices[pos];
+    return c;
+}
+
+/*********************************************************************************************************/
+// Returns the local properties of the cell at a given position
+//
+LocalProperties LinearOctree::getLocalProperties(long pos) const
+{
+    return LocalProperties(getValue(rho, valueBytes, pos), getValue(Bx, valueBytes, pos), getValue(By, valueBytes, pos), getValue(Bz, valueBytes, pos));
+}
+
+} // namespace
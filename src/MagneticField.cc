@@ -6,9 +6,27 @@ namespace saga {
 
 /*********************************************************************************************************/ 
 // Constructor Magnetic Field
-MagneticField::MagneticField(ref_ptr<AMRgrid> grid)
+// Input:
+//   grid: AMR grid
+//   interpolate: whether the field is interpolated between cell centres (see FieldInterpolator) 
+//                instead of taken from the nearest cell
+MagneticField::MagneticField(ref_ptr<AMRgrid> grid, bool interpolate)
 {
     TheGrid = grid;
+    setInterpolation(interpolate);
+}
+
+
+/*********************************************************************************************************/ 
+// Switches between the value of the nearest cell and the interpolated field
+void MagneticField::setInterpolation(bool interpolate)
+{
+    Interpolator = interpolate ? new FieldInterpolator(TheGrid) : NULL;
+}
+
+bool MagneticField::getInterpolation() const
+{
+    return Interpolator.valid();
 }
 
 
@@ -17,7 +35,7 @@ MagneticField::MagneticField(ref_ptr<AMRgrid> grid)
 std::vector<double> MagneticField::getField(double x, double y, double z) const
 {
     std::vector<double> b;
-    LocalProperties lp = TheGrid->getLocalProperties(x,y,z);
+    LocalProperties lp = Interpolator.valid() ? Interpolator->getLocalProperties(x,y,z) : TheGrid->getLocalProperties(x,y,z);
     b.push_back(lp.getBx());
     b.push_back(lp.getBy());
     b.push_back(lp.getBz());
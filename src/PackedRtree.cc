@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "saga/PackedRtree.h"
+#include "saga/Morton.h"
+
+
+namespace saga{
+
+// bytes of a node entry: 64-bit id and 6 float coordinates
+static const int bytesPerEntry = 8 + 6 * 4;
+
+// rows of <name>_rowid inserted by one statement, below the 999 parameters SQLite accepts by default
+static const int pairsPerStatement = 256;
+
+/*********************************************************************************************************/
+// Conversions to the format of the SQLite R-tree module: big-endian integers, and coordinates rounded
+// outwards to floats
+//
+static void putBigEndian(unsigned char *p, uint64_t v, int bytes)
+{
+    for (int i=bytes-1; i>=0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static float roundDown(double v)
+{
+    float f = (float) v;
+    if (f > v)
+        f = nextafterf(f, -INFINITY);
+    return f;
+}
+
+static float roundUp(double v)
+{
+    float f = (float) v;
+    if (f < v)
+        f = nextafterf(f, INFINITY);
+    return f;
+}
+
+/*********************************************************************************************************/
+// Statements writing the nodes, finalised whatever happens
+//
+struct RtreeStatements
+{
+    RtreeStatements() : node(NULL), rowid(NULL), rowids(NULL), parent(NULL) {}
+    ~RtreeStatements()
+    {
+        sqlite3_finalize(node);
+        sqlite3_finalize(rowid);
+        sqlite3_finalize(rowids);
+        sqlite3_finalize(parent);
+    }
+    sqlite3_stmt *node;
+    sqlite3_stmt *rowid;
+    sqlite3_stmt *rowids;
+    sqlite3_stmt *parent;
+};
+
+static void check(sqlite3 *db, int rc)
+{
+    if (rc != SQLITE_OK && rc != SQLITE_DONE && rc != SQLITE_ROW)
+        throw std::runtime_error(std::string("Failed to write the R-tree: ") + sqlite3_errmsg(db));
+}
+
+static void insertPairs(sqlite3 *db, sqlite3_stmt *statement, const std::pair<int64_t, int64_t> *pairs, int n)
+{
+    for (int i=0; i<n; i++) {
+        sqlite3_bind_int64(statement, 2 * i + 1, pairs[i].first);
+        sqlite3_bind_int64(statement, 2 * i + 2, pairs[i].second);
+    }
+    check(db, sqlite3_step(statement));
+    sqlite3_reset(statement);
+}
+
+/*********************************************************************************************************/
+// Constructor
+PackedRtree::PackedRtree() : nNodes(0), depth(0)
+{
+}
+
+/*********************************************************************************************************/
+// Destructor
+PackedRtree::~PackedRtree()
+{
+}
+
+void PackedRtree::reserve(size_t n)
+{
+    entries.reserve(n);
+}
+
+/*********************************************************************************************************/
+// Adds the box of a cell
+// Input:
+//   id: index of the cell (id of the R-tree)
+//   (x,y,z)(min,max): bounds of the cell in grid units
+//
+void PackedRtree::add(int64_t id, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+{
+    Entry e;
+    e.id = id;
+    e.box[0] = roundDown(xmin);
+    e.box[1] = roundUp(xmax);
+    e.box[2] = roundDown(ymin);
+    e.box[3] = roundUp(ymax);
+    e.box[4] = roundDown(zmin);
+    e.box[5] = roundUp(zmax);
+    entries.push_back(e);
+}
+
+size_t PackedRtree::size() const
+{
+    return entries.size();
+}
+
+void PackedRtree::clear()
+{
+    entries.clear();
+    nNodes = 0;
+    depth = 0;
+}
+
+/*********************************************************************************************************/
+// Creates the R-tree and writes all the boxes added, within a savepoint so that it joins a transaction
+// of the caller if there is one
+// Input:
+//   db: open database, which must not have a table of that name
+//   name: name of the R-tree (Cell_tree for a SAGA database)
+//
+void PackedRtree::write(sqlite3 *db, std::string name)
+{
+    check(db, sqlite3_exec(db, "SAVEPOINT packedRtree;", NULL, NULL, NULL));
+    try {
+        writeNodes(db, name);
+    } catch (std::runtime_error &e) {
+        sqlite3_exec(db, "ROLLBACK TO packedRtree; RELEASE packedRtree;", NULL, NULL, NULL);
+        throw;
+    }
+    check(db, sqlite3_exec(db, "RELEASE packedRtree;", NULL, NULL, NULL));
+}
+
+/*********************************************************************************************************/
+// Creates the virtual table and writes its nodes (see write)
+//
+void PackedRtree::writeNodes(sqlite3 *db, std::string name)
+{
+    std::string shadow = "\"" + name;
+    check(db, sqlite3_exec(db, ("CREATE VIRTUAL TABLE \"" + name + "\" USING rtree(id, minX, maxX, minY, maxY, minZ, maxZ);").c_str(), NULL, NULL, NULL));
+
+    // size of the nodes, chosen by SQLite from the page size when creating the table: that of its root
+    RtreeStatements statements;
+    check(db, sqlite3_prepare_v2(db, ("SELECT length(data) FROM " + shadow + "_node\" WHERE nodeno = 1;").c_str(), -1, &statements.node, NULL));
+    if (sqlite3_step(statements.node) != SQLITE_ROW)
+        throw std::runtime_error("Failed to write the R-tree: no root node.");
+    int nodeSize = sqlite3_column_int(statements.node, 0);
+    sqlite3_finalize(statements.node);
+    statements.node = NULL;
+    long capacity = (nodeSize - 4) / bytesPerEntry;
+    if (capacity < 2)
+        throw std::runtime_error("Failed to write the R-tree: nodes too small.");
+
+    // leaves in the Hilbert order of the centres of the cells
+    std::vector<std::pair<uint64_t, size_t> > order(entries.size());
+    for (size_t i=0; i<entries.size(); i++) {
+        const float *b = entries[i].box;
+        order[i].first = hilbertEncode(hilbertCoordinate(0.5 * ((double) b[0] + b[1])), hilbertCoordinate(0.5 * ((double) b[2] + b[3])), hilbertCoordinate(0.5 * ((double) b[4] + b[5])));
+        order[i].second = i;
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<Entry> level(entries.size());
+    for (size_t i=0; i<order.size(); i++)
+        level[i] = entries[order[i].second];
+
+    check(db, sqlite3_prepare_v2(db, ("INSERT OR REPLACE INTO " + shadow + "_node\" VALUES (?1, ?2);").c_str(), -1, &statements.node, NULL));
+    std::string insertRowid = "INSERT INTO " + shadow + "_rowid\" VALUES (?, ?)";
+    check(db, sqlite3_prepare_v2(db, (insertRowid + ";").c_str(), -1, &statements.rowid, NULL));
+    for (int i=1; i<pairsPerStatement; i++)
+        insertRowid += ", (?, ?)";
+    check(db, sqlite3_prepare_v2(db, (insertRowid + ";").c_str(), -1, &statements.rowids, NULL));
+    check(db, sqlite3_prepare_v2(db, ("INSERT INTO " + shadow + "_parent\" VALUES (?1, ?2);").c_str(), -1, &statements.parent, NULL));
+
+    // levels from the leaves up: each full run of entries makes a node, whose box is an entry of the
+    // level above; the root (node 1) holds the last level, which fits in a node
+    std::vector<unsigned char> data(nodeSize);
+    std::vector<std::pair<int64_t, int64_t> > leaves;
+    leaves.reserve(level.size());
+    int64_t next = 2;
+    depth = 0;
+    while (true) {
+        bool root = (long) level.size() <= capacity;
+        std::vector<Entry> parents;
+        for (size_t i=0; i<level.size() || (root && i == 0); i+=capacity) {
+            int64_t node = root ? 1 : next++;
+            long count = std::min((long) (level.size() - i), capacity);
+            std::fill(data.begin(), data.end(), 0);
+            putBigEndian(&data[0], root ? depth : 0, 2);
+            putBigEndian(&data[2], count, 2);
+            Entry parent;
+            parent.id = node;
+            for (long j=0; j<count; j++) {
+                const Entry &e = level[i + j];
+                unsigned char *p = &data[4 + j * bytesPerEntry];
+                putBigEndian(p, e.id, 8);
+                for (int k=0; k<6; k++) {
+                    uint32_t bits;
+                    memcpy(&bits, &e.box[k], 4);
+                    putBigEndian(p + 8 + 4 * k, bits, 4);
+                    if (j == 0)
+                        parent.box[k] = e.box[k];
+                    else
+                        parent.box[k] = (k % 2 == 0) ? std::min(parent.box[k], e.box[k]) : std::max(parent.box[k], e.box[k]);
+                }
+                std::pair<int64_t, int64_t> link(e.id, node);
+                if (depth == 0)
+                    leaves.push_back(link);
+                else
+                    insertPairs(db, statements.parent, &link, 1);
+            }
+            sqlite3_bind_int64(statements.node, 1, node);
+            sqlite3_bind_blob(statements.node, 2, &data[0], nodeSize, SQLITE_STATIC);
+            check(db, sqlite3_step(statements.node));
+            sqlite3_reset(statements.node);
+            parents.push_back(parent);
+        }
+        if (root)
+            break;
+        level.swap(parents);
+        depth++;
+    }
+    nNodes = next - 1;
+
+    // leaf of each cell, in the order of the ids: appended to the table rather than inserted at random
+    std::sort(leaves.begin(), leaves.end());
+    size_t i = 0;
+    for (; i+pairsPerStatement<=leaves.size(); i+=pairsPerStatement)
+        insertPairs(db, statements.rowids, &leaves[i], pairsPerStatement);
+    for (; i<leaves.size(); i++)
+        insertPairs(db, statements.rowid, &leaves[i], 1);
+}
+
+/*********************************************************************************************************/
+// Number of nodes and depth (0 when the root is a leaf) of the last R-tree written
+//
+long PackedRtree::getNumberOfNodes() const
+{
+    return nNodes;
+}
+
+int PackedRtree::getDepth() const
+{
+    return depth;
+}
+
+} // namespace
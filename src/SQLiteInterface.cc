@@ -1,25 +1,297 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <algorithm>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <atomic>
 
 #include "saga/SQLiteInterface.h"
+#include "saga/SQLiteMemoryImage.h"
 
 
 namespace saga{
 
-const int maxNumThreads = 256;
-int threadID;
-sqlite3 *dbarr[maxNumThreads];    
-sqlite3 *dbsing;    
+/*********************************************************************************************************/ 
+// A connection to the database together with its cache of prepared statements.
+// A connection is used by one thread at a time.
+//
+// Counters are written by the thread using the connection only, and may be read by any thread.
+//
+struct SQLiteQueryCounters
+{
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> rows;
+    std::atomic<unsigned long long> nanoseconds;
+    std::atomic<unsigned long long> histogram[SQLiteQueryStatistics::nLatencyBuckets];
+};
+
+struct SQLiteConnection
+{
+    sqlite3 *db;
+    sqlite3_stmt *statements[SQLiteDB::maxCachedStatements];
+
+    int number;
+    int pageSize;
+    int busyTimeout;
+    std::atomic<unsigned long long> busyRetries;
+    std::atomic<unsigned long long> pagesRead;
+    SQLiteQueryCounters counters[SQLiteDB::maxCachedStatements + 1];
+};
 
-static int callback(void *NotUsed, int argc, char **argv, char **azColName)
+static inline void add(std::atomic<unsigned long long> &counter, unsigned long long n)
 {
-    int i;
-    for(i=0; i<argc; i++){
-        printf("%s = %s\n", azColName[i], argv[i] ? argv[i] : "NULL");
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static void resetCounters(SQLiteConnection *connection)
+{
+    connection->busyRetries.store(0);
+    connection->pagesRead.store(0);
+    for (int k=0; k<=SQLiteDB::maxCachedStatements; k++) {
+        SQLiteQueryCounters &q = connection->counters[k];
+        q.count.store(0);
+        q.rows.store(0);
+        q.nanoseconds.store(0);
+        for (int i=0; i<SQLiteQueryStatistics::nLatencyBuckets; i++)
+            q.histogram[i].store(0);
     }
-    printf("\n");
-    return 0;
+}
+
+/*********************************************************************************************************/ 
+// Connections of one open database. Threads lease a connection the first time they query the database
+// and keep it until they exit, when it returns to the free list for other threads.
+//
+class SQLiteConnectionPool
+{
+public:
+    SQLiteConnectionPool(unsigned long poolId, std::string file, SQLiteOpenOptions openOptions) : id(poolId), filename(file), options(openOptions), image(NULL) {}
+    ~SQLiteConnectionPool();
+    SQLiteConnection* acquire();
+    void release(SQLiteConnection *connection);
+    int size();
+    std::vector<SQLiteConnection*> getConnections();
+
+    const unsigned long id;
+    const std::string filename;
+    const SQLiteOpenOptions options;
+    // image of the file queried by all connections, in preload mode
+    SQLiteMemoryImage *image;
+
+private:
+    std::mutex mutex;
+    std::vector<SQLiteConnection*> connections;
+    std::vector<SQLiteConnection*> freeConnections;
+};
+
+/*********************************************************************************************************/ 
+// Connections leased by the calling thread, identified by the id of their pool.
+// On thread exit they are returned to their pools, if these are still open.
+//
+struct SQLiteLease
+{
+    unsigned long poolId;
+    SQLiteConnection *connection;
+};
+
+struct SQLiteThreadLeases
+{
+    ~SQLiteThreadLeases();
+    std::vector<SQLiteLease> leases;
+};
+
+// open pools, by id; guards pools against being closed while a thread returns a connection
+static std::mutex registryMutex;
+static std::map<unsigned long, SQLiteConnectionPool*> registry;
+static unsigned long nextPoolId = 1;
+
+static thread_local SQLiteThreadLeases threadLeases;
+
+SQLiteThreadLeases::~SQLiteThreadLeases()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (size_t i=0; i<leases.size(); i++) {
+        std::map<unsigned long, SQLiteConnectionPool*>::iterator it = registry.find(leases[i].poolId);
+        if (it != registry.end())
+            it->second->release(leases[i].connection);
+    }
+}
+
+/*********************************************************************************************************/ 
+// Default options: immutable file read through a memory mapping of up to 1 GiB, private page caches
+//
+SQLiteOpenOptions::SQLiteOpenOptions()
+{
+    immutable = true;
+    mmapSize = 1LL << 30;
+    cacheSize = 0;
+    sharedCache = false;
+    busyTimeout = 5000;
+    preload = false;
+}
+
+/*********************************************************************************************************/ 
+// Builds the URI of a file, escaping the characters that have a meaning in URIs
+// Input:
+//   filename: path of the file
+//   immutable: whether to add the immutable=1 parameter
+// Output:
+//   URI to be opened with SQLITE_OPEN_URI
+//
+static std::string fileURI(const std::string &filename, bool immutable)
+{
+    std::string uri = "file:";
+    for (size_t i=0; i<filename.size(); i++) {
+        char c = filename[i];
+        if (c == '%' || c == '?' || c == '#') {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", (unsigned char) c);
+            uri += hex;
+        } else {
+            uri += c;
+        }
+    }
+    if (immutable)
+        uri += "?immutable=1";
+    return uri;
+}
+
+/*********************************************************************************************************/ 
+// Busy handler: sleeps 1 ms before each retry, until the busy timeout of the connection has elapsed
+//
+static int busyHandler(void *data, int nRetries)
+{
+    SQLiteConnection *connection = (SQLiteConnection*) data;
+    if (nRetries >= connection->busyTimeout)
+        return 0;
+    add(connection->busyRetries, 1);
+    usleep(1000);
+    return 1;
+}
+
+/*********************************************************************************************************/ 
+// Applies the options of the pool to a freshly opened connection
+//
+static void configureConnection(SQLiteConnection *connection, const SQLiteOpenOptions &options)
+{
+    sqlite3 *db = connection->db;
+    char pragma[128];
+    snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size=%lld;", options.mmapSize);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+    if (options.cacheSize != 0) {
+        snprintf(pragma, sizeof(pragma), "PRAGMA cache_size=%d;", options.cacheSize);
+        sqlite3_exec(db, pragma, NULL, NULL, NULL);
+    }
+    if (! options.immutable && ! options.preload) {
+        connection->busyTimeout = options.busyTimeout;
+        sqlite3_busy_handler(db, busyHandler, connection);
+    }
+
+    sqlite3_stmt *statement;
+    connection->pageSize = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA page_size;", -1, &statement, NULL) == SQLITE_OK) {
+        if (sqlite3_step(statement) == SQLITE_ROW)
+            connection->pageSize = sqlite3_column_int(statement, 0);
+        sqlite3_finalize(statement);
+    }
+}
+
+/*********************************************************************************************************/ 
+// Finalizes all cached statements of a connection and closes it
+//
+static int closeConnection(SQLiteConnection *connection)
+{
+    for (int i=0; i<SQLiteDB::maxCachedStatements; i++) {
+        if (connection->statements[i] != NULL)
+            sqlite3_finalize(connection->statements[i]);
+    }
+    int ret = sqlite3_close(connection->db);
+    delete connection;
+    return ret;
+}
+
+/*********************************************************************************************************/ 
+// Closes all connections of the pool, including the ones still leased
+//
+SQLiteConnectionPool::~SQLiteConnectionPool()
+{
+    for (size_t i=0; i<connections.size(); i++)
+        closeConnection(connections[i]);
+    delete image;
+}
+
+/*********************************************************************************************************/ 
+// Returns a free connection, opening a new one if there is none
+//
+SQLiteConnection* SQLiteConnectionPool::acquire()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (! freeConnections.empty()) {
+        SQLiteConnection *connection = freeConnections.back();
+        freeConnections.pop_back();
+        return connection;
+    }
+
+    SQLiteConnection *connection = new SQLiteConnection();
+    for (int i=0; i<SQLiteDB::maxCachedStatements; i++)
+        connection->statements[i] = NULL;
+    connection->number = connections.size();
+    connection->busyTimeout = 0;
+    resetCounters(connection);
+    int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_URI;
+    flags |= options.sharedCache ? SQLITE_OPEN_SHAREDCACHE : SQLITE_OPEN_PRIVATECACHE;
+    int ret;
+    if (image != NULL)
+        ret = sqlite3_open_v2(filename.c_str(), &connection->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE, image->getVFSName());
+    else
+        ret = sqlite3_open_v2(fileURI(filename, options.immutable).c_str(), &connection->db, flags, NULL);
+    if (ret != SQLITE_OK) {
+        sqlite3_close(connection->db);
+        delete connection;
+        throw std::runtime_error("Failed to open the file.");
+    }
+    configureConnection(connection, options);
+    connections.push_back(connection);
+    return connection;
+}
+
+/*********************************************************************************************************/ 
+// Puts a connection back in the free list
+//
+void SQLiteConnectionPool::release(SQLiteConnection *connection)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    freeConnections.push_back(connection);
+}
+
+/*********************************************************************************************************/ 
+// Returns the number of connections opened so far
+//
+int SQLiteConnectionPool::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return connections.size();
+}
+
+/*********************************************************************************************************/ 
+// Returns all connections opened so far, leased or not
+//
+std::vector<SQLiteConnection*> SQLiteConnectionPool::getConnections()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return connections;
+}
+
+/*********************************************************************************************************/ 
+// Empty statistics
+//
+SQLiteQueryStatistics::SQLiteQueryStatistics()
+{
+    count = 0;
+    rows = 0;
+    seconds = 0;
+    for (int i=0; i<nLatencyBuckets; i++)
+        histogram[i] = 0;
 }
 
 
@@ -28,78 +300,137 @@ static int callback(void *NotUsed, int argc, char **argv, char **azColName)
 //
 SQLiteDB::SQLiteDB()
 {
-    int n = atoi(getenv("OMP_NUM_THREADS"));
-    #ifdef _OPENMP 
-        if (n > 1)
-            omp_set_num_threads(std::min(maxNumThreads, n));
-        else
-            omp_set_num_threads(1);
-    #endif
+    pool = NULL;
+    statisticsEnabled = false;
 
     // sqlite3_config(SQLITE_CONFIG_SERIALIZED);
     sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
-    sqlite3_enable_shared_cache(1); 
 }
 
 SQLiteDB::~SQLiteDB()
 {
+    if (pool != NULL)
+        close();
 }
 
 /*********************************************************************************************************/ 
-// Opens the SQL database
+// Opens the SQL database. 
+// Only one connection is opened here; every other thread opens its own on its first query, so the
+// database can be used from any number of threads, whatever threading model they come from.
 // Input:
 //     filename: name of the file
+//     options: settings applied to every connection
 //
-bool SQLiteDB::open(std::string filename)
-{
-    int fileRet;
-    #ifndef _OPENMP
-        fileRet = sqlite3_open(filename.c_str(), &dbsing);
-    #else
-        // opening connections with the database
-        #pragma omp parallel private(fileRet,threadID) shared(filename, dbarr) default(none)
-        {
-            threadID = omp_get_thread_num();
-            fileRet = sqlite3_open_v2(filename.c_str(), &dbarr[threadID], SQLITE_OPEN_READONLY , NULL);
-            // fileRet = sqlite3_open_v2(filename.c_str(), &dbarr[threadID], SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX , NULL);
-        }
-    #endif
+bool SQLiteDB::open(std::string filename, SQLiteOpenOptions options)
+{
+    if (pool != NULL)
+        close();
 
-    if(fileRet == 0) {
-        std::cout << "Database successfully opened." << std::endl;
-        return true;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        pool = new SQLiteConnectionPool(nextPoolId++, filename, options);
+        registry[pool->id] = pool;
     }
-    else {
-        throw std::runtime_error("Failed to open the file.");
-        return false;
+
+    // the first connection checks that the file can be opened
+    try {
+        if (options.preload) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            pool->image = new SQLiteMemoryImage();
+            pool->image->load(filename);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Database loaded into memory: " << pool->image->size() / 1048576. << " MB in " << seconds << " s." << std::endl;
+        }
+        connection();
+    } catch (std::exception &e) {
+        close();
+        throw;
     }
-        
+
+    std::cout << "Database successfully opened." << std::endl;
+    return true;
 }
 
 /*********************************************************************************************************/ 
-// Closes the SQL database
+// Closes the SQL database.
+// All connections are closed, so no other thread may be querying the database at this point.
 //
 bool SQLiteDB::close() 
 {
-    int fileRet;
-    #ifndef _OPENMP
-        fileRet = sqlite3_close(dbsing);
-    #else
-        // closing connections to the database
-        #pragma omp parallel private(threadID,fileRet) shared(dbarr) default(none)
-        {
-            threadID = omp_get_thread_num();        
-            fileRet = sqlite3_close(dbarr[threadID]);
+    if (pool == NULL)
+        return true;
+
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.erase(pool->id);
+    }
+    delete pool;
+    pool = NULL;
+
+    return true;
+} 
+
+/*********************************************************************************************************/ 
+// Returns the connection leased by the calling thread, leasing one on the first call.
+// The lookup only touches thread-local data, so concurrent queries never contend for a lock.
+//
+SQLiteConnection* SQLiteDB::connection()
+{
+    if (pool == NULL)
+        throw std::runtime_error("The SQL database is not open.");
+
+    std::vector<SQLiteLease> &leases = threadLeases.leases;
+    for (size_t i=0; i<leases.size(); i++) {
+        if (leases[i].poolId == pool->id)
+            return leases[i].connection;
+    }
+
+    // forget the leases of pools that have been closed in the meantime
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        size_t j = 0;
+        for (size_t i=0; i<leases.size(); i++) {
+            if (registry.count(leases[i].poolId) > 0)
+                leases[j++] = leases[i];
         }
-    #endif
+        leases.resize(j);
+    }
+
+    SQLiteLease lease;
+    lease.poolId = pool->id;
+    lease.connection = pool->acquire();
+    leases.push_back(lease);
+    return lease.connection;
+}
+
+/*********************************************************************************************************/ 
+// Returns the number of connections opened so far, i.e. the number of threads that have used the database
+//
+int SQLiteDB::getNumberOfConnections()
+{
+    return (pool != NULL) ? pool->size() : 0;
+}
 
-    if(fileRet==0)
+/*********************************************************************************************************/ 
+// Collects the rows of a query as text. Used by the legacy string interface.
+//
+class TextRowCollector : public SQLiteRowVisitor
+{
+public:
+    TextRowCollector(std::vector<std::vector<std::string> > &res) : results(res) {}
+    bool visitRow(const SQLiteRow &row)
+    {
+        std::vector<std::string> values;
+        for(int col = 0; col < row.getColumnCount(); col++){
+            const char *charPtr = row.getText(col);
+            values.push_back(charPtr ? charPtr : "");
+        }
+        results.push_back(values);
         return true;
-    else {
-        throw std::runtime_error("Failed to close the SQL database.");
-        return false;
     }
-} 
+private:
+    std::vector<std::vector<std::string> > &results;
+};
 
 /*********************************************************************************************************/ 
 // Returns the result of a query
@@ -110,82 +441,197 @@ bool SQLiteDB::close()
 //
 std::vector<std::vector<std::string> > SQLiteDB::query(char* queryString)
 {
+    std::vector<std::vector<std::string> > results;
+    TextRowCollector collector(results);
+    query(queryString, collector);
+    return results;  
+}
 
+/*********************************************************************************************************/ 
+// Runs a query and hands each resulting row to a visitor, with typed access to the columns.
+// Input:
+//   queryString: contains the string to be used as query
+//   visitor: receives the rows; returning false from visitRow stops the query
+// Output:
+//   number of rows visited
+//
+int SQLiteDB::query(const char* queryString, SQLiteRowVisitor &visitor)
+{
+    sqlite3 *db = connection()->db;
     sqlite3_stmt *statement;
-    std::vector<std::vector<std::string> > results;
+    if(sqlite3_prepare_v2(db, queryString, -1, &statement, 0) != SQLITE_OK)
+        throw std::runtime_error(std::string("Failed to prepare query: ") + sqlite3_errmsg(db));
 
-    // single thread
-    #ifndef _OPENMP
-        if(sqlite3_prepare_v2(dbsing, queryString, -1, &statement, 0) == SQLITE_OK){
-            int cols = sqlite3_column_count(statement);
-            int result = 0;
-            while(true) {
-                result = sqlite3_step(statement);
-                if(result == SQLITE_ROW){
-                    std::vector<std::string> values;
-                    for(int col = 0; col < cols; col++){
-                        char *charPtr = (char*)sqlite3_column_text(statement, col);
-                        std::string str = charPtr;
-                        values.push_back(str);
-                    }
-                    results.push_back(values);
-                } else {
-                    break;   
-                }
-            }
-            sqlite3_finalize(statement);
-        }
-        std::string error = sqlite3_errmsg(dbsing);
-
-    // multiple threads
-    #else
-        threadID = omp_get_thread_num();
-        int accessCounts = 0;
-        int accessCountsTolerance = 50;
-        if(sqlite3_prepare_v2(dbarr[threadID], queryString, -1, &statement, 0) == SQLITE_OK){
-            int cols = sqlite3_column_count(statement);
-            int result = 0;
-            char *charPtr;
-            do {
-                result = sqlite3_step(statement);
-                // lock to avoid thread conflict
-                if (result == SQLITE_LOCKED || result == SQLITE_BUSY) { 
-                    usleep(1000);
-                    // printf("threadID: %i \t\t sleeping... \t\t access counts %i \n", threadID, accessCounts);
-                } 
-                if (result == SQLITE_ROW){
-                    std::vector<std::string> values;
-                    for(int col = 0; col < cols; col++){
-                        char *charPtr = (char*)sqlite3_column_text(statement, col);
-                        std::string str = charPtr;
-                        values.push_back(str);
-                    }
-                    results.push_back(values);
-                } 
-                accessCounts++;
-            } while (accessCounts < accessCountsTolerance && (result == SQLITE_LOCKED || result == SQLITE_BUSY));
-            sqlite3_finalize(statement);
+    int nRows = step(statement, visitor);
+    sqlite3_finalize(statement);
+
+    return nRows;
+}
+
+/*********************************************************************************************************/ 
+// Returns a prepared statement from the cache of the calling thread's connection.
+// The statement is prepared on first use; afterwards it is only reset, so the SQL is parsed once per 
+// connection. Parameters are bound by the caller with sqlite3_bind_* and the statement is run with step().
+// Input:
+//   slot: cache position reserved by the caller for this statement (0 <= slot < maxCachedStatements)
+//   queryString: SQL of the statement, with ?N parameters
+// Output:
+//   prepared statement, ready for binding
+//
+sqlite3_stmt* SQLiteDB::prepareCached(int slot, const char* queryString)
+{
+    if (slot < 0 || slot >= maxCachedStatements)
+        throw std::out_of_range("Invalid prepared statement slot.");
+
+    SQLiteConnection *c = connection();
+    sqlite3_stmt **cache = c->statements;
+    if (cache[slot] == NULL) {
+        sqlite3 *db = c->db;
+        if(sqlite3_prepare_v2(db, queryString, -1, &cache[slot], 0) != SQLITE_OK)
+            throw std::runtime_error(std::string("Failed to prepare query: ") + sqlite3_errmsg(db));
+    }
+
+    return cache[slot];
+}
+
+/*********************************************************************************************************/ 
+// Steps a prepared statement and hands each resulting row to a visitor.
+// The statement is reset afterwards, so cached statements can be re-bound and reused.
+// Waiting on locks is left to the busy handler of the connection; immutable databases never wait.
+// Input:
+//   statement: prepared statement with all parameters bound
+//   visitor: receives the rows; returning false from visitRow stops the query
+// Output:
+//   number of rows visited
+//
+int SQLiteDB::step(sqlite3_stmt *statement, SQLiteRowVisitor &visitor)
+{
+    // read once, so that a query is either fully recorded or not at all
+    bool timed = statisticsEnabled.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point start;
+    if (timed)
+        start = std::chrono::steady_clock::now();
+
+    SQLiteRow row(statement);
+    int nRows = 0;
+    int result;
+    while((result = sqlite3_step(statement)) == SQLITE_ROW) {
+        nRows++;
+        if(! visitor.visitRow(row))
+            break;
+    }
+    sqlite3_reset(statement);
+
+    if (timed)
+        record(statement, nRows, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+    if (result != SQLITE_ROW && result != SQLITE_DONE)
+        throw std::runtime_error(std::string("Query failed: ") + sqlite3_errstr(result));
+
+    return nRows;
+}
+
+/*********************************************************************************************************/ 
+// Adds a query run by the calling thread to the statistics of its connection
+// Input:
+//   statement: statement run; its kind is its slot in the cache, or uncached
+//   nRows: number of rows visited
+//   nanoseconds: time spent stepping the statement
+//
+void SQLiteDB::record(sqlite3_stmt *statement, int nRows, long long nanoseconds)
+{
+    SQLiteConnection *c = connection();
+    int kind = maxCachedStatements;
+    for (int i=0; i<maxCachedStatements; i++) {
+        if (c->statements[i] == statement) {
+            kind = i;
+            break;
         }
-        std::string error = sqlite3_errmsg(dbarr[threadID]);
-    #endif
-    
-    return results;  
+    }
+
+    SQLiteQueryCounters &q = c->counters[kind];
+    add(q.count, 1);
+    add(q.rows, nRows);
+    add(q.nanoseconds, nanoseconds);
+    int bucket = 0;
+    while (bucket < SQLiteQueryStatistics::nLatencyBuckets - 1 && (1LL << bucket) * 1000 <= nanoseconds)
+        bucket++;
+    add(q.histogram[bucket], 1);
+
+    int current = 0, highest = 0;
+    if (sqlite3_db_status(c->db, SQLITE_DBSTATUS_CACHE_MISS, &current, &highest, 0) == SQLITE_OK)
+        c->pagesRead.store(current, std::memory_order_relaxed);
 }
 
 /*********************************************************************************************************/ 
-// Returns the database
+// Turns the statistics on or off. They are off by default.
 //
-#ifdef _OPENMP
-    sqlite3** SQLiteDB::getSQLiteDatabase() 
-    {
-        return dbarr;
+void SQLiteDB::setStatisticsEnabled(bool enabled)
+{
+    statisticsEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool SQLiteDB::getStatisticsEnabled() const
+{
+    return statisticsEnabled.load(std::memory_order_relaxed);
+}
+
+/*********************************************************************************************************/ 
+// Returns the statistics of every connection opened so far.
+// Output:
+//   one entry per connection, with one SQLiteQueryStatistics per kind of query (maxCachedStatements + 1)
+//
+std::vector<SQLiteConnectionStatistics> SQLiteDB::getStatistics()
+{
+    std::vector<SQLiteConnectionStatistics> statistics;
+    if (pool == NULL)
+        return statistics;
+
+    std::vector<SQLiteConnection*> connections = pool->getConnections();
+    for (size_t n=0; n<connections.size(); n++) {
+        SQLiteConnection *c = connections[n];
+        SQLiteConnectionStatistics s;
+        s.connection = c->number;
+        s.busyRetries = c->busyRetries.load(std::memory_order_relaxed);
+        s.bytesRead = c->pagesRead.load(std::memory_order_relaxed) * (unsigned long long) c->pageSize;
+        s.queries.resize(maxCachedStatements + 1);
+        for (int k=0; k<=maxCachedStatements; k++) {
+            SQLiteQueryCounters &q = c->counters[k];
+            s.queries[k].count = q.count.load(std::memory_order_relaxed);
+            s.queries[k].rows = q.rows.load(std::memory_order_relaxed);
+            s.queries[k].seconds = q.nanoseconds.load(std::memory_order_relaxed) * 1e-9;
+            for (int i=0; i<SQLiteQueryStatistics::nLatencyBuckets; i++)
+                s.queries[k].histogram[i] = q.histogram[i].load(std::memory_order_relaxed);
+        }
+        statistics.push_back(s);
     }
-#else
-    sqlite3* SQLiteDB::getSQLiteDatabase()
-    {
-        return dbsing;
+    return statistics;
+}
+
+/*********************************************************************************************************/ 
+// Sets all statistics to zero. Queries running concurrently may be lost.
+// The bytes read are counted by SQLite and are not reset.
+//
+void SQLiteDB::resetStatistics()
+{
+    if (pool == NULL)
+        return;
+    std::vector<SQLiteConnection*> connections = pool->getConnections();
+    for (size_t n=0; n<connections.size(); n++) {
+        SQLiteConnection *c = connections[n];
+        int pages = c->pagesRead.load();
+        resetCounters(c);
+        c->pagesRead.store(pages);
     }
-#endif
+}
+
+/*********************************************************************************************************/ 
+// Returns the connection of the calling thread
+//
+sqlite3* SQLiteDB::getSQLiteDatabase()
+{
+    return connection()->db;
+}
 
 
 
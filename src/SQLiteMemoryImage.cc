@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/types.h>
+
+#include "saga/SQLiteMemoryImage.h"
+
+
+namespace saga{
+
+static std::atomic<unsigned long> nextImageId(1);
+
+/*********************************************************************************************************/
+// File handle of the VFS: a view of the image
+//
+struct MemoryFile
+{
+    sqlite3_file base;
+    const char *data;
+    sqlite3_int64 size;
+};
+
+static int memoryClose(sqlite3_file *file)
+{
+    return SQLITE_OK;
+}
+
+static int memoryRead(sqlite3_file *file, void *buffer, int amount, sqlite3_int64 offset)
+{
+    MemoryFile *f = (MemoryFile*) file;
+    if (offset >= f->size) {
+        memset(buffer, 0, amount);
+        return SQLITE_IOERR_SHORT_READ;
+    }
+    if (offset + amount > f->size) {
+        int available = (int) (f->size - offset);
+        memcpy(buffer, f->data + offset, available);
+        memset((char*) buffer + available, 0, amount - available);
+        return SQLITE_IOERR_SHORT_READ;
+    }
+    memcpy(buffer, f->data + offset, amount);
+    return SQLITE_OK;
+}
+
+static int memoryWrite(sqlite3_file *file, const void *buffer, int amount, sqlite3_int64 offset)
+{
+    return SQLITE_READONLY;
+}
+
+static int memoryTruncate(sqlite3_file *file, sqlite3_int64 size)
+{
+    return SQLITE_READONLY;
+}
+
+static int memorySync(sqlite3_file *file, int flags)
+{
+    return SQLITE_OK;
+}
+
+static int memoryFileSize(sqlite3_file *file, sqlite3_int64 *size)
+{
+    *size = ((MemoryFile*) file)->size;
+    return SQLITE_OK;
+}
+
+// the image never changes, so there is nothing to lock
+static int memoryLock(sqlite3_file *file, int lock)
+{
+    return SQLITE_OK;
+}
+
+static int memoryCheckReservedLock(sqlite3_file *file, int *result)
+{
+    *result = 0;
+    return SQLITE_OK;
+}
+
+static int memoryFileControl(sqlite3_file *file, int op, void *arg)
+{
+    return SQLITE_NOTFOUND;
+}
+
+static int memorySectorSize(sqlite3_file *file)
+{
+    return 4096;
+}
+
+static int memoryDeviceCharacteristics(sqlite3_file *file)
+{
+    return SQLITE_IOCAP_IMMUTABLE;
+}
+
+static int memoryFetch(sqlite3_file *file, sqlite3_int64 offset, int amount, void **pointer)
+{
+    MemoryFile *f = (MemoryFile*) file;
+    *pointer = (offset + amount <= f->size) ? (void*) (f->data + offset) : NULL;
+    return SQLITE_OK;
+}
+
+static int memoryUnfetch(sqlite3_file *file, sqlite3_int64 offset, void *pointer)
+{
+    return SQLITE_OK;
+}
+
+// version 3 for xFetch; without xShmMap SQLite never tries to open the image in WAL mode
+static const sqlite3_io_methods memoryMethods = {
+    3,
+    memoryClose,
+    memoryRead,
+    memoryWrite,
+    memoryTruncate,
+    memorySync,
+    memoryFileSize,
+    memoryLock,
+    memoryLock,
+    memoryCheckReservedLock,
+    memoryFileControl,
+    memorySectorSize,
+    memoryDeviceCharacteristics,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    memoryFetch,
+    memoryUnfetch
+};
+
+/*********************************************************************************************************/
+// Methods of the VFS. The main database is the image, opened read-only; a read-only connection writes no
+// journal of it. Temporary files (temporary databases and their journals, sorts spilled to disk) are
+// opened by the default VFS, as everything unrelated to files.
+//
+static sqlite3_vfs* defaultVFS(sqlite3_vfs *vfs)
+{
+    return (sqlite3_vfs*) ((void**) vfs->pAppData)[1];
+}
+
+static int memoryOpen(sqlite3_vfs *vfs, const char *name, sqlite3_file *file, int flags, int *outFlags)
+{
+    file->pMethods = NULL;
+    if ((flags & (SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_TRANSIENT_DB | SQLITE_OPEN_SUBJOURNAL)) != 0)
+        return defaultVFS(vfs)->xOpen(defaultVFS(vfs), name, file, flags, outFlags);
+    if ((flags & SQLITE_OPEN_MAIN_DB) == 0 || (flags & SQLITE_OPEN_READWRITE) != 0)
+        return SQLITE_CANTOPEN;
+    const std::vector<char> *data = (const std::vector<char>*) ((void**) vfs->pAppData)[0];
+    MemoryFile *f = (MemoryFile*) file;
+    f->data = &(*data)[0];
+    f->size = data->size();
+    f->base.pMethods = &memoryMethods;
+    if (outFlags != NULL)
+        *outFlags = SQLITE_OPEN_READONLY;
+    return SQLITE_OK;
+}
+
+static int memoryDelete(sqlite3_vfs *vfs, const char *name, int syncDir)
+{
+    return SQLITE_IOERR_DELETE;
+}
+
+static int memoryAccess(sqlite3_vfs *vfs, const char *name, int flags, int *result)
+{
+    *result = 0;
+    return SQLITE_OK;
+}
+
+static int memoryFullPathname(sqlite3_vfs *vfs, const char *name, int nOut, char *out)
+{
+    sqlite3_snprintf(nOut, out, "%s", name);
+    return SQLITE_OK;
+}
+
+static void* memoryDlOpen(sqlite3_vfs *vfs, const char *filename)
+{
+    return defaultVFS(vfs)->xDlOpen(defaultVFS(vfs), filename);
+}
+
+static void memoryDlError(sqlite3_vfs *vfs, int nByte, char *message)
+{
+    defaultVFS(vfs)->xDlError(defaultVFS(vfs), nByte, message);
+}
+
+static void (*memoryDlSym(sqlite3_vfs *vfs, void *handle, const char *symbol))(void)
+{
+    return defaultVFS(vfs)->xDlSym(defaultVFS(vfs), handle, symbol);
+}
+
+static void memoryDlClose(sqlite3_vfs *vfs, void *handle)
+{
+    defaultVFS(vfs)->xDlClose(defaultVFS(vfs), handle);
+}
+
+static int memoryRandomness(sqlite3_vfs *vfs, int nByte, char *out)
+{
+    return defaultVFS(vfs)->xRandomness(defaultVFS(vfs), nByte, out);
+}
+
+static int memorySleep(sqlite3_vfs *vfs, int microseconds)
+{
+    return defaultVFS(vfs)->xSleep(defaultVFS(vfs), microseconds);
+}
+
+static int memoryCurrentTime(sqlite3_vfs *vfs, double *now)
+{
+    return defaultVFS(vfs)->xCurrentTime(defaultVFS(vfs), now);
+}
+
+static int memoryGetLastError(sqlite3_vfs *vfs, int nByte, char *message)
+{
+    return defaultVFS(vfs)->xGetLastError(defaultVFS(vfs), nByte, message);
+}
+
+/*********************************************************************************************************/
+// Constructor: empty image, no VFS registered
+//
+SQLiteMemoryImage::SQLiteMemoryImage()
+{
+    vfs = NULL;
+}
+
+/*********************************************************************************************************/
+// Destructor: unregisters the VFS. All connections opened on the image must be closed by now.
+//
+SQLiteMemoryImage::~SQLiteMemoryImage()
+{
+    if (vfs != NULL) {
+        sqlite3_vfs_unregister(vfs);
+        delete [] (void**) vfs->pAppData;
+        delete vfs;
+    }
+}
+
+/*********************************************************************************************************/
+// Reads a database file into memory and registers a VFS serving it.
+// A database in WAL mode is served as a rollback-journal database; anything still in its -wal file is not
+// part of the image.
+// Input:
+//   filename: database file
+//
+void SQLiteMemoryImage::load(std::string filename)
+{
+    if (vfs != NULL)
+        throw std::runtime_error("The memory image is already loaded.");
+
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (f == NULL)
+        throw std::runtime_error("Failed to open the file.");
+    bool failed = fseeko(f, 0, SEEK_END) != 0;
+    off_t fileSize = failed ? 0 : ftello(f);
+    if (! failed && fileSize > 0 && fseeko(f, 0, SEEK_SET) == 0) {
+        data.resize(fileSize);
+        failed = fread(&data[0], 1, fileSize, f) != (size_t) fileSize;
+    }
+    fclose(f);
+    if (failed || data.size() < 100 || memcmp(&data[0], "SQLite format 3", 16) != 0) {
+        data.clear();
+        throw std::runtime_error("Failed to read the SQLite database into memory.");
+    }
+
+    // file format read/write versions: 2 means WAL
+    if (data[18] == 2)
+        data[18] = 1;
+    if (data[19] == 2)
+        data[19] = 1;
+
+    sqlite3_initialize();
+    sqlite3_vfs *base = sqlite3_vfs_find(NULL);
+    char name[64];
+    snprintf(name, sizeof(name), "saga-memory-%lu", nextImageId++);
+    vfsName = name;
+
+    void **appData = new void*[2];
+    appData[0] = &data;
+    appData[1] = base;
+    vfs = new sqlite3_vfs();
+    vfs->iVersion = 1;
+    // the handles of temporary files are those of the default VFS
+    vfs->szOsFile = std::max((int) sizeof(MemoryFile), base->szOsFile);
+    vfs->mxPathname = base->mxPathname;
+    vfs->zName = vfsName.c_str();
+    vfs->pAppData = appData;
+    vfs->xOpen = memoryOpen;
+    vfs->xDelete = memoryDelete;
+    vfs->xAccess = memoryAccess;
+    vfs->xFullPathname = memoryFullPathname;
+    vfs->xDlOpen = memoryDlOpen;
+    vfs->xDlError = memoryDlError;
+    vfs->xDlSym = memoryDlSym;
+    vfs->xDlClose = memoryDlClose;
+    vfs->xRandomness = memoryRandomness;
+    vfs->xSleep = memorySleep;
+    vfs->xCurrentTime = memoryCurrentTime;
+    vfs->xGetLastError = memoryGetLastError;
+    sqlite3_vfs_register(vfs, 0);
+}
+
+/*********************************************************************************************************/
+// Returns the name of the VFS to pass to sqlite3_open_v2
+//
+const char* SQLiteMemoryImage::getVFSName() const
+{
+    return vfsName.c_str();
+}
+
+/*********************************************************************************************************/
+// Returns the size of the image in bytes
+//
+size_t SQLiteMemoryImage::size() const
+{
+    return data.size();
+}
+
+} // namespace
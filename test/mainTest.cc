@@ -1,13 +1,30 @@
 #include <iostream>
 #include <ctime>
 #include <cmath>
+#include <climits>
+#include <algorithm>
+#include <thread>
 #include "saga/AMRcell.h"
+#include "saga/BaryonDensity.h"
+#include "saga/CellKernels.h"
+#include "saga/CellSet.h"
 #include "saga/AMRgrid.h"
+#include "saga/AMRgridWriter.h"
+#include "saga/LinearOctree.h"
 #include "saga/LocalProperties.h"
 #include "saga/MagneticField.h"
+#include "saga/PackedRtree.h"
 #include "saga/SQLiteInterface.h"
 #include "saga/Referenced.h"
 
+// i-th point of a deterministic sequence filling the unit cube, shared by the tests
+void samplePoint(long i, double &x, double &y, double &z)
+{
+    x = fmod(0.618034 * i, 1.);
+    y = fmod(0.414214 * i + 0.1, 1.);
+    z = fmod(0.732051 * i + 0.2, 1.);
+}
+
 void testGetCellsRegion(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
 {
     std::cout << "---------------------------------------------------" << std::endl;
@@ -28,6 +45,144 @@ void testGetCellsRegion(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
     std::cout << "TEST SUCCEEDED... end of getCellsRegion() test" << std::endl;
 }
 
+void testGetCellSetRegion(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... getCellSetRegion()" << std::endl;
+    if (sizeof(saga::CompactCell) != 16) {
+        std::cout << "TEST FAILED..... compact cells take " << sizeof(saga::CompactCell) << " bytes" << std::endl;
+        exit(1);
+    }
+    // unaligned, negative, non-cubic, non-dyadic and out-of-box cells are not octree cells
+    double invalid[5][6] = {{0.1, 0.35, 0, 0.25, 0, 0.25}, {-0.25, 0, 0, 0.25, 0, 0.25}, {0, 0.25, 0, 0.5, 0, 0.25}, {0, 0.3, 0, 0.3, 0, 0.3}, {1, 1.25, 0, 0.25, 0, 0.25}};
+    for(int i=0; i<5; i++) {
+        double *b = invalid[i];
+        bool thrown = false;
+        try {
+            saga::CompactCell::encode(1, b[0], b[1], b[2], b[3], b[4], b[5]);
+        } catch (std::runtime_error &e) {
+            thrown = true;
+        }
+        if (! thrown || saga::CompactCell::octreeLevel(b[0], b[1], b[2], b[3], b[4], b[5]) != -1) {
+            std::cout << "TEST FAILED..... invalid cell " << i << " encoded" << std::endl;
+            exit(1);
+        }
+    }
+    if (saga::CompactCell::octreeLevel(0.75, 1, 0.25, 0.5, 0, 0.25) != 2) {
+        std::cout << "TEST FAILED..... wrong level of an octree cell" << std::endl;
+        exit(1);
+    }
+    saga::AMRgridOptions options;
+    options.backend = saga::AMRgridOptions::OctreeBackend;
+    saga::ref_ptr<saga::AMRgrid> octree = new saga::AMRgrid(filename, 10, options);
+    saga::ref_ptr<saga::AMRgrid> grids[2] = {amr, octree};
+    for(int g=0; g<2; g++) {
+        for(int i=0; i<nRegions; i++) {
+            double x = (i + 0.4) / nRegions, y = (i + 0.2) / nRegions, z = (i + 0.7) / nRegions;
+            std::vector<saga::AMRcell> cells = grids[g]->getCellsRegion(x-0.1,x+0.1,y-0.1,y+0.1,z-0.1,z+0.1);
+            saga::CellSet set = grids[g]->getCellSetRegion(x-0.1,x+0.1,y-0.1,y+0.1,z-0.1,z+0.1, true);
+            if (set.size() != cells.size() || ! set.hasProperties()) {
+                std::cout << "TEST FAILED..... getCellSetRegion() and getCellsRegion() differ" << std::endl;
+                exit(1);
+            }
+            std::vector<double> xc(set.size()), yc(set.size()), zc(set.size());
+            set.getCentres(xc.data(), yc.data(), zc.data());
+            for(int n=0; n<set.size(); n++) {
+                saga::AMRcell c = set.getCell(n);
+                saga::LocalProperties lp = set.getLocalProperties(n);
+                if (c.getCellIndex() != cells[n].getCellIndex() || c.getXmin() != cells[n].getXmin() || c.getXmax() != cells[n].getXmax() || c.getYmin() != cells[n].getYmin() || c.getZmax() != cells[n].getZmax() ||
+                    xc[n] != cells[n].getXcenter() || yc[n] != cells[n].getYcenter() || zc[n] != cells[n].getZcenter() ||
+                    lp.getDensity() != amr->getLocalPropertiesFromIndex(c.getCellIndex()).getDensity()) {
+                    std::cout << "TEST FAILED..... cell " << n << " of the set differs" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of getCellSetRegion() test" << std::endl;
+}
+
+void testCellKernels(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... cell kernels" << std::endl;
+    std::string automatic = saga::getKernelInstructionSet();
+    std::cout << "Instruction set: " << automatic << std::endl;
+    const char *names[3] = {"scalar", "avx2", "avx512"};
+    for(int s=0; s<3; s++) {
+        try {
+            saga::setKernelInstructionSet(names[s]);
+        } catch (std::exception &e) {
+            continue;
+        }
+        for(int n=0; n<40; n++) {
+            std::vector<double> b[6], d(n);
+            std::vector<int32_t> idx(n);
+            std::vector<unsigned char> overlap(n), inside(n);
+            for(int i=0; i<n; i++) {
+                for(int q=0; q<3; q++) {
+                    b[2 * q].push_back(fmod(0.37 * (i % 7) + 0.11 * q, 1.));
+                    b[2 * q + 1].push_back(b[2 * q][i] + 0.125);
+                }
+                idx[i] = n - i;
+            }
+            double box[6] = {0.2, 0.5, 0.1, 0.6, 0.3, 0.3};
+            double x = 0.3, y = 0.45, z = 0.6;
+            saga::distancesToPoint(&b[0][0], &b[2][0], &b[4][0], n, x, y, z, &d[0]);
+            saga::boxesOverlapBox(&b[0][0], &b[1][0], &b[2][0], &b[3][0], &b[4][0], &b[5][0], n, box, &overlap[0]);
+            saga::pointsInBox(&b[0][0], &b[2][0], &b[4][0], n, box, &inside[0]);
+            long nearest = saga::selectNearestCentre(&b[0][0], &b[2][0], &b[4][0], &idx[0], n, x, y, z);
+            long expected = (n > 0) ? 0 : -1;
+            for(int i=0; i<n; i++) {
+                saga::AMRcell cell(idx[i], b[0][i] - 1, b[0][i] + 1, b[2][i] - 1, b[2][i] + 1, b[4][i] - 1, b[4][i] + 1);
+                double dc = cell.distanceToPoint(x, y, z);
+                bool o = b[1][i] >= box[0] && b[0][i] <= box[1] && b[3][i] >= box[2] && b[2][i] <= box[3] && b[5][i] >= box[4] && b[4][i] <= box[5];
+                bool in = b[0][i] >= box[0] && b[0][i] <= box[1] && b[2][i] >= box[2] && b[2][i] <= box[3] && b[4][i] >= box[4] && b[4][i] <= box[5];
+                if (d[i] != dc || overlap[i] != o || inside[i] != in) {
+                    std::cout << "TEST FAILED..... " << names[s] << " kernels differ from the scalar rule" << std::endl;
+                    exit(1);
+                }
+                if (i > 0 && (dc < d[expected] || (dc == d[expected] && idx[i] < idx[expected])))
+                    expected = i;
+            }
+            if (nearest != expected) {
+                std::cout << "TEST FAILED..... " << names[s] << " nearest centre differs" << std::endl;
+                exit(1);
+            }
+        }
+        // exact ties: centres whose offsets from the point are swapped between x and y are at the same
+        // distance with the roundings of the scalar rule, and the lowest index must win
+        for(int n=0; n<2000; n++) {
+            double p, a, b, c;
+            samplePoint(n, a, b, c);
+            p = fmod(0.381966 * n + 0.2, 1.);
+            double cx[2] = {p + 0.3 * a, p - 0.2 * b}, cy[2] = {p - 0.2 * b, p + 0.3 * a}, cz[2] = {p + 0.1 * c, p + 0.1 * c};
+            int32_t idx[2] = {(int32_t) (n % 2), (int32_t) (1 - n % 2)};
+            double d[2];
+            saga::distancesToPoint(cx, cy, cz, 2, p, p, p, d);
+            saga::AMRcell cell(1., cx[0], cy[0], cz[0], 0);
+            if (d[0] != d[1] || d[0] != cell.distanceToPoint(p, p, p) || saga::selectNearestCentre(cx, cy, cz, idx, 2, p, p, p) != n % 2) {
+                std::cout << "TEST FAILED..... " << names[s] << " kernels resolve a tie differently from the scalar rule" << std::endl;
+                exit(1);
+            }
+        }
+        for(int i=0; i<nRegions; i++) {
+            double x = (i + 0.45) / nRegions, y = (i + 0.15) / nRegions, z = (i + 0.8) / nRegions;
+            double h = 0.5 * amr->getMinCellSize();
+            saga::CellSet around = amr->getCellSetRegion(x - h, x + h, y - h, y + h, z - h, z + h);
+            saga::CellSet region = amr->getCellSetRegion(x - 0.1, x + 0.1, y - 0.1, y + 0.1, z - 0.1, z + 0.1);
+            std::vector<long> positions;
+            region.findInBox(x - h, x + h, y - h, y + h, z - h, z + h, positions);
+            if (around.getCell(around.findNearest(x, y, z)).getCellIndex() != amr->selectNearestNeighbor(x, y, z).getCellIndex() || positions.size() != around.size()) {
+                std::cout << "TEST FAILED..... " << names[s] << " search in a cell set differs from the grid" << std::endl;
+                exit(1);
+            }
+        }
+    }
+    saga::setKernelInstructionSet(automatic);
+    std::cout << "TEST SUCCEEDED... end of cell kernels test" << std::endl;
+}
+
 void testGetNearestNeighbors(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
 {
     std::cout << "---------------------------------------------------" << std::endl;
@@ -87,6 +242,90 @@ void testGetLocalPropertiesRegion(saga::ref_ptr<saga::AMRgrid> amr, int nRegions
     std::cout << "TEST SUCCEEDED... end of getLocalPropertiesRegion() test" << std::endl;
 }
 
+class CellCounter : public saga::AMRcellVisitor
+{
+public:
+    CellCounter() : nCells(0) {}
+    bool visitCell(saga::AMRcell &cell, saga::LocalProperties &lp)
+    {
+        nCells++;
+        return true;
+    }
+    int nCells;
+};
+
+void testVisitCellsRegion(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... visitCellsRegion()" << std::endl;
+    for(int i=1; i<nRegions; i++) {
+        for(int j=1; j<nRegions; j++) {
+            for(int k=1; k<nRegions; k++) {
+                double x = ((double)i ) / nRegions;
+                double y = ((double)j ) / nRegions;
+                double z = ((double)k ) / nRegions;
+                CellCounter counter;
+                amr->visitCellsRegion(x-0.01,x+0.01,y-0.01,y+0.01,z-0.01,z+0.01,counter);
+                if (counter.nCells != amr->getCellsRegion(x-0.01,x+0.01,y-0.01,y+0.01,z-0.01,z+0.01).size()) {
+                    std::cout << "TEST FAILED..... number of cells differs from getCellsRegion()" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of visitCellsRegion() test" << std::endl;
+}
+
+void testVisitCellsIndexRange(saga::ref_ptr<saga::AMRgrid> amr)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... visitCellsIndexRange()" << std::endl;
+    int nCells = amr->getGridSize();
+    CellCounter all;
+    amr->visitCellsIndexRange(1, nCells, -HUGE_VAL, all);
+    if (all.nCells != nCells) {
+        std::cout << "TEST FAILED..... full scan does not visit every cell" << std::endl;
+        exit(1);
+    }
+    double rho0 = amr->getLocalPropertiesFromIndex(nCells / 2).getDensity();
+    int nDense = 0;
+    for(int i=1; i<=nCells; i++) {
+        if (amr->getLocalPropertiesFromIndex(i).getDensity() > rho0)
+            nDense++;
+    }
+    CellCounter dense;
+    amr->visitCellsIndexRange(1, nCells / 3, rho0, dense);
+    amr->visitCellsIndexRange(nCells / 3 + 1, nCells, rho0, dense);
+    if (dense.nCells != nDense) {
+        std::cout << "TEST FAILED..... filtered scan differs from getLocalPropertiesFromIndex()" << std::endl;
+        exit(1);
+    }
+    std::cout << "TEST SUCCEEDED... end of visitCellsIndexRange() test" << std::endl;
+}
+
+void testHasDensityAbove(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... hasDensityAbove()" << std::endl;
+    double rho0 = amr->getLocalPropertiesFromIndex(1).getDensity();
+    double dx = 1. / nRegions;
+    for(int i=0; i<nRegions; i++) {
+        for(int j=0; j<nRegions; j++) {
+            for(int k=0; k<nRegions; k++) {
+                std::vector<saga::LocalProperties> lp = amr->getLocalPropertiesRegion(i*dx, i*dx+0.05, j*dx, j*dx+0.05, k*dx, k*dx+0.05);
+                double rhoMax = -HUGE_VAL;
+                for(int n=0; n<lp.size(); n++)
+                    rhoMax = std::max(rhoMax, lp[n].getDensity());
+                if (amr->hasDensityAbove(i*dx, i*dx+0.05, j*dx, j*dx+0.05, k*dx, k*dx+0.05, rho0) != (rhoMax > rho0)) {
+                    std::cout << "TEST FAILED..... hasDensityAbove() differs from the maximum density of the region" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of hasDensityAbove() test" << std::endl;
+}
+
 void testGetLocalProperties(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
 {
     std::cout << "---------------------------------------------------" << std::endl;
@@ -117,6 +356,877 @@ void testGetLocalPropertiesFromIndex(saga::ref_ptr<saga::AMRgrid> amr)
     std::cout << "TEST SUCCEEDED... end of getLocalPropertiesFromIndex() test" << std::endl;
 }
 
+void testGetDensityAndMagneticField(saga::ref_ptr<saga::AMRgrid> amr, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... getDensity() and getMagneticField()" << std::endl;
+    for(int i=1; i<nRegions; i++) {
+        for(int j=1; j<nRegions; j++) {
+            for(int k=1; k<nRegions; k++) {
+                double x = ((double)i ) / nRegions;
+                double y = ((double)j ) / nRegions;
+                double z = ((double)k ) / nRegions;
+                saga::LocalProperties lp = amr->getLocalProperties(x,y,z);
+                std::vector<double> b = amr->getMagneticField(x,y,z);
+                if (amr->getDensity(x,y,z) != lp.getDensity() || b[0] != lp.getBx() || b[1] != lp.getBy() || b[2] != lp.getBz()) {
+                    std::cout << "TEST FAILED..... inconsistent with getLocalProperties()" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of getDensity() and getMagneticField() test" << std::endl;
+}
+
+void testOctreeBackend(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... octree backend" << std::endl;
+    saga::AMRgridOptions options;
+    options.backend = saga::AMRgridOptions::OctreeBackend;
+    saga::ref_ptr<saga::AMRgrid> octree = new saga::AMRgrid(filename, 10, options);
+    if (octree->getGridSize() != amr->getGridSize()) {
+        std::cout << "TEST FAILED..... grid sizes differ" << std::endl;
+        exit(1);
+    }
+    int n = 4 * nRegions;
+    for(int i=0; i<n; i++) {
+        for(int j=0; j<n; j++) {
+            for(int k=0; k<n; k++) {
+                double x = ((double)i + 0.3) / n;
+                double y = ((double)j + 0.6) / n;
+                double z = ((double)k + 0.1) / n;
+                saga::LocalProperties lp1 = amr->getLocalProperties(x,y,z);
+                saga::LocalProperties lp2 = octree->getLocalProperties(x,y,z);
+                std::vector<saga::AMRcell> c1 = amr->getCellsRegion(x-0.02,x+0.02,y-0.02,y+0.02,z-0.02,z+0.02);
+                std::vector<saga::AMRcell> c2 = octree->getCellsRegion(x-0.02,x+0.02,y-0.02,y+0.02,z-0.02,z+0.02);
+                if (lp1.getDensity() != lp2.getDensity() || lp1.getBx() != lp2.getBx() || c1.size() != c2.size() || amr->selectNearestNeighbor(x,y,z).getCellIndex() != octree->selectNearestNeighbor(x,y,z).getCellIndex()) {
+                    std::cout << "TEST FAILED..... octree and SQLite backends differ" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+    double rho0 = amr->getLocalPropertiesFromIndex(1).getDensity();
+    CellCounter dense1, dense2;
+    amr->visitCellsIndexRange(LONG_MIN, LONG_MAX, rho0, dense1);
+    octree->visitCellsIndexRange(LONG_MIN, LONG_MAX, rho0, dense2);
+    if (dense1.nCells != dense2.nCells) {
+        std::cout << "TEST FAILED..... octree and SQLite index scans differ" << std::endl;
+        exit(1);
+    }
+    // once closed, a grid answering from the database reports it instead of crashing
+    saga::ref_ptr<saga::AMRgrid> closed = new saga::AMRgrid(filename, 10);
+    closed->close();
+    bool thrown = false;
+    try {
+        closed->getLocalProperties(0.5, 0.5, 0.5);
+    } catch (std::runtime_error &e) {
+        thrown = true;
+    }
+    if (! thrown) {
+        std::cout << "TEST FAILED..... query on a closed grid did not throw" << std::endl;
+        exit(1);
+    }
+    std::cout << "TEST SUCCEEDED... end of octree backend test" << std::endl;
+}
+
+void testSnapshotBackend(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... snapshot backend" << std::endl;
+    std::string snapshot = "testMain.snapshot";
+    {
+        saga::SQLiteDB DB;
+        DB.open(filename);
+        saga::LinearOctree octree;
+        octree.load(&DB);
+        DB.close();
+        octree.writeSnapshot(snapshot);
+    }
+    saga::AMRgridOptions options;
+    options.backend = saga::AMRgridOptions::SnapshotBackend;
+    saga::ref_ptr<saga::AMRgrid> mapped = new saga::AMRgrid(snapshot, 10, options);
+    if (mapped->getGridSize() != amr->getGridSize()) {
+        std::cout << "TEST FAILED..... grid sizes differ" << std::endl;
+        exit(1);
+    }
+    int n = 4 * nRegions;
+    for(int i=0; i<n; i++) {
+        for(int j=0; j<n; j++) {
+            for(int k=0; k<n; k++) {
+                double x = ((double)i + 0.3) / n;
+                double y = ((double)j + 0.6) / n;
+                double z = ((double)k + 0.1) / n;
+                saga::LocalProperties lp1 = amr->getLocalProperties(x,y,z);
+                saga::LocalProperties lp2 = mapped->getLocalProperties(x,y,z);
+                if (lp1.getDensity() != lp2.getDensity() || lp1.getBz() != lp2.getBz()) {
+                    std::cout << "TEST FAILED..... snapshot and SQLite backends differ" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    // truncated or corrupt copies are rejected when opened
+    std::vector<char> bytes;
+    {
+        FILE *f = fopen(snapshot.c_str(), "rb");
+        fseek(f, 0, SEEK_END);
+        bytes.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        fread(&bytes[0], 1, bytes.size(), f);
+        fclose(f);
+    }
+    size_t keys = (sizeof(saga::SnapshotHeader) + 7) & ~((size_t) 7);
+    for(int c=0; c<4; c++) {
+        std::vector<char> corrupt = bytes;
+        saga::SnapshotHeader *header = (saga::SnapshotHeader*) &corrupt[0];
+        if (c == 0) {
+            corrupt.resize(corrupt.size() - 8);
+        } else if (c == 1) {
+            header->nCells = ((uint64_t) 1) << 61;
+        } else if (c == 2) {
+            std::swap(((uint64_t*) &corrupt[keys])[0], ((uint64_t*) &corrupt[keys])[1]);
+        } else {
+            ((int64_t*) &corrupt[corrupt.size() - 8])[0] += 1;
+        }
+        FILE *f = fopen(snapshot.c_str(), "wb");
+        fwrite(&corrupt[0], 1, corrupt.size(), f);
+        fclose(f);
+        bool thrown = false;
+        try {
+            saga::LinearOctree octree;
+            octree.openSnapshot(snapshot);
+        } catch (std::runtime_error &e) {
+            thrown = true;
+        }
+        if (! thrown) {
+            std::cout << "TEST FAILED..... corrupt snapshot " << c << " was accepted" << std::endl;
+            exit(1);
+        }
+    }
+    remove(snapshot.c_str());
+    std::cout << "TEST SUCCEEDED... end of snapshot backend test" << std::endl;
+}
+
+void testSinglePrecision(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... single precision" << std::endl;
+    saga::AMRgridOptions options;
+    options.backend = saga::AMRgridOptions::OctreeBackend;
+    options.singlePrecision = true;
+    saga::ref_ptr<saga::AMRgrid> single = new saga::AMRgrid(filename, 10, options);
+    int n = 4 * nRegions;
+    std::vector<double> x, y, z;
+    for(int i=0; i<n*n*n; i++) {
+        x.push_back((i / (n * n) + 0.3) / n);
+        y.push_back((i / n % n + 0.6) / n);
+        z.push_back((i % n + 0.1) / n);
+    }
+    std::vector<float> rho(x.size()), Bx(x.size()), By(x.size()), Bz(x.size());
+    single->getLocalPropertiesBatch(&x[0], &y[0], &z[0], x.size(), &rho[0], &Bx[0], &By[0], &Bz[0]);
+    double maxError = 0;
+    for(int i=0; i<x.size(); i++) {
+        saga::LocalProperties lp1 = amr->getLocalProperties(x[i], y[i], z[i]);
+        saga::LocalProperties lp2 = single->getLocalProperties(x[i], y[i], z[i]);
+        double v1[4] = {lp1.getDensity(), lp1.getBx(), lp1.getBy(), lp1.getBz()};
+        double v2[4] = {lp2.getDensity(), lp2.getBx(), lp2.getBy(), lp2.getBz()};
+        float v3[4] = {rho[i], Bx[i], By[i], Bz[i]};
+        for(int q=0; q<4; q++) {
+            if (v1[q] != 0)
+                maxError = std::max(maxError, fabs(v2[q] - v1[q]) / fabs(v1[q]));
+            if (v2[q] != (float) v1[q] || v3[q] != v2[q]) {
+                std::cout << "TEST FAILED..... single precision values differ from the rounded doubles" << std::endl;
+                exit(1);
+            }
+        }
+    }
+    std::cout << "Maximum relative error: " << maxError << std::endl;
+
+    std::string snapshot = "testMain.float.snapshot";
+    {
+        saga::SQLiteDB DB;
+        DB.open(filename);
+        saga::LinearOctree octree;
+        octree.load(&DB, sizeof(float));
+        DB.close();
+        octree.writeSnapshot(snapshot);
+    }
+    options.backend = saga::AMRgridOptions::SnapshotBackend;
+    saga::ref_ptr<saga::AMRgrid> mapped = new saga::AMRgrid(snapshot, 10, options);
+    for(int i=0; i<x.size(); i++) {
+        if (mapped->getLocalProperties(x[i], y[i], z[i]).getBy() != By[i]) {
+            std::cout << "TEST FAILED..... single precision snapshot differs" << std::endl;
+            exit(1);
+        }
+    }
+    mapped = NULL;
+    remove(snapshot.c_str());
+    std::cout << "TEST SUCCEEDED... end of single precision test" << std::endl;
+}
+
+void testLevelOfDetail(saga::ref_ptr<saga::AMRgrid> amr, std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... level of detail" << std::endl;
+    saga::AMRgridOptions options;
+    options.levelOfDetail = true;
+    saga::ref_ptr<saga::AMRgrid> lod = new saga::AMRgrid(filename, 10, options);
+    int maxLevel = lod->getMaxLevelOfDetail();
+
+    // every level partitions the unit cube and conserves the mass of the grid
+    saga::CellSet finest = lod->getCellSetRegionAtLevel(0, 1, 0, 1, 0, 1, maxLevel);
+    double mass = 0;
+    for(int n=0; n<finest.size(); n++)
+        mass += finest.getLocalProperties(n).getDensity() * pow(finest.getCellSize(n), 3);
+    if (finest.size() != amr->getGridSize()) {
+        std::cout << "TEST FAILED..... the finest level is not the grid" << std::endl;
+        exit(1);
+    }
+    for(int level=0; level<=maxLevel; level++) {
+        saga::CellSet cells = lod->getCellSetRegionAtLevel(0, 1, 0, 1, 0, 1, level);
+        double volume = 0, m = 0;
+        for(int n=0; n<cells.size(); n++) {
+            double v = pow(cells.getCellSize(n), 3);
+            volume += v;
+            m += cells.getLocalProperties(n).getDensity() * v;
+            if (cells.getCompactCell(n).level > level || (cells.getCompactCell(n).level < level && cells.getCompactCell(n).index < 0)) {
+                std::cout << "TEST FAILED..... node of the wrong level" << std::endl;
+                exit(1);
+            }
+        }
+        if (fabs(volume - 1) > 1e-12 || fabs(m - mass) > 1e-12 * mass) {
+            std::cout << "TEST FAILED..... level " << level << " does not conserve volume or mass" << std::endl;
+            exit(1);
+        }
+    }
+
+    // point queries return the node of the region query containing the point
+    for(int i=0; i<200; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        int level = i % (maxLevel + 2);
+        saga::LocalProperties lp = lod->getLocalPropertiesAtLevel(x, y, z, level);
+        saga::CellSet cells = lod->getCellSetRegionAtLevel(x, x, y, y, z, z, level);
+        bool found = false;
+        for(int n=0; n<cells.size(); n++) {
+            saga::AMRcell c = cells.getCell(n);
+            if (x >= c.getXmin() && x < c.getXmax() && y >= c.getYmin() && y < c.getYmax() && z >= c.getZmin() && z < c.getZmax())
+                found = cells.getLocalProperties(n).getDensity() == lp.getDensity() && (c.getCellIndex() < 0 || lp.getBx() == amr->getLocalPropertiesFromIndex(c.getCellIndex()).getBx());
+        }
+        if (! found) {
+            std::cout << "TEST FAILED..... point query at level " << level << " differs from the region query" << std::endl;
+            exit(1);
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of level of detail test" << std::endl;
+}
+
+class RowCounter : public saga::SQLiteRowVisitor
+{
+public:
+    RowCounter() : nRows(0) {}
+    bool visitRow(const saga::SQLiteRow &row)
+    {
+        nRows++;
+        return true;
+    }
+    int nRows;
+};
+
+void testPreload(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... database preloaded into memory" << std::endl;
+    saga::AMRgridOptions options;
+    options.sqlite.preload = true;
+    saga::ref_ptr<saga::AMRgrid> memory = new saga::AMRgrid(filename, 10, options);
+    double dx = 1. / nRegions;
+    for(int i=0; i<nRegions; i++) {
+        std::vector<saga::AMRcell> cells1 = amr->getCellsRegion(i * dx, (i + 1) * dx, 0, 1, 0, 1);
+        std::vector<saga::AMRcell> cells2 = memory->getCellsRegion(i * dx, (i + 1) * dx, 0, 1, 0, 1);
+        if (cells1.size() != cells2.size()) {
+            std::cout << "TEST FAILED..... preloaded and on-disk regions differ" << std::endl;
+            exit(1);
+        }
+    }
+    for(int i=0; i<1000; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        if (amr->getDensity(x, y, z) != memory->getDensity(x, y, z)) {
+            std::cout << "TEST FAILED..... preloaded and on-disk values differ" << std::endl;
+            exit(1);
+        }
+    }
+    // queries needing temporary files run on a preloaded database as on disk
+    saga::SQLiteDB db;
+    db.open(filename, options.sqlite);
+    RowCounter rows;
+    try {
+        db.query("PRAGMA temp_store=FILE;", rows);
+        db.query("PRAGMA temp.cache_size=1;", rows);
+        db.query("CREATE TEMP TABLE Sorted AS SELECT * FROM Cell ORDER BY random();", rows);
+        db.query("SELECT * FROM Sorted;", rows);
+    } catch (std::exception &e) {
+        std::cout << "TEST FAILED..... query with temporary files fails on a preloaded database: " << e.what() << std::endl;
+        exit(1);
+    }
+    if (rows.nRows != amr->getGridSize()) {
+        std::cout << "TEST FAILED..... temporary table of a preloaded database is incomplete" << std::endl;
+        exit(1);
+    }
+    std::cout << "TEST SUCCEEDED... end of preload test" << std::endl;
+}
+
+// Largest change of the interpolated By between consecutive points of a segment, relative to its range
+// (a range below the rounding errors of a constant field counts as such)
+double interpolatedStepRatio(saga::ref_ptr<saga::FieldInterpolator> interpolator, double x0, double y0, double z0, double x1, double y1, double z1, int nSteps)
+{
+    double previous = 0, maxStep = 0, byMin = 0, byMax = 0;
+    for(int n=0; n<=nSteps; n++) {
+        double t = n / (double) nSteps;
+        double by = interpolator->getLocalProperties(x0 + t * (x1 - x0), y0 + t * (y1 - y0), z0 + t * (z1 - z0)).getBy();
+        if (n > 0)
+            maxStep = std::max(maxStep, fabs(by - previous));
+        byMin = (n == 0) ? by : std::min(byMin, by);
+        byMax = (n == 0) ? by : std::max(byMax, by);
+        previous = by;
+    }
+    double range = std::max(byMax - byMin, 1e-9 * std::max(fabs(byMin), fabs(byMax)));
+    return (range > 0) ? maxStep / range : 0;
+}
+
+void testInterpolation(saga::ref_ptr<saga::AMRgrid> amr, std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... interpolated MagneticField and BaryonDensity" << std::endl;
+    saga::ref_ptr<saga::MagneticField> field = new saga::MagneticField(amr, true);
+    saga::ref_ptr<saga::BaryonDensity> density = new saga::BaryonDensity(amr, true);
+    saga::ref_ptr<saga::FieldInterpolator> interpolator = new saga::FieldInterpolator(amr);
+    saga::ref_ptr<saga::FieldInterpolator> uncached = new saga::FieldInterpolator(amr, 1);
+    for(int i=0; i<500; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        // at a cell centre the interpolation returns the value of the cell
+        saga::AMRcell cell = amr->selectNearestNeighbor(x, y, z);
+        saga::LocalProperties lp = amr->getLocalProperties(cell.getXcenter(), cell.getYcenter(), cell.getZcenter());
+        if (fabs(density->getDensity(cell.getXcenter(), cell.getYcenter(), cell.getZcenter()) - lp.getDensity()) > 1e-12 * fabs(lp.getDensity())) {
+            std::cout << "TEST FAILED..... interpolated density differs from the cell value at its centre" << std::endl;
+            exit(1);
+        }
+        // cached and uncached stencils give the same values
+        double dx = 1e-3 * (cell.getXmax() - cell.getXmin());
+        std::vector<double> b1 = field->getField(cell.getXcenter() + dx, cell.getYcenter(), cell.getZcenter());
+        saga::LocalProperties lp2 = uncached->getLocalProperties(cell.getXcenter() + dx, cell.getYcenter(), cell.getZcenter());
+        if (b1[0] != lp2.getBx() || b1[1] != lp2.getBy() || b1[2] != lp2.getBz()) {
+            std::cout << "TEST FAILED..... cached and uncached stencils differ" << std::endl;
+            exit(1);
+        }
+    }
+
+    // no jump where the segment enters a cell of another level: steps of 1/1000 of the finest cell change
+    // the field by a small fraction of its range over the 4 finest cells around the face, where a jump
+    // would be of the order of the range itself
+    double h = amr->getMinCellSize();
+    int nSteps = 4000;
+    int nFaces = 0;
+    for(int i=0; i<200 && nFaces<20; i++) {
+        double x0, y0, z0;
+        samplePoint(i, x0, y0, z0);
+        double x1 = fmod(0.316228 * i + 0.5, 1.), y1 = fmod(0.223607 * i + 0.7, 1.), z1 = fmod(0.264575 * i + 0.3, 1.);
+        double length = sqrt(pow(x1 - x0, 2) + pow(y1 - y0, 2) + pow(z1 - z0, 2));
+        std::vector<saga::CellCrossing> crossings = amr->traverseSegment(x0, y0, z0, x1, y1, z1);
+        for(int n=1; n<crossings.size() && nFaces<20; n++) {
+            saga::AMRcell &before = crossings[n - 1].cell, &after = crossings[n].cell;
+            if (before.getXmax() - before.getXmin() == after.getXmax() - after.getXmin())
+                continue;
+            double t0 = std::max(0., crossings[n].tEntry - 2 * h / length), t1 = std::min(1., crossings[n].tEntry + 2 * h / length);
+            double ratio = interpolatedStepRatio(interpolator, x0 + t0 * (x1 - x0), y0 + t0 * (y1 - y0), z0 + t0 * (z1 - z0), x0 + t1 * (x1 - x0), y0 + t1 * (y1 - y0), z0 + t1 * (z1 - z0), nSteps);
+            if (ratio > 0.05) {
+                std::cout << "TEST FAILED..... interpolated field jumps by " << ratio << " of its range across a level change" << std::endl;
+                exit(1);
+            }
+            nFaces++;
+        }
+    }
+    if (nFaces == 0) {
+        std::cout << "TEST FAILED..... no level change found to test the interpolation across" << std::endl;
+        exit(1);
+    }
+
+    // periodic grid: stencils wrap around the unit cube, so the field is periodic and has no jump at the faces
+    saga::AMRgridOptions options;
+    options.periodic = true;
+    saga::ref_ptr<saga::AMRgrid> periodic = new saga::AMRgrid(filename, amr->getMaxRefinementLevel(), options);
+    saga::ref_ptr<saga::FieldInterpolator> wrapped = new saga::FieldInterpolator(periodic);
+    for(int i=0; i<40; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        // dyadic points, which are wrapped exactly
+        x = floor(x * 1024) / 1024.;
+        y = floor(y * 1024) / 1024.;
+        if (wrapped->getLocalProperties(x + 1, y - 1, z).getBy() != wrapped->getLocalProperties(x, y, z).getBy()) {
+            std::cout << "TEST FAILED..... interpolated field is not periodic" << std::endl;
+            exit(1);
+        }
+        double ratio = interpolatedStepRatio(wrapped, 1 - 2 * h, y, z, 1 + 2 * h, y, z, nSteps);
+        if (ratio > 0.05) {
+            std::cout << "TEST FAILED..... interpolated field jumps by " << ratio << " of its range across a periodic face" << std::endl;
+            exit(1);
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of interpolation test" << std::endl;
+}
+
+void testStatistics(std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... query statistics" << std::endl;
+    saga::AMRgridOptions options;
+    options.cellCacheSize = 0;
+    options.statistics = true;
+    saga::ref_ptr<saga::AMRgrid> amr = new saga::AMRgrid(filename, 10, options);
+    amr->resetStatistics();
+    for(int i=0; i<100; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        amr->getLocalProperties(x, y, z);
+    }
+    amr->getGridSize();
+    std::vector<saga::SQLiteConnectionStatistics> statistics = amr->getStatistics();
+    unsigned long long nRegion = 0, nCount = 0, nHistogram = 0;
+    for(int n=0; n<statistics.size(); n++) {
+        for(int k=0; k<statistics[n].queries.size(); k++) {
+            if (saga::AMRgrid::getQueryKind(k) == "regionJoin") {
+                nRegion += statistics[n].queries[k].count;
+                for(int i=0; i<saga::SQLiteQueryStatistics::nLatencyBuckets; i++)
+                    nHistogram += statistics[n].queries[k].histogram[i];
+            }
+            if (saga::AMRgrid::getQueryKind(k) == "count")
+                nCount += statistics[n].queries[k].count;
+        }
+    }
+    if (nRegion != 100 || nHistogram != 100 || nCount != 1 || amr->getStatisticsJSON().find("\"regionJoin\"") == std::string::npos) {
+        std::cout << "TEST FAILED..... queries not counted" << std::endl;
+        exit(1);
+    }
+    std::cout << amr->getStatisticsJSON();
+    std::cout << "TEST SUCCEEDED... end of query statistics test" << std::endl;
+}
+
+void testTraverseSegment(saga::ref_ptr<saga::AMRgrid> amr)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... traverseSegment()" << std::endl;
+    for(int i=0; i<200; i++) {
+        double x0, y0, z0;
+        samplePoint(i, x0, y0, z0);
+        double x1 = fmod(0.316228 * i + 0.5, 1.), y1 = (i % 4 == 0) ? y0 : fmod(0.223607 * i + 0.7, 1.), z1 = fmod(0.264575 * i + 0.3, 1.);
+        std::vector<saga::CellCrossing> crossings = amr->traverseSegment(x0, y0, z0, x1, y1, z1);
+        if (crossings.empty() || crossings.front().tEntry != 0 || crossings.back().tExit != 1) {
+            std::cout << "TEST FAILED..... crossings do not cover the segment" << std::endl;
+            exit(1);
+        }
+        for(int n=0; n<crossings.size(); n++) {
+            saga::CellCrossing &c = crossings[n];
+            double t = 0.5 * (c.tEntry + c.tExit);
+            double x = x0 + t * (x1 - x0), y = y0 + t * (y1 - y0), z = z0 + t * (z1 - z0);
+            bool inside = x >= c.cell.getXmin() && x <= c.cell.getXmax() && y >= c.cell.getYmin() && y <= c.cell.getYmax() && z >= c.cell.getZmin() && z <= c.cell.getZmax();
+            bool contiguous = (n == 0) || crossings[n - 1].tExit == c.tEntry;
+            if (! inside || ! contiguous || c.tExit <= c.tEntry || c.properties.getDensity() != amr->getLocalPropertiesFromIndex(c.cell.getCellIndex()).getDensity()) {
+                std::cout << "TEST FAILED..... invalid crossing " << n << " of segment " << i << std::endl;
+                exit(1);
+            }
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of traverseSegment() test" << std::endl;
+}
+
+void testPeriodic(saga::ref_ptr<saga::AMRgrid> amr, std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... periodic mode" << std::endl;
+    saga::AMRgridOptions options;
+    options.periodic = true;
+    saga::ref_ptr<saga::AMRgrid> periodic = new saga::AMRgrid(filename, 10, options);
+    options.backend = saga::AMRgridOptions::OctreeBackend;
+    saga::ref_ptr<saga::AMRgrid> octree = new saga::AMRgrid(filename, 10, options);
+    // dyadic points, which are wrapped exactly
+    for(int i=0; i<200; i++) {
+        double x = ((i * 37) % 1000 + 0.5) / 1024., y = ((i * 91) % 1000 + 0.25) / 1024., z = ((i * 53) % 1000 + 0.75) / 1024.;
+        double rho = amr->getLocalProperties(x, y, z).getDensity();
+        if (periodic->getLocalProperties(x + 1, y - 1, z + 2).getDensity() != rho || octree->getLocalProperties(x - 3, y, z + 1).getDensity() != rho) {
+            std::cout << "TEST FAILED..... wrapped point differs from the point in the grid" << std::endl;
+            exit(1);
+        }
+    }
+    // points near the faces: nearest of the periodic images of the cells around the point
+    std::vector<saga::AMRcell> cells = amr->getCellsRegion(0, 1, 0, 1, 0, 1);
+    double h = 0.5 * amr->getMinCellSize();
+    for(int i=0; i<40; i++) {
+        double x = (i % 2) ? 0.2 * h : 1 - 0.3 * h, y = fmod(0.414214 * i + 0.1, 1.), z = (i % 3) ? 1 - 0.1 * h : fmod(0.732051 * i, 1.);
+        int expected = -1;
+        double best = 0;
+        for(int n=0; n<cells.size(); n++) {
+            saga::AMRcell &c = cells[n];
+            for(int image=0; image<27; image++) {
+                double ox = image % 3 - 1, oy = (image / 3) % 3 - 1, oz = image / 9 - 1;
+                if (c.getXmax() + ox < x - h || c.getXmin() + ox > x + h || c.getYmax() + oy < y - h || c.getYmin() + oy > y + h || c.getZmax() + oz < z - h || c.getZmin() + oz > z + h)
+                    continue;
+                double d = sqrt(pow(c.getXcenter() + ox - x, 2) + pow(c.getYcenter() + oy - y, 2) + pow(c.getZcenter() + oz - z, 2));
+                if (expected < 0 || d < best || (d == best && c.getCellIndex() < expected)) {
+                    expected = c.getCellIndex();
+                    best = d;
+                }
+            }
+        }
+        if (periodic->selectNearestNeighbor(x, y, z).getCellIndex() != expected || octree->selectNearestNeighbor(x, y, z).getCellIndex() != expected) {
+            std::cout << "TEST FAILED..... wrong nearest cell across a face at point " << i << std::endl;
+            exit(1);
+        }
+    }
+    // region straddling a corner: union of the 8 parts, without duplicates
+    size_t count = 0;
+    for(int part=0; part<8; part++) {
+        double x0 = (part & 4) ? 0 : 0.95, y0 = (part & 2) ? 0 : 0.97, z0 = (part & 1) ? 0 : 0.96;
+        double x1 = (part & 4) ? 0.05 : 1, y1 = (part & 2) ? 0.03 : 1, z1 = (part & 1) ? 0.04 : 1;
+        count += amr->getCellsRegion(x0, x1, y0, y1, z0, z1).size();
+    }
+    if (periodic->getCellsRegion(-0.05, 0.05, -0.03, 0.03, -0.04, 0.04).size() != count || octree->getCellSetRegion(0.95, 1.05, 0.97, 1.03, 0.96, 1.04).size() != count) {
+        std::cout << "TEST FAILED..... wrong number of cells in a region straddling a corner" << std::endl;
+        exit(1);
+    }
+    // segment crossing faces
+    std::vector<saga::CellCrossing> crossings = periodic->traverseSegment(0.9, 0.5, 0.05, 1.3, 0.6, -0.2);
+    for(int n=0; n<crossings.size(); n++) {
+        saga::CellCrossing &c = crossings[n];
+        double t = 0.5 * (c.tEntry + c.tExit);
+        double x = 0.9 + 0.4 * t, y = 0.5 + 0.1 * t, z = 0.05 - 0.25 * t;
+        x -= floor(x);
+        z -= floor(z);
+        bool inside = x >= c.cell.getXmin() && x <= c.cell.getXmax() && y >= c.cell.getYmin() && y <= c.cell.getYmax() && z >= c.cell.getZmin() && z <= c.cell.getZmax();
+        bool contiguous = (n == 0) ? c.tEntry == 0 : crossings[n - 1].tExit == c.tEntry;
+        if (! inside || ! contiguous || c.tExit <= c.tEntry) {
+            std::cout << "TEST FAILED..... invalid crossing " << n << " of a periodic segment" << std::endl;
+            exit(1);
+        }
+    }
+    if (crossings.empty() || crossings.back().tExit != 1) {
+        std::cout << "TEST FAILED..... crossings do not cover the periodic segment" << std::endl;
+        exit(1);
+    }
+    std::cout << "TEST SUCCEEDED... end of periodic mode test" << std::endl;
+}
+
+void testPackedRtree(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... PackedRtree" << std::endl;
+    // copy of the grid, with its R-tree packed
+    std::string packed = filename + ".packed";
+    remove(packed.c_str());
+    sqlite3 *db;
+    sqlite3_open(packed.c_str(), &db);
+    sqlite3_exec(db, "CREATE TABLE Cell(rho REAL, Bx REAL, By REAL, Bz REAL); BEGIN;", NULL, NULL, NULL);
+    sqlite3_stmt *insert;
+    sqlite3_prepare_v2(db, "INSERT INTO Cell(rowid, rho, Bx, By, Bz) VALUES (?1, ?2, ?3, ?4, ?5);", -1, &insert, NULL);
+    std::vector<saga::AMRcell> cells = amr->getCellsRegion(0, 1, 0, 1, 0, 1);
+    saga::PackedRtree tree;
+    for(int i=0; i<cells.size(); i++) {
+        saga::AMRcell &c = cells[i];
+        saga::LocalProperties lp = amr->getLocalPropertiesFromIndex(c.getCellIndex());
+        sqlite3_bind_int64(insert, 1, c.getCellIndex());
+        sqlite3_bind_double(insert, 2, lp.getDensity());
+        sqlite3_bind_double(insert, 3, lp.getBx());
+        sqlite3_bind_double(insert, 4, lp.getBy());
+        sqlite3_bind_double(insert, 5, lp.getBz());
+        sqlite3_step(insert);
+        sqlite3_reset(insert);
+        tree.add(c.getCellIndex(), c.getXmin(), c.getXmax(), c.getYmin(), c.getYmax(), c.getZmin(), c.getZmax());
+    }
+    sqlite3_finalize(insert);
+    tree.write(db, "Cell_tree");
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    sqlite3_close(db);
+
+    saga::ref_ptr<saga::AMRgrid> copy = new saga::AMRgrid(packed, 10);
+    for(int i=0; i<20 * nRegions; i++) {
+        double x, y, z, w = 0.02 + 0.1 * fmod(0.3 * i, 1.);
+        samplePoint(i, x, y, z);
+        std::vector<saga::AMRcell> c1 = amr->getCellsRegion(x - w, x + w, y - w, y + w, z - w, z + w);
+        std::vector<saga::AMRcell> c2 = copy->getCellsRegion(x - w, x + w, y - w, y + w, z - w, z + w);
+        std::vector<int> i1, i2;
+        for(int n=0; n<c1.size(); n++)
+            i1.push_back(c1[n].getCellIndex());
+        for(int n=0; n<c2.size(); n++)
+            i2.push_back(c2[n].getCellIndex());
+        std::sort(i1.begin(), i1.end());
+        std::sort(i2.begin(), i2.end());
+        if (i1 != i2 || amr->getLocalProperties(x, y, z).getDensity() != copy->getLocalProperties(x, y, z).getDensity()) {
+            std::cout << "TEST FAILED..... packed and original R-trees differ in region " << i << std::endl;
+            exit(1);
+        }
+    }
+    std::cout << "cells: " << cells.size() << ", nodes: " << tree.getNumberOfNodes() << ", depth: " << tree.getDepth() << std::endl;
+    copy = NULL;
+    remove(packed.c_str());
+    std::cout << "TEST SUCCEEDED... end of PackedRtree test" << std::endl;
+}
+
+void testGridWriter(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... AMRgridWriter" << std::endl;
+    // copy of the grid: half of the cells one by one, the other half as a cell set, in small batches
+    std::string written = filename + ".written";
+    saga::CellSet cells = amr->getCellSetRegion(0, 1, 0, 1, 0, 1, true);
+    saga::AMRgridWriterOptions options;
+    options.batchSize = 1000;
+    options.transactionSize = 5000;
+    saga::ref_ptr<saga::AMRgridWriter> writer = new saga::AMRgridWriter(written, options);
+    saga::CellSet rest;
+    for(size_t i=0; i<cells.size(); i++) {
+        saga::AMRcell c = cells.getCell(i);
+        saga::LocalProperties lp = cells.getLocalProperties(i);
+        if (i % 2 == 0) {
+            if (writer->addCell(c.getXmin(), c.getXmax(), c.getYmin(), c.getYmax(), c.getZmin(), c.getZmax(), lp.getDensity(), lp.getBx(), lp.getBy(), lp.getBz()) != i / 2 + 1) {
+                std::cout << "TEST FAILED..... cells are not numbered in the order they are added" << std::endl;
+                exit(1);
+            }
+        } else {
+            rest.push_back(cells.getCompactCell(i), lp);
+        }
+    }
+    writer->addCells(rest);
+    bool thrown = false;
+    try {
+        writer->addCell(0.1, 0.35, 0, 0.25, 0, 0.25, 1, 0, 0, 0);
+    } catch (std::runtime_error &e) {
+        thrown = true;
+    }
+    if (! thrown) {
+        std::cout << "TEST FAILED..... cell not aligned with the octree written" << std::endl;
+        exit(1);
+    }
+    writer->close();
+    if (writer->getNumberOfCells() != cells.size()) {
+        std::cout << "TEST FAILED..... wrong number of cells written" << std::endl;
+        exit(1);
+    }
+
+    // same cells, with other indices
+    saga::ref_ptr<saga::AMRgrid> copy = new saga::AMRgrid(written, 10);
+    for(int i=0; i<20 * nRegions; i++) {
+        double x, y, z, w = 0.02 + 0.1 * fmod(0.3 * i, 1.);
+        samplePoint(i, x, y, z);
+        std::vector<std::vector<double> > c[2];
+        saga::ref_ptr<saga::AMRgrid> grids[2] = {amr, copy};
+        for(int g=0; g<2; g++) {
+            std::vector<saga::AMRcell> region = grids[g]->getCellsRegion(x - w, x + w, y - w, y + w, z - w, z + w);
+            for(int n=0; n<region.size(); n++) {
+                saga::LocalProperties lp = grids[g]->getLocalPropertiesFromIndex(region[n].getCellIndex());
+                double row[] = {region[n].getXmin(), region[n].getYmin(), region[n].getZmin(), region[n].getXmax(), lp.getDensity(), lp.getBx(), lp.getBy(), lp.getBz()};
+                c[g].push_back(std::vector<double>(row, row + 8));
+            }
+            std::sort(c[g].begin(), c[g].end());
+        }
+        if (c[0] != c[1]) {
+            std::cout << "TEST FAILED..... written and original grids differ in region " << i << std::endl;
+            exit(1);
+        }
+    }
+    copy = NULL;
+    remove(written.c_str());
+    std::cout << "TEST SUCCEEDED... end of AMRgridWriter test" << std::endl;
+}
+
+void testPrefetch(std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... prefetch" << std::endl;
+    saga::AMRgridOptions options;
+    options.cellCacheSize = 0;
+    saga::ref_ptr<saga::AMRgrid> plain = new saga::AMRgrid(filename, 10, options);
+    options.prefetchThreads = 2;
+    saga::ref_ptr<saga::AMRgrid> prefetching = new saga::AMRgrid(filename, 10, options);
+    // trajectory announced at every step; the fetches are awaited now and then for reproducible hits
+    double step = plain->getMinCellSize(), dx = 0.6, dy = 0.3, dz = -0.2;
+    double x = 0.1, y = 0.35, z = 0.8;
+    for(int i=0; i<3000; i++) {
+        prefetching->prefetch(x, y, z, dx, dy, dz, 20 * step);
+        if (i % 50 == 0)
+            prefetching->waitForPrefetch();
+        saga::LocalProperties lp1 = plain->getLocalProperties(x, y, z);
+        saga::LocalProperties lp2 = prefetching->getLocalProperties(x, y, z);
+        if (lp1.getDensity() != lp2.getDensity() || lp1.getBx() != lp2.getBx() || lp1.getBz() != lp2.getBz()) {
+            std::cout << "TEST FAILED..... prefetched and queried values differ at step " << i << std::endl;
+            exit(1);
+        }
+        x += 0.2 * step * dx;
+        y += 0.2 * step * dy;
+        z += 0.2 * step * dz;
+    }
+    if (prefetching->getPrefetchHits() == 0 || prefetching->getPrefetchHits() + prefetching->getPrefetchMisses() != 3000) {
+        std::cout << "TEST FAILED..... wrong prefetch counters" << std::endl;
+        exit(1);
+    }
+    std::cout << "prefetch hits: " << prefetching->getPrefetchHits() << ", misses: " << prefetching->getPrefetchMisses() << std::endl;
+    std::cout << "TEST SUCCEEDED... end of prefetch test" << std::endl;
+}
+
+void testCellCache(std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... cell cache" << std::endl;
+    // grids opened at their true finest level, so that the finest cells are as wide as the neighbourhood
+    saga::AMRgridOptions options;
+    options.cellCacheSize = 0;
+    saga::CellSet all = saga::ref_ptr<saga::AMRgrid>(new saga::AMRgrid(filename, 10, options))->getCellSetRegion(0, 1, 0, 1, 0, 1);
+    int finest = 0;
+    long finestCell = 0;
+    for(size_t i=0; i<all.size(); i++) {
+        if (all.getCompactCell(i).level > finest) {
+            finest = all.getCompactCell(i).level;
+            finestCell = i;
+        }
+    }
+    saga::ref_ptr<saga::AMRgrid> uncached = new saga::AMRgrid(filename, finest, options);
+    options.cellCacheSize = 4;
+    saga::ref_ptr<saga::AMRgrid> cached = new saga::AMRgrid(filename, finest, options);
+    // straight trajectory sampled in small steps
+    for(int i=0; i<2000; i++) {
+        double x = 0.05 + 0.9 * i / 2000.;
+        double y = 0.31 + 0.4 * i / 2000.;
+        double z = 0.77 - 0.5 * i / 2000.;
+        saga::LocalProperties lp1 = uncached->getLocalProperties(x,y,z);
+        saga::LocalProperties lp2 = cached->getLocalProperties(x,y,z);
+        if (lp1.getDensity() != lp2.getDensity() || lp1.getBy() != lp2.getBy()) {
+            std::cout << "TEST FAILED..... cached and uncached values differ" << std::endl;
+            exit(1);
+        }
+    }
+    if (cached->getCellCacheHits() + cached->getCellCacheMisses() != 2000 || cached->getCellCacheHits() == 0) {
+        std::cout << "TEST FAILED..... cache counters do not add up, or no hit" << std::endl;
+        exit(1);
+    }
+    std::cout << "cache hits: " << cached->getCellCacheHits() << ", misses: " << cached->getCellCacheMisses() << std::endl;
+
+    // points inside a finest cell, all but the first served from the cache
+    saga::AMRcell cell = all.getCell(finestCell);
+    double h = cell.getXmax() - cell.getXmin();
+    cached->resetCellCacheCounters();
+    for(int i=0; i<100; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        x = cell.getXmin() + (0.01 + 0.98 * x) * h;
+        y = cell.getYmin() + (0.01 + 0.98 * y) * h;
+        z = cell.getZmin() + (0.01 + 0.98 * z) * h;
+        if (cached->getLocalProperties(x,y,z).getDensity() != uncached->getLocalProperties(x,y,z).getDensity()) {
+            std::cout << "TEST FAILED..... cached and uncached values differ in a finest cell" << std::endl;
+            exit(1);
+        }
+    }
+    if (cached->getCellCacheHits() != 99) {
+        std::cout << "TEST FAILED..... finest cell not served from the cache: " << cached->getCellCacheHits() << " hits" << std::endl;
+        exit(1);
+    }
+    std::cout << "TEST SUCCEEDED... end of cell cache test" << std::endl;
+}
+
+void testGetLocalPropertiesBatch(saga::ref_ptr<saga::AMRgrid> amr, std::string filename, int nRegions)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... getLocalPropertiesBatch()" << std::endl;
+    int n = 10 * nRegions * nRegions * nRegions;
+    std::vector<double> x(n), y(n), z(n), rho(n), Bx(n), By(n), Bz(n);
+    for(int i=0; i<n; i++)
+        samplePoint(i, x[i], y[i], z[i]);
+    amr->getLocalPropertiesBatch(&x[0], &y[0], &z[0], n, &rho[0], &Bx[0], &By[0], &Bz[0]);
+    for(int i=0; i<n; i++) {
+        saga::LocalProperties lp = amr->getLocalProperties(x[i], y[i], z[i]);
+        if (lp.getDensity() != rho[i] || lp.getBx() != Bx[i] || lp.getBy() != By[i] || lp.getBz() != Bz[i]) {
+            std::cout << "TEST FAILED..... batch and scalar values differ" << std::endl;
+            exit(1);
+        }
+    }
+
+    // dense points around a corner of a finest cell, with the grids opened at their true finest level, and
+    // around the corner of the box in periodic mode
+    saga::CellSet all = amr->getCellSetRegion(0, 1, 0, 1, 0, 1);
+    int finest = 0;
+    long finestCell = 0;
+    for(size_t i=0; i<all.size(); i++) {
+        if (all.getCompactCell(i).level > finest) {
+            finest = all.getCompactCell(i).level;
+            finestCell = i;
+        }
+    }
+    saga::AMRcell cell = all.getCell(finestCell);
+    double h = cell.getXmax() - cell.getXmin();
+    for(int p=0; p<2; p++) {
+        saga::AMRgridOptions options;
+        options.cellCacheSize = 0;
+        options.periodic = (p == 1);
+        saga::ref_ptr<saga::AMRgrid> grid = new saga::AMRgrid(filename, finest, options);
+        for(int i=0; i<n; i++) {
+            samplePoint(i, x[i], y[i], z[i]);
+            x[i] = (p == 1 ? 0 : cell.getXmin()) + 3 * h * (x[i] - 0.5);
+            y[i] = (p == 1 ? 0 : cell.getYmin()) + 3 * h * (y[i] - 0.5);
+            z[i] = (p == 1 ? 0 : cell.getZmin()) + 3 * h * (z[i] - 0.5);
+        }
+        grid->getLocalPropertiesBatch(&x[0], &y[0], &z[0], n, &rho[0], &Bx[0], &By[0], &Bz[0]);
+        for(int i=0; i<n; i++) {
+            saga::LocalProperties lp = grid->getLocalProperties(x[i], y[i], z[i]);
+            if (lp.getDensity() != rho[i] || lp.getBx() != Bx[i] || lp.getBy() != By[i] || lp.getBz() != Bz[i]) {
+                std::cout << "TEST FAILED..... batch and scalar values differ around a finest cell" << std::endl;
+                exit(1);
+            }
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of getLocalPropertiesBatch() test" << std::endl;
+}
+
+void testConcurrentGrids(saga::ref_ptr<saga::AMRgrid> amr, std::string filename)
+{
+    std::cout << "---------------------------------------------------" << std::endl;
+    std::cout << "TESTING.......... concurrent queries from std::thread" << std::endl;
+    const int nThreads = 4;
+    const int nPoints = 500;
+    saga::AMRgridOptions options;
+    options.cellCacheSize = 0;
+    // locking read path, concurrently with the default immutable one
+    options.sqlite.immutable = false;
+    options.sqlite.mmapSize = 0;
+    options.sqlite.cacheSize = -1024;
+    saga::ref_ptr<saga::AMRgrid> other = new saga::AMRgrid(filename, 10, options);
+    std::vector<double> rho(nThreads * nPoints * 2);
+    std::vector<std::thread> threads;
+    for(int t=0; t<nThreads; t++) {
+        threads.push_back(std::thread([&, t]() {
+            for(int i=0; i<nPoints; i++) {
+                double x, y, z;
+                samplePoint(t * nPoints + i, x, y, z);
+                rho[2 * (t * nPoints + i)] = amr->getDensity(x, y, z);
+                rho[2 * (t * nPoints + i) + 1] = other->getDensity(x, y, z);
+            }
+        }));
+    }
+    for(int t=0; t<nThreads; t++)
+        threads[t].join();
+    for(int i=0; i<nThreads * nPoints; i++) {
+        double x, y, z;
+        samplePoint(i, x, y, z);
+        double expected = amr->getDensity(x, y, z);
+        if (rho[2 * i] != expected || rho[2 * i + 1] != expected) {
+            std::cout << "TEST FAILED..... concurrent and serial values differ" << std::endl;
+            exit(1);
+        }
+    }
+    std::cout << "TEST SUCCEEDED... end of concurrent queries test" << std::endl;
+}
+
 int main(int argc, char** argv )
 {
 
@@ -134,11 +1244,32 @@ int main(int argc, char** argv )
     saga::ref_ptr<saga::AMRgrid> amr = new saga::AMRgrid(filename, 10);
 
     testGetCellsRegion(amr, nRegions);
+    testGetCellSetRegion(amr, filename, nRegions);
+    testCellKernels(amr, nRegions);
     testGetNearestNeighbors(amr, nRegions);
     testSelectNearestNeighbor(amr, nRegions);
     testGetLocalPropertiesRegion(amr, nRegions);
+    testVisitCellsRegion(amr, nRegions);
+    testVisitCellsIndexRange(amr);
+    testHasDensityAbove(amr, nRegions);
     testGetLocalProperties(amr, nRegions);
     testGetLocalPropertiesFromIndex(amr);
+    testGetDensityAndMagneticField(amr, nRegions);
+    testGetLocalPropertiesBatch(amr, filename, nRegions);
+    testOctreeBackend(amr, filename, nRegions);
+    testSnapshotBackend(amr, filename, nRegions);
+    testPreload(amr, filename, nRegions);
+    testSinglePrecision(amr, filename, nRegions);
+    testLevelOfDetail(amr, filename);
+    testCellCache(filename);
+    testPrefetch(filename);
+    testTraverseSegment(amr);
+    testPeriodic(amr, filename);
+    testPackedRtree(amr, filename, nRegions);
+    testGridWriter(amr, filename, nRegions);
+    testStatistics(filename);
+    testInterpolation(amr, filename);
+    testConcurrentGrids(amr, filename);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,377 @@
+/*
+Benchmarks the queries of AMRgrid on a SAGA database (see GenerateSyntheticGrid
+ for reproducible inputs), for each backend, single- and multi-threaded.
+Reports the throughput, the median and 99th percentile latencies, and the peak
+ resident memory of the benchmark. The cell kernels are timed first for each
+ instruction set the CPU supports, in cells per second, and the copy of the grid
+ into a new database by AMRgridWriter last. Each backend and the writer run in a
+ child process, whose memory is reported above what it started with, so that the
+ figures of one do not include the memory of another.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+    #include "omp.h"
+#endif
+
+#include "saga/AMRgrid.h"
+#include "saga/AMRgridWriter.h"
+#include "saga/CellKernels.h"
+#include "saga/LocalProperties.h"
+#include "saga/Referenced.h"
+
+void Usage(std::string name)
+{
+    std::cout << "USAGE" << std::endl;
+    std::cout << "./" << name << " <path_to_SQL_file> [number_of_queries] [backends]" <<  std::endl;
+    std::cout << "  arg 1: path to SQL file containing the magnetic field and density" << std::endl;
+    std::cout << "  arg 2: number of point queries per benchmark [optional; default=100000]" << std::endl;
+    std::cout << "  arg 3: comma-separated list of backends among sqlite, sqlite-prefetch, preload, octree, octree-float [optional; default=all]" << std::endl;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// peak resident set size of the process when the benchmark started, in MB
+static double baselineMemory = 0;
+
+// peak resident set size of the process since the benchmark started, in MB
+static double peakMemory()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024. - baselineMemory;
+}
+
+// runs a benchmark in a child process, so that the memory it reports is its own; false if it failed
+template<typename Benchmark>
+static bool runInChild(Benchmark benchmark)
+{
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        baselineMemory = peakMemory();
+        int status = 0;
+        try {
+            benchmark();
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            status = 1;
+        }
+        std::cout.flush();
+        _exit(status);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void report(std::string backend, std::string benchmark, int nThreads, long nQueries, double time, std::vector<double> latencies)
+{
+    std::cout << std::left << std::setw(16) << backend << std::setw(30) << benchmark << std::right << std::setw(8) << nThreads << std::setw(10) << nQueries;
+    std::cout << std::setw(14) << std::fixed << std::setprecision(0) << nQueries / time;
+    if (! latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::setw(10) << std::setprecision(2) << latencies[latencies.size() / 2] * 1e6;
+        std::cout << std::setw(10) << latencies[(size_t) (0.99 * (latencies.size() - 1))] * 1e6;
+    } else {
+        std::cout << std::setw(10) << "-" << std::setw(10) << "-";
+    }
+    std::cout << std::setw(12) << std::setprecision(1) << peakMemory() << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+class Points
+{
+public:
+    // uniformly distributed points, or a random walk with steps of the size of the finest cells
+    Points(long n, bool trajectory, double step, int seed) : x(n), y(n), z(n)
+    {
+        std::mt19937 random(seed);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        double px = uniform(random), py = uniform(random), pz = uniform(random);
+        for (long i=0; i<n; i++) {
+            if (trajectory) {
+                px = fmod(px + step * uniform(random) + 1, 1.);
+                py = fmod(py + step * (uniform(random) - 0.5) + 1, 1.);
+                pz = fmod(pz + step * (uniform(random) - 0.5) + 1, 1.);
+            } else {
+                px = uniform(random);
+                py = uniform(random);
+                pz = uniform(random);
+            }
+            x[i] = px;
+            y[i] = py;
+            z[i] = pz;
+        }
+    }
+    std::vector<double> x, y, z;
+};
+
+// random walk whose direction, taken over the next 16 steps as a particle velocity would give it, is
+// announced at every step (see AMRgrid::prefetch); it starts away from the cells cached by the previous walk
+static void benchmarkPrefetch(std::string backend, saga::ref_ptr<saga::AMRgrid> amr, const Points &p, double distance)
+{
+    long n = p.x.size();
+    std::vector<double> latencies(n);
+    double sum = 0;
+    Clock::time_point start = Clock::now();
+    for (long i=0; i<n; i++) {
+        Clock::time_point t = Clock::now();
+        long j = std::min(i + 16, n - 1);
+        amr->prefetch(p.x[i], p.y[i], p.z[i], p.x[j] - p.x[i], p.y[j] - p.y[i], p.z[j] - p.z[i], distance);
+        sum += amr->getLocalProperties(p.x[i], p.y[i], p.z[i]).getDensity();
+        latencies[i] = seconds(t);
+    }
+    report(backend, "getLocalProperties(walk+hints)", 1, n, seconds(start), latencies);
+}
+
+// single thread, every call timed
+static void benchmarkPoints(std::string backend, std::string benchmark, saga::ref_ptr<saga::AMRgrid> amr, const Points &p)
+{
+    long n = p.x.size();
+    std::vector<double> latencies(n);
+    double sum = 0;
+    Clock::time_point start = Clock::now();
+    for (long i=0; i<n; i++) {
+        Clock::time_point t = Clock::now();
+        sum += amr->getLocalProperties(p.x[i], p.y[i], p.z[i]).getDensity();
+        latencies[i] = seconds(t);
+    }
+    report(backend, benchmark, 1, n, seconds(start), latencies);
+}
+
+static void benchmarkRegions(std::string backend, saga::ref_ptr<saga::AMRgrid> amr, const Points &p, double size)
+{
+    long n = p.x.size();
+    std::vector<double> latencies(n);
+    long nCells = 0;
+    Clock::time_point start = Clock::now();
+    for (long i=0; i<n; i++) {
+        Clock::time_point t = Clock::now();
+        nCells += amr->getCellsRegion(p.x[i], p.x[i] + size, p.y[i], p.y[i] + size, p.z[i], p.z[i] + size).size();
+        latencies[i] = seconds(t);
+    }
+    report(backend, "getCellsRegion", 1, n, seconds(start), latencies);
+
+    start = Clock::now();
+    for (long i=0; i<n; i++) {
+        Clock::time_point t = Clock::now();
+        nCells += amr->getCellSetRegion(p.x[i], p.x[i] + size, p.y[i], p.y[i] + size, p.z[i], p.z[i] + size).size();
+        latencies[i] = seconds(t);
+    }
+    report(backend, "getCellSetRegion", 1, n, seconds(start), latencies);
+
+    start = Clock::now();
+    for (long i=0; i<n; i++) {
+        Clock::time_point t = Clock::now();
+        nCells += amr->getLocalPropertiesRegion(p.x[i], p.x[i] + size, p.y[i], p.y[i] + size, p.z[i], p.z[i] + size).size();
+        latencies[i] = seconds(t);
+    }
+    report(backend, "getLocalPropertiesRegion", 1, n, seconds(start), latencies);
+}
+
+// point queries on the level-of-detail pyramid, at a few maximum levels; the pyramid is built for a grid of
+// its own, so that the other benchmarks of the backend do not include it
+static void benchmarkLevels(std::string backend, saga::AMRgridOptions options, std::string filename, const Points &p)
+{
+    options.levelOfDetail = true;
+    Clock::time_point open = Clock::now();
+    saga::ref_ptr<saga::AMRgrid> amr = new saga::AMRgrid(filename, 10, options);
+    std::cout << "Levels of detail: " << amr->getMaxLevelOfDetail() << ", opened in " << seconds(open) << " s" << std::endl;
+    long n = p.x.size();
+    int maxLevel = amr->getMaxLevelOfDetail();
+    int levels[3] = {2, maxLevel / 2, maxLevel};
+    for (int l=0; l<3; l++) {
+        std::vector<double> latencies(n);
+        double sum = 0;
+        Clock::time_point start = Clock::now();
+        for (long i=0; i<n; i++) {
+            Clock::time_point t = Clock::now();
+            sum += amr->getLocalPropertiesAtLevel(p.x[i], p.y[i], p.z[i], levels[l]).getDensity();
+            latencies[i] = seconds(t);
+        }
+        std::stringstream name;
+        name << "getLocalPropertiesAtLevel(" << levels[l] << ")";
+        report(backend, name.str(), 1, n, seconds(start), latencies);
+    }
+}
+
+// nThreads threads, each following its own share of the points
+static void benchmarkThreads(std::string backend, saga::ref_ptr<saga::AMRgrid> amr, const Points &p, int nThreads)
+{
+    long n = p.x.size();
+    double sum = 0;
+    Clock::time_point start = Clock::now();
+    #pragma omp parallel for num_threads(nThreads) schedule(static) reduction(+:sum)
+    for (long i=0; i<n; i++)
+        sum += amr->getLocalProperties(p.x[i], p.y[i], p.z[i]).getDensity();
+    report(backend, "getLocalProperties", nThreads, n, seconds(start), std::vector<double>());
+}
+
+// all threads, points sorted along a space-filling curve by the grid
+static void benchmarkBatch(std::string backend, saga::ref_ptr<saga::AMRgrid> amr, const Points &p, int nThreads)
+{
+    long n = p.x.size();
+    std::vector<double> rho(n);
+    Clock::time_point start = Clock::now();
+    amr->getDensityBatch(&p.x[0], &p.y[0], &p.z[0], n, &rho[0]);
+    report(backend, "getDensityBatch", nThreads, n, seconds(start), std::vector<double>());
+}
+
+// distance and box kernels over a column of cells, for each available instruction set
+static void benchmarkKernels(long nQueries)
+{
+    const long n = 4096;
+    long repeats = std::max(1L, nQueries / 100);
+    std::mt19937 random(4);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<double> c[6], d(n);
+    std::vector<unsigned char> overlap(n);
+    for (int q=0; q<3; q++) {
+        for (long i=0; i<n; i++) {
+            c[2 * q].push_back(uniform(random));
+            c[2 * q + 1].push_back(c[2 * q][i] + 1e-3);
+        }
+    }
+    double box[6] = {0.2, 0.4, 0.3, 0.5, 0.1, 0.3};
+
+    std::string automatic = saga::getKernelInstructionSet();
+    const char *names[3] = {"scalar", "avx2", "avx512"};
+    for (int s=0; s<3; s++) {
+        try {
+            saga::setKernelInstructionSet(names[s]);
+        } catch (std::exception &e) {
+            continue;
+        }
+        Clock::time_point start = Clock::now();
+        for (long r=0; r<repeats; r++)
+            saga::distancesToPoint(&c[0][0], &c[2][0], &c[4][0], n, 0.5, 0.5, 0.5 + r * 1e-9, &d[0]);
+        report(names[s], "distancesToPoint", 1, n * repeats, seconds(start), std::vector<double>());
+        start = Clock::now();
+        for (long r=0; r<repeats; r++)
+            saga::boxesOverlapBox(&c[0][0], &c[1][0], &c[2][0], &c[3][0], &c[4][0], &c[5][0], n, box, &overlap[0]);
+        report(names[s], "boxesOverlapBox", 1, n * repeats, seconds(start), std::vector<double>());
+    }
+    saga::setKernelInstructionSet(automatic);
+}
+
+// all the cells of the grid written into a temporary database, R-tree included
+static void benchmarkWriter(std::string filename)
+{
+    saga::AMRgridOptions options;
+    options.backend = saga::AMRgridOptions::OctreeBackend;
+    saga::ref_ptr<saga::AMRgrid> amr = new saga::AMRgrid(filename, 10, options);
+    saga::CellSet cells = amr->getCellSetRegion(0, 1, 0, 1, 0, 1, true);
+    amr = NULL;
+
+    std::string output = filename + ".bench";
+    Clock::time_point start = Clock::now();
+    saga::ref_ptr<saga::AMRgridWriter> writer = new saga::AMRgridWriter(output);
+    writer->addCells(cells);
+    writer->close();
+    report("writer", "AMRgridWriter", 1, cells.size(), seconds(start), std::vector<double>());
+    remove(output.c_str());
+}
+
+// all the benchmarks of a backend
+static void benchmarkBackend(std::string backend, saga::AMRgridOptions options, std::string filename, long nQueries, int maxThreads)
+{
+    Clock::time_point start = Clock::now();
+    saga::ref_ptr<saga::AMRgrid> amr = new saga::AMRgrid(filename, 10, options);
+    std::cout << std::endl << "Backend " << backend << ": opened in " << seconds(start) << " s, " << amr->getGridSize() << " cells" << std::endl;
+    std::cout << std::left << std::setw(16) << "backend" << std::setw(30) << "benchmark" << std::right << std::setw(8) << "threads" << std::setw(10) << "queries";
+    std::cout << std::setw(14) << "queries/s" << std::setw(10) << "p50[us]" << std::setw(10) << "p99[us]" << std::setw(12) << "RSS[MB]" << std::endl;
+
+    double step = amr->getMinCellSize();
+    Points random(nQueries, false, step, 1);
+    Points trajectory(nQueries, true, step, 2);
+    Points hinted(nQueries, true, step, 3);
+    benchmarkPoints(backend, "getLocalProperties", amr, random);
+    benchmarkPoints(backend, "getLocalProperties(walk)", amr, trajectory);
+    benchmarkPrefetch(backend, amr, hinted, 32 * step);
+    Points regions(std::max(1L, nQueries / 100), false, step, 3);
+    benchmarkRegions(backend, amr, regions, 4 * step);
+    for (int t=1; t<maxThreads; t*=2)
+        benchmarkThreads(backend, amr, random, t);
+    benchmarkThreads(backend, amr, random, maxThreads);
+    benchmarkBatch(backend, amr, random, maxThreads);
+    benchmarkLevels(backend, options, filename, random);
+}
+
+int main(int argc, char** argv )
+{
+
+    if(argc < 2 || argc > 4)
+    {
+        Usage(argv[0]);
+        return -1;
+    }
+    std::string filename = argv[1];
+    long nQueries = (argc > 2) ? atol(argv[2]) : 100000;
+    std::string backends = (argc > 3) ? argv[3] : "sqlite,sqlite-prefetch,preload,octree,octree-float";
+    int maxThreads = 1;
+    #ifdef _OPENMP
+        maxThreads = omp_get_max_threads();
+    #endif
+
+    std::cout << "Input file: " << filename << std::endl;
+    std::cout << "Queries per benchmark: " << nQueries << std::endl;
+    std::cout << "Threads: up to " << maxThreads << std::endl;
+    std::cout << "Cell kernels: " << saga::getKernelInstructionSet() << std::endl;
+
+    std::vector<std::string> names;
+    std::stringstream list(backends);
+    std::string name;
+    while (std::getline(list, name, ','))
+        names.push_back(name);
+
+    std::cout << std::endl << std::left << std::setw(16) << "kernels" << std::setw(30) << "benchmark" << std::right << std::setw(8) << "threads" << std::setw(10) << "cells";
+    std::cout << std::setw(14) << "cells/s" << std::setw(10) << "p50[us]" << std::setw(10) << "p99[us]" << std::setw(12) << "RSS[MB]" << std::endl;
+    benchmarkKernels(nQueries);
+
+    for (size_t b=0; b<names.size(); b++) {
+        saga::AMRgridOptions options;
+        if (names[b] == "preload")
+            options.sqlite.preload = true;
+        else if (names[b] == "sqlite-prefetch")
+            options.prefetchThreads = 2;
+        else if (names[b] == "octree")
+            options.backend = saga::AMRgridOptions::OctreeBackend;
+        else if (names[b] == "octree-float") {
+            options.backend = saga::AMRgridOptions::OctreeBackend;
+            options.singlePrecision = true;
+        }
+        else if (names[b] != "sqlite") {
+            Usage(argv[0]);
+            return -1;
+        }
+        if (! runInChild([&]{ benchmarkBackend(names[b], options, filename, nQueries, maxThreads); }))
+            std::cout << "Backend " << names[b] << " failed" << std::endl;
+    }
+
+    std::cout << std::endl << std::left << std::setw(16) << "writer" << std::setw(30) << "benchmark" << std::right << std::setw(8) << "threads" << std::setw(10) << "cells";
+    std::cout << std::setw(14) << "cells/s" << std::setw(10) << "p50[us]" << std::setw(10) << "p99[us]" << std::setw(12) << "RSS[MB]" << std::endl;
+    if (! runInChild([&]{ benchmarkWriter(filename); }))
+        std::cout << "Writer failed" << std::endl;
+
+    return 0;
+}
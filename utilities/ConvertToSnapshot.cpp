@@ -0,0 +1,57 @@
+/*
+Converts a SAGA database into a binary snapshot, which can be mapped 
+ read-only by AMRgrid (SnapshotBackend) without loading or parsing anything.
+The density and magnetic field can be written in single precision, halving
+ the size of the snapshot at a relative error of at most 2^-24.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+#include "saga/LinearOctree.h"
+#include "saga/SQLiteInterface.h"
+
+void Usage(std::string name)
+{
+    std::cout << "USAGE" << std::endl;
+    std::cout << "./" << name << " <path_to_SQL_file> <output_snapshot_file> [precision]" <<  std::endl;    
+    std::cout << "  arg 1: path to SQL file containing the magnetic field and density" << std::endl;
+    std::cout << "  arg 2: name of output snapshot file" << std::endl;
+    std::cout << "  arg 3: precision of the values, double or float [optional; default=double]" << std::endl;
+}
+
+int main(int argc, char** argv )
+{
+
+    if(argc < 3 || argc > 4)
+    {
+        Usage(argv[0]);
+        return -1;
+    }
+    std::string filename = argv[1];
+    std::string outputfile = argv[2];
+    std::string precision = (argc > 3) ? argv[3] : "double";
+    if (precision != "double" && precision != "float")
+    {
+        Usage(argv[0]);
+        return -1;
+    }
+
+    std::cout << "Input file: " << filename << std::endl;
+    saga::SQLiteDB DB;
+    DB.open(filename);
+
+    saga::LinearOctree octree;
+    octree.load(&DB, (precision == "float") ? sizeof(float) : sizeof(double));
+    DB.close();
+    std::cout << "Number of cells: " << octree.size() << std::endl;
+    std::cout << "Finest refinement level: " << octree.getMaxLevel() << std::endl;
+    std::cout << "Precision: " << precision << std::endl;
+
+    std::cout << "Output file: " << outputfile << std::endl;
+    octree.writeSnapshot(outputfile);
+    std::cout << "File written" << std::endl;
+
+    return 0;
+}
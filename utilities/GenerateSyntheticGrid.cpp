@@ -0,0 +1,159 @@
+/*
+Writes a synthetic SAGA database, for tests and benchmarks at reproducible sizes.
+The grid starts uniform at a base level and is refined around randomly placed
+ clusters (Gaussian overdensities), down to a maximum depth, in the same way
+ a quasi-Lagrangian AMR code refines dense regions.
+*/
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <random>
+
+#include "sqlite3/sqlite3.h"
+
+void Usage(std::string name)
+{
+    std::cout << "USAGE" << std::endl;
+    std::cout << "./" << name << " <output_SQL_file> <base_level> <refinement_depth> [number_of_clusters] [seed]" <<  std::endl;
+    std::cout << "  arg 1: name of the output SQL file (overwritten)" << std::endl;
+    std::cout << "  arg 2: base level: the coarsest cells have size 2^-base_level" << std::endl;
+    std::cout << "  arg 3: maximum number of refinement levels above the base level" << std::endl;
+    std::cout << "  arg 4: number of clusters around which the grid is refined [optional; default=8]" << std::endl;
+    std::cout << "  arg 5: seed of the random generator [optional; default=1]" << std::endl;
+}
+
+struct Cluster
+{
+    double x, y, z;
+    double width;
+    double amplitude;
+};
+
+class SyntheticGrid
+{
+public:
+    SyntheticGrid(int baseLevel, int maxLevel, int nClusters, int seed) : baseLevel(baseLevel), maxLevel(maxLevel), nCells(0)
+    {
+        std::mt19937 random(seed);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        for (int i=0; i<nClusters; i++) {
+            Cluster c;
+            c.x = uniform(random);
+            c.y = uniform(random);
+            c.z = uniform(random);
+            c.width = 0.01 + 0.05 * uniform(random);
+            c.amplitude = pow(10, 2 + 2 * uniform(random));
+            clusters.push_back(c);
+        }
+        for (int i=0; i<3; i++)
+            phase[i] = 2 * M_PI * uniform(random);
+    }
+
+    double density(double x, double y, double z) const
+    {
+        double rho = 1;
+        for (size_t i=0; i<clusters.size(); i++) {
+            const Cluster &c = clusters[i];
+            double r2 = (x - c.x) * (x - c.x) + (y - c.y) * (y - c.y) + (z - c.z) * (z - c.z);
+            rho += c.amplitude * exp(-0.5 * r2 / (c.width * c.width));
+        }
+        return rho;
+    }
+
+    // refines a cell if its density exceeds twice the threshold of the level above, down to maxLevel
+    void write(int level, long i, long j, long k, sqlite3_stmt *cell, sqlite3_stmt *tree)
+    {
+        double h = ldexp(1., -level);
+        double x = (i + 0.5) * h;
+        double y = (j + 0.5) * h;
+        double z = (k + 0.5) * h;
+        double rho = density(x, y, z);
+        if (level < baseLevel || (level < maxLevel && rho > 2 * pow(4., level - baseLevel))) {
+            for (int c=0; c<8; c++)
+                write(level + 1, 2 * i + ((c >> 2) & 1), 2 * j + ((c >> 1) & 1), 2 * k + (c & 1), cell, tree);
+            return;
+        }
+
+        nCells++;
+        double b = sqrt(rho);
+        sqlite3_bind_int64(cell, 1, nCells);
+        sqlite3_bind_double(cell, 2, rho);
+        sqlite3_bind_double(cell, 3, b * sin(2 * M_PI * y + phase[0]));
+        sqlite3_bind_double(cell, 4, b * sin(2 * M_PI * z + phase[1]));
+        sqlite3_bind_double(cell, 5, b * sin(2 * M_PI * x + phase[2]));
+        sqlite3_bind_int64(tree, 1, nCells);
+        sqlite3_bind_double(tree, 2, i * h);
+        sqlite3_bind_double(tree, 3, (i + 1) * h);
+        sqlite3_bind_double(tree, 4, j * h);
+        sqlite3_bind_double(tree, 5, (j + 1) * h);
+        sqlite3_bind_double(tree, 6, k * h);
+        sqlite3_bind_double(tree, 7, (k + 1) * h);
+        if (sqlite3_step(cell) != SQLITE_DONE || sqlite3_step(tree) != SQLITE_DONE) {
+            std::cout << "Failed to insert cell " << nCells << std::endl;
+            exit(1);
+        }
+        sqlite3_reset(cell);
+        sqlite3_reset(tree);
+    }
+
+    int baseLevel;
+    int maxLevel;
+    long nCells;
+
+private:
+    std::vector<Cluster> clusters;
+    double phase[3];
+};
+
+int main(int argc, char** argv )
+{
+
+    if(argc < 4 || argc > 6)
+    {
+        Usage(argv[0]);
+        return -1;
+    }
+    std::string outputfile = argv[1];
+    int baseLevel = atoi(argv[2]);
+    int depth = atoi(argv[3]);
+    int nClusters = (argc > 4) ? atoi(argv[4]) : 8;
+    int seed = (argc > 5) ? atoi(argv[5]) : 1;
+    if (baseLevel < 0 || depth < 0 || baseLevel + depth > 21 || nClusters < 0) {
+        Usage(argv[0]);
+        return -1;
+    }
+
+    remove(outputfile.c_str());
+    sqlite3 *db;
+    if (sqlite3_open(outputfile.c_str(), &db) != SQLITE_OK) {
+        std::cout << "Cannot create " << outputfile << std::endl;
+        return 1;
+    }
+    sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;", NULL, NULL, NULL);
+    if (sqlite3_exec(db, "CREATE TABLE Cell(rho REAL, Bx REAL, By REAL, Bz REAL);", NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_exec(db, "CREATE VIRTUAL TABLE Cell_tree USING rtree(id, minX, maxX, minY, maxY, minZ, maxZ);", NULL, NULL, NULL) != SQLITE_OK) {
+        std::cout << "Cannot create the tables: " << sqlite3_errmsg(db) << std::endl;
+        return 1;
+    }
+
+    sqlite3_stmt *cell;
+    sqlite3_stmt *tree;
+    sqlite3_prepare_v2(db, "INSERT INTO Cell(rowid, rho, Bx, By, Bz) VALUES (?1, ?2, ?3, ?4, ?5);", -1, &cell, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO Cell_tree VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7);", -1, &tree, NULL);
+
+    std::cout << "Output file: " << outputfile << std::endl;
+    SyntheticGrid grid(baseLevel, baseLevel + depth, nClusters, seed);
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    grid.write(0, 0, 0, 0, cell, tree);
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+
+    sqlite3_finalize(cell);
+    sqlite3_finalize(tree);
+    sqlite3_close(db);
+    std::cout << "Number of cells: " << grid.nCells << std::endl;
+
+    return 0;
+}
@@ -3,11 +3,15 @@ Creates a text file containing a list of "sources".
 Sources are defined as regions with density higher than rho0.
 This approach considers all cells, which may be biased due to the
  non uniformity of the grid. See GetListOfSources2 for another approach.
+The cells are read in a single scan, split in ranges of indices across threads.
 */
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstring>
+#include <climits>
+#include <cmath>
 
 #include "saga/AMRcell.h"
 #include "saga/AMRgrid.h"
@@ -16,6 +20,27 @@ This approach considers all cells, which may be biased due to the
 #include "saga/SQLiteInterface.h"
 #include "saga/Referenced.h"
 
+/*********************************************************************************************************/ 
+// Formats the cells denser than rho0 into a text buffer
+//
+class SourceWriter : public saga::AMRcellVisitor
+{
+public:
+    SourceWriter(double cl, double x0, double y0, double z0, double crho, double rho0) : cl(cl), x0(x0), y0(y0), z0(z0), crho(crho), rho0(rho0), nSources(0) {}
+    bool visitCell(saga::AMRcell &cell, saga::LocalProperties &lp)
+    {
+        double rho = lp.getDensity() * crho;
+        if (rho > rho0) {
+            buffer << cell.getXcenter() * cl + x0 << "\t" << cell.getYcenter() * cl + y0 << "\t" << cell.getZcenter() * cl + z0 << "\n";
+            nSources++;
+        }
+        return true;
+    }
+    double cl, x0, y0, z0, crho, rho0;
+    long nSources;
+    std::ostringstream buffer;
+};
+
 void Usage(std::string name)
 {
     std::cout << "USAGE" << std::endl;
@@ -57,16 +82,39 @@ int main(int argc, char** argv )
 
     int nCells = amr->getGridSize();
     std::cout << "Number of cells: " << nCells << std::endl;
-    for (int i=1; i<nCells; i++) {
-        saga::AMRcell cell = amr->getCellWithIndex(i);
-        double x = cell.getXcenter() * cl + x0;
-        double y = cell.getYcenter() * cl + y0;
-        double z = cell.getZcenter() * cl + z0;
-        // std::cout << i << " " << x << " " << y << " " << z << std::endl;
-        saga::LocalProperties lp = amr->getLocalPropertiesFromIndex(i);
-        double rho = lp.getDensity() * crho;
-        if (rho > rho0) fout << x << "\t" << y << "\t" << z << std::endl;
+
+    // the threshold is applied in the scan on the density in simulation units, slightly loosened so that
+    // no cell is lost to rounding; the exact test is done on the converted value, as before
+    double minDensity = -HUGE_VAL;
+    if (crho > 0)
+        minDensity = (rho0 / crho) - fabs(rho0 / crho) * 1e-12;
+
+    // cells are scanned in chunks of consecutive indices, one chunk per thread at a time; the output of
+    // each chunk is buffered and written in index order
+    const long chunkSize = 65536;
+    long nChunks = nCells / chunkSize + 1;
+    long nSources = 0;
+    std::string error;
+    #pragma omp parallel for ordered schedule(dynamic, 1) reduction(+:nSources)
+    for (long c=0; c<nChunks; c++) {
+        long first = (c == 0) ? LONG_MIN : c * chunkSize + 1;
+        long last = (c == nChunks - 1) ? LONG_MAX : (c + 1) * chunkSize;
+        SourceWriter writer(cl, x0, y0, z0, crho, rho0);
+        try {
+            amr->visitCellsIndexRange(first, last, minDensity, writer);
+        } catch (std::exception &e) {
+            #pragma omp critical(GetListOfSourcesError)
+            error = e.what();
+        }
+        nSources += writer.nSources;
+        #pragma omp ordered
+        fout << writer.buffer.str();
+    }
+    if (! error.empty()) {
+        std::cout << "Error: " << error << std::endl;
+        return 1;
     }
+    std::cout << "Number of sources: " << nSources << std::endl;
 
     fout.close();
 
@@ -2,11 +2,17 @@
 Creates a text file containing a list of "sources".
 Sources are defined as regions with density higher than rho0.
 This approach is based on sampling the grid in N parts..
+The samples are evaluated in tiles of T^3 points, in parallel: the cells of a tile are fetched with a
+ single region query, and tiles without any cell denser than rho0 are skipped without fetching them.
 */
 
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 
 #include "saga/AMRcell.h"
 #include "saga/AMRgrid.h"
@@ -15,6 +21,94 @@ This approach is based on sampling the grid in N parts..
 #include "saga/SQLiteInterface.h"
 #include "saga/Referenced.h"
 
+/*********************************************************************************************************/ 
+// Block of sample points evaluated together.
+// The cells of the region covered by the neighbourhoods of all points are streamed once; each cell updates
+// the points whose neighbourhood it overlaps, with the nearest-neighbour rule of AMRgrid (nearest centre,
+// ties to the lowest index), so every point gets the value getLocalProperties would return.
+//
+class Tile : public saga::AMRcellVisitor
+{
+public:
+    Tile(int n, double halfWidth, int i0, int i1, int j0, int j1, int k0, int k1) : i0(i0), i1(i1), j0(j0), j1(j1), k0(k0), k1(k1), N(n), h(halfWidth)
+    {
+        long size = (long) (i1 - i0) * (j1 - j0) * (k1 - k0);
+        distance.assign(size, HUGE_VAL);
+        index.assign(size, -1);
+        density.assign(size, 0);
+    }
+
+    void getRegion(double &xmin, double &xmax, double &ymin, double &ymax, double &zmin, double &zmax) const
+    {
+        xmin = coordinate(i0) - h;
+        xmax = coordinate(i1 - 1) + h;
+        ymin = coordinate(j0) - h;
+        ymax = coordinate(j1 - 1) + h;
+        zmin = coordinate(k0) - h;
+        zmax = coordinate(k1 - 1) + h;
+    }
+
+    bool visitCell(saga::AMRcell &cell, saga::LocalProperties &lp)
+    {
+        int ia, ib, ja, jb, ka, kb;
+        overlapping(cell.getXmin(), cell.getXmax(), i0, i1, ia, ib);
+        overlapping(cell.getYmin(), cell.getYmax(), j0, j1, ja, jb);
+        overlapping(cell.getZmin(), cell.getZmax(), k0, k1, ka, kb);
+        for (int i=ia; i<ib; i++) {
+            for (int j=ja; j<jb; j++) {
+                for (int k=ka; k<kb; k++) {
+                    long n = offset(i, j, k);
+                    double d = cell.distanceToPoint(coordinate(i), coordinate(j), coordinate(k));
+                    if (index[n] < 0 || d < distance[n] || (d == distance[n] && cell.getCellIndex() < index[n])) {
+                        distance[n] = d;
+                        index[n] = cell.getCellIndex();
+                        density[n] = lp.getDensity();
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    double getDensity(int i, int j, int k) const
+    {
+        long n = offset(i, j, k);
+        if (index[n] < 0)
+            throw std::runtime_error("No cell found around the requested position.");
+        return density[n];
+    }
+
+    const int i0, i1, j0, j1, k0, k1;
+
+private:
+    double coordinate(int i) const
+    {
+        return ((double)i + 0.5) / N;
+    }
+
+    long offset(int i, int j, int k) const
+    {
+        return ((long) (i - i0) * (j1 - j0) + (j - j0)) * (k1 - k0) + (k - k0);
+    }
+
+    // range [a, b) of the points of [lo, hi) whose neighbourhood overlaps [cmin, cmax] (boundaries included)
+    void overlapping(double cmin, double cmax, int lo, int hi, int &a, int &b) const
+    {
+        a = std::max(lo, (int) floor((cmin - h) * N - 0.5) - 1);
+        while (a < hi && coordinate(a) + h < cmin)
+            a++;
+        b = a;
+        while (b < hi && coordinate(b) - h <= cmax)
+            b++;
+    }
+
+    int N;
+    double h;
+    std::vector<double> distance;
+    std::vector<int> index;
+    std::vector<double> density;
+};
+
 void Usage(std::string name)
 {
     std::cout << "USAGE" << std::endl;
@@ -28,12 +122,13 @@ void Usage(std::string name)
     std::cout << "  arg 7: box origin z-coordinate [use 0 for grid units]" << std::endl;
     std::cout << "  arg 8: conversion factor density" << std::endl;
     std::cout << "  arg 9: number of samples (in each dimension)" << std::endl;
+    std::cout << "  arg 10: number of samples per tile (in each dimension) [optional; default=16]" << std::endl;
 }
 
 int main(int argc, char** argv )
 {
 
-    if(argc != 10)
+    if(argc != 10 && argc != 11)
     {
         Usage(argv[0]);
         return -1;
@@ -47,6 +142,11 @@ int main(int argc, char** argv )
     double z0 = atof(argv[7]);
     double crho = atof(argv[8]);
     int N = atoi(argv[9]);
+    int T = (argc == 11) ? atoi(argv[10]) : 16;
+    if (N <= 0 || T <= 0) {
+        Usage(argv[0]);
+        return -1;
+    }
 
     std::cout << "Input file: " << filename << std::endl;
     saga::ref_ptr<saga::AMRgrid> amr = new saga::AMRgrid(filename, 10);
@@ -57,23 +157,66 @@ int main(int argc, char** argv )
     std::ofstream fout(outputfile.c_str());
 
     std::cout << "Number of sampled points: " << N << "^3." << std::endl;
+    std::cout << "Tile size: " << T << "^3 points." << std::endl;
+
+    // same neighbourhood as AMRgrid::getLocalProperties
+    double h = 0.5 * amr->getMinCellSize();
+    double minDensity = -HUGE_VAL;
+    if (crho > 0)
+        minDensity = (rho0 / crho) - fabs(rho0 / crho) * 1e-12;
+
+    // tiles are processed one slab of T values of i at a time, so that the output keeps its i,j,k order
+    int nTiles = (N + T - 1) / T;
+    long nSkipped = 0;
+    std::string error;
+    for (int ti=0; ti<nTiles; ti++) {
+        int i0 = ti * T;
+        int i1 = std::min(N, i0 + T);
+        std::vector<char> dense((long) (i1 - i0) * N * N, 0);
+
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:nSkipped)
+        for (int t=0; t<nTiles*nTiles; t++) {
+            try {
+                Tile tile(N, h, i0, i1, (t / nTiles) * T, std::min(N, (t / nTiles) * T + T), (t % nTiles) * T, std::min(N, (t % nTiles) * T + T));
+                double xmin, xmax, ymin, ymax, zmin, zmax;
+                tile.getRegion(xmin, xmax, ymin, ymax, zmin, zmax);
+                if (! amr->hasDensityAbove(xmin, xmax, ymin, ymax, zmin, zmax, minDensity)) {
+                    nSkipped++;
+                    continue;
+                }
+                amr->visitCellsRegion(xmin, xmax, ymin, ymax, zmin, zmax, tile);
+                for (int i=tile.i0; i<tile.i1; i++)
+                    for (int j=tile.j0; j<tile.j1; j++)
+                        for (int k=tile.k0; k<tile.k1; k++)
+                            dense[((long) (i - i0) * N + j) * N + k] = tile.getDensity(i, j, k) * crho > rho0;
+            } catch (std::exception &e) {
+                #pragma omp critical(GetListOfSources2Error)
+                error = e.what();
+            }
+        }
+        if (! error.empty()) {
+            std::cout << "Error: " << error << std::endl;
+            return 1;
+        }
 
-    for (int i=0; i<N; i++) {
-        for (int j=0; j<N; j++) {
-            for (int k=0; k<N; k++) {
-                double x = ((double)i + 0.5) / N;
-                double y = ((double)j + 0.5) / N;
-                double z = ((double)k + 0.5) / N;
-                saga::LocalProperties lp = amr->getLocalProperties(x, y, z);
-                double rho = lp.getDensity() * crho;
-                x = x * cl + x0;
-                y = y * cl + y0;
-                z = z * cl + z0;
-                if (rho > rho0) 
-                    fout << x << "\t" << y << "\t" << z << std::endl;
+        for (int i=i0; i<i1; i++) {
+            for (int j=0; j<N; j++) {
+                for (int k=0; k<N; k++) {
+                    if (! dense[((long) (i - i0) * N + j) * N + k])
+                        continue;
+                    double x = ((double)i + 0.5) / N;
+                    double y = ((double)j + 0.5) / N;
+                    double z = ((double)k + 0.5) / N;
+                    x = x * cl + x0;
+                    y = y * cl + y0;
+                    z = z * cl + z0;
+                    fout << x << "\t" << y << "\t" << z << "\n";
+                }
             }
         }
+        std::cout << "Progress: " << (ti + 1) * 100 / nTiles << "%" << std::endl;
     }
+    std::cout << "Tiles skipped: " << nSkipped << " of " << (long) nTiles * nTiles * nTiles << std::endl;
 
     fout.close();
 
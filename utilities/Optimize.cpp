@@ -0,0 +1,167 @@
+/*
+Rewrites a SAGA database for faster region queries.
+The cells are renumbered along the Hilbert curve of their centres, so that
+ cells close in space are stored close in the file, and the R-tree is packed
+ bottom-up (see PackedRtree) instead of being grown by inserts. The schema is
+ unchanged and AMRgrid reads the output as any SAGA database; only the cell
+ indices change.
+*/
+
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "saga/Morton.h"
+#include "saga/PackedRtree.h"
+
+void Usage(std::string name)
+{
+    std::cout << "USAGE" << std::endl;
+    std::cout << "./" << name << " <input_SQL_file> <output_SQL_file>" <<  std::endl;
+    std::cout << "  arg 1: path to SQL file containing the magnetic field and density" << std::endl;
+    std::cout << "  arg 2: name of the optimised SQL file (overwritten)" << std::endl;
+}
+
+struct CellBox
+{
+    uint64_t key;
+    sqlite3_int64 id;
+    double box[6];
+
+    bool operator<(const CellBox &c) const
+    {
+        return key < c.key || (key == c.key && id < c.id);
+    }
+};
+
+static bool execute(sqlite3 *db, std::string sql)
+{
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+        std::cout << "SQL error: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv )
+{
+
+    if(argc != 3)
+    {
+        Usage(argv[0]);
+        return -1;
+    }
+    std::string filename = argv[1];
+    std::string outputfile = argv[2];
+    if (filename == outputfile) {
+        Usage(argv[0]);
+        return -1;
+    }
+
+    std::cout << "Input file: " << filename << std::endl;
+    remove(outputfile.c_str());
+    sqlite3 *db;
+    if (sqlite3_open(outputfile.c_str(), &db) != SQLITE_OK) {
+        std::cout << "Cannot create " << outputfile << std::endl;
+        return 1;
+    }
+    char *attach = sqlite3_mprintf("ATTACH DATABASE %Q AS source;", filename.c_str());
+    bool attached = execute(db, attach);
+    sqlite3_free(attach);
+    if (! attached || ! execute(db, "PRAGMA main.journal_mode=OFF; PRAGMA main.synchronous=OFF;"))
+        return 1;
+
+    // same table of cells, and the names of its columns
+    sqlite3_stmt *statement;
+    std::string createCell, columns, sourceColumns;
+    sqlite3_prepare_v2(db, "SELECT sql FROM source.sqlite_master WHERE type = 'table' AND name = 'Cell';", -1, &statement, NULL);
+    if (sqlite3_step(statement) == SQLITE_ROW)
+        createCell = (const char*) sqlite3_column_text(statement, 0);
+    sqlite3_finalize(statement);
+    if (createCell.empty()) {
+        std::cout << "No table Cell in " << filename << std::endl;
+        return 1;
+    }
+    sqlite3_prepare_v2(db, "PRAGMA source.table_info(Cell);", -1, &statement, NULL);
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        std::string name = std::string("\"") + (const char*) sqlite3_column_text(statement, 1) + "\"";
+        columns += ", " + name;
+        sourceColumns += ", c." + name;
+    }
+    sqlite3_finalize(statement);
+    sqlite3_prepare_v2(db, "SELECT name FROM source.sqlite_master WHERE type = 'table' AND name != 'Cell' AND name NOT LIKE 'Cell\\_tree%' ESCAPE '\\' AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\';", -1, &statement, NULL);
+    while (sqlite3_step(statement) == SQLITE_ROW)
+        std::cout << "Table " << sqlite3_column_text(statement, 0) << " is not copied" << std::endl;
+    sqlite3_finalize(statement);
+
+    // cells in the Hilbert order of their centres
+    std::vector<CellBox> cells;
+    if (sqlite3_prepare_v2(db, "SELECT id, minX, maxX, minY, maxY, minZ, maxZ FROM source.Cell_tree;", -1, &statement, NULL) != SQLITE_OK) {
+        std::cout << "SQL error: " << sqlite3_errmsg(db) << std::endl;
+        return 1;
+    }
+    int result;
+    while ((result = sqlite3_step(statement)) == SQLITE_ROW) {
+        CellBox c;
+        c.id = sqlite3_column_int64(statement, 0);
+        for (int k=0; k<6; k++)
+            c.box[k] = sqlite3_column_double(statement, k + 1);
+        c.key = saga::hilbertEncode(saga::hilbertCoordinate(0.5 * (c.box[0] + c.box[1])), saga::hilbertCoordinate(0.5 * (c.box[2] + c.box[3])), saga::hilbertCoordinate(0.5 * (c.box[4] + c.box[5])));
+        cells.push_back(c);
+    }
+    sqlite3_finalize(statement);
+    if (result != SQLITE_DONE) {
+        std::cout << "SQL error: " << sqlite3_errmsg(db) << std::endl;
+        return 1;
+    }
+    std::sort(cells.begin(), cells.end());
+    std::cout << "Number of cells: " << cells.size() << std::endl;
+
+    // rows of the cells copied in that order, with new indices
+    if (! execute(db, createCell) || ! execute(db, "CREATE TEMP TABLE Reorder(newid INTEGER PRIMARY KEY, oldid INTEGER);") || ! execute(db, "BEGIN;"))
+        return 1;
+    if (sqlite3_prepare_v2(db, "INSERT INTO temp.Reorder VALUES (?1, ?2);", -1, &statement, NULL) != SQLITE_OK) {
+        std::cout << "SQL error: " << sqlite3_errmsg(db) << std::endl;
+        return 1;
+    }
+    for (size_t i=0; i<cells.size(); i++) {
+        sqlite3_bind_int64(statement, 1, i + 1);
+        sqlite3_bind_int64(statement, 2, cells[i].id);
+        if (sqlite3_step(statement) != SQLITE_DONE) {
+            std::cout << "SQL error: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_finalize(statement);
+            return 1;
+        }
+        sqlite3_reset(statement);
+    }
+    sqlite3_finalize(statement);
+    if (! execute(db, "INSERT INTO main.Cell(rowid" + columns + ") SELECT r.newid" + sourceColumns + " FROM temp.Reorder AS r JOIN source.Cell AS c ON c.rowid = r.oldid ORDER BY r.newid;"))
+        return 1;
+    if (sqlite3_changes(db) != (int) cells.size()) {
+        std::cout << "The tables Cell and Cell_tree of " << filename << " do not hold the same cells" << std::endl;
+        return 1;
+    }
+
+    saga::PackedRtree tree;
+    tree.reserve(cells.size());
+    for (size_t i=0; i<cells.size(); i++) {
+        const double *b = cells[i].box;
+        tree.add(i + 1, b[0], b[1], b[2], b[3], b[4], b[5]);
+    }
+    try {
+        tree.write(db, "Cell_tree");
+    } catch (std::runtime_error &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+    if (! execute(db, "COMMIT;") || ! execute(db, "DETACH DATABASE source;"))
+        return 1;
+    sqlite3_close(db);
+
+    std::cout << "Output file: " << outputfile << std::endl;
+    std::cout << "R-tree nodes: " << tree.getNumberOfNodes() << ", depth: " << tree.getDepth() << std::endl;
+
+    return 0;
+}
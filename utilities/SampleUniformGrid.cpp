@@ -1,11 +1,16 @@
 /*
 Creates uniform grids (binary files) containing the magnetic field and the 
  density, for a given number of sampling points.
+The grid is sampled in parallel, one slab of constant x per thread at a time.
 */
 
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <atomic>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "saga/AMRcell.h"
 #include "saga/AMRgrid.h"
@@ -27,6 +32,22 @@ void Usage(std::string name)
     std::cout << "  * if arg5 or arg6 is provided, the other one must also be" << std::endl;
 }
 
+/*********************************************************************************************************/ 
+// Writes a buffer at a given offset of a file, looping over partial writes
+//
+void writeAll(int fd, const void *buffer, size_t size, off_t offset)
+{
+    const char *p = (const char*) buffer;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, p, size, offset);
+        if (written <= 0)
+            throw std::runtime_error("Failed to write the output file.");
+        p += written;
+        size -= written;
+        offset += written;
+    }
+}
+
 int main(int argc, char** argv )
 {
 
@@ -53,31 +74,60 @@ int main(int argc, char** argv )
     std::cout << "The AMR grid will be uniformly sampled in " << sz << "^3 points." << std::endl;
     std::cout << "Output file (B field): " << outputfile1 << std::endl;
     std::cout << "Output file (density): " << outputfile2 << std::endl;
-    std::ofstream fout1(outputfile1.c_str(), std::ios::binary);
-    std::ofstream fout2(outputfile2.c_str(), std::ios::binary);
+    int fd1 = open(outputfile1.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int fd2 = open(outputfile2.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd1 < 0 || fd2 < 0) {
+        std::cout << "Cannot create the output files." << std::endl;
+        return 1;
+    }
 
+    // each slab (fixed x) is sampled by one thread and written at its own offset, so slabs can be
+    // completed in any order
+    const long slabPoints = (long) sz * sz;
+    std::atomic<int> nDone(0);
+    std::string error;
+    #pragma omp parallel
+    {
+        std::vector<float> slabB(3 * slabPoints);
+        std::vector<float> slabRho(slabPoints);
 
-    for(int i=0; i<sz; i++) {
-        for(int j=0; j<sz; j++) {
-            for(int k=0; k<sz; k++) {
+        #pragma omp for schedule(dynamic, 1)
+        for(int i=0; i<sz; i++) {
+            try {
                 double x = ((double)i ) / sz;
-                double y = ((double)j ) / sz;
-                double z = ((double)k ) / sz;
-                saga::LocalProperties lp = amr->getLocalProperties(x, y, z);
-                float Bx = lp.getBx() * convB;
-                float By = lp.getBy() * convB;
-                float Bz = lp.getBz() * convB;
-                float rho = lp.getDensity() * convRho;
-                fout1.write((char*) &Bx, sizeof(float));
-                fout1.write((char*) &By, sizeof(float));
-                fout1.write((char*) &Bz, sizeof(float));
-                fout2.write((char*) &rho, sizeof(float));
+                for(int j=0; j<sz; j++) {
+                    double y = ((double)j ) / sz;
+                    for(int k=0; k<sz; k++) {
+                        double z = ((double)k ) / sz;
+                        saga::LocalProperties lp = amr->getLocalProperties(x, y, z);
+                        long n = (long) j * sz + k;
+                        slabB[3 * n] = lp.getBx() * convB;
+                        slabB[3 * n + 1] = lp.getBy() * convB;
+                        slabB[3 * n + 2] = lp.getBz() * convB;
+                        slabRho[n] = lp.getDensity() * convRho;
+                    }
+                }
+                writeAll(fd1, &slabB[0], 3 * slabPoints * sizeof(float), (off_t) i * 3 * slabPoints * sizeof(float));
+                writeAll(fd2, &slabRho[0], slabPoints * sizeof(float), (off_t) i * slabPoints * sizeof(float));
+            } catch (std::exception &e) {
+                #pragma omp critical(SampleUniformGridError)
+                error = e.what();
+            }
+
+            int done = ++nDone;
+            if (done * 100 / sz != (done - 1) * 100 / sz) {
+                #pragma omp critical(SampleUniformGridProgress)
+                std::cout << "Progress: " << done * 100 / sz << "% (" << done << "/" << sz << " slabs)" << std::endl;
             }
         }
     }
+    close(fd1);
+    close(fd2);
+    if (! error.empty()) {
+        std::cout << "Error: " << error << std::endl;
+        return 1;
+    }
     std::cout << "Files written" << std::endl;
-    fout1.close();
-    fout2.close();
 
     return 0;
 }
\ No newline at end of file